@@ -0,0 +1,1043 @@
+/*
+ * bench.c --
+ *
+ *      Micro-benchmark of the driver's row paths.  mysql.c is linked
+ *      against the stand-ins below for the parts of AOLserver and
+ *      libmysqlclient it calls, and its procs are driven through the
+ *      table it registers, the way nsdb drives them, over synthetic
+ *      results of several shapes.  The cached path reads the same
+ *      results through [ns_mysql cached_select] and checks every value
+ *      it returns, which covers the query cache's copy of a result with
+ *      more columns than tables.  Nothing here talks to a server, so
+ *      the numbers are the driver's own cost per row plus that of the
+ *      Ns_Set calls it makes.
+ *
+ *      Usage: bench ?shape ...?
+ *
+ *      For each shape and path this prints ns/row, ns_malloc family
+ *      allocations per row and rows/sec.
+ */
+
+#include "ns.h"
+#include "nsdb.h"
+#include <mysql.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <sys/time.h>
+
+extern int      Ns_DbDriverInit(char *hDriver, char *configPath);
+
+/*
+ * A synthetic result: every row is the same, numcols values of length
+ * bytes each, of which nullpct percent are NULL.  A run sends queries
+ * queries of rows rows each.
+ */
+
+typedef struct Shape {
+    char           *name;
+    unsigned int    numcols;
+    unsigned long   length;
+    int             nullpct;
+    unsigned long   rows;
+    int             queries;
+    MYSQL_FIELD    *fields;
+    MYSQL_ROW       row;
+    unsigned long  *lengths;
+} Shape;
+
+static Shape    shapes[] = {
+    { "narrow",  4,    8,  0, 100000,     10 },
+    { "wide",   64,    8,  0,  10000,     10 },
+    { "long",    4, 2048,  0,  20000,     10 },
+    { "nulls",  16,    8, 90,  50000,     10 },
+    { "single",  8,   16,  0,      1, 200000 },
+    { NULL }
+};
+
+struct MYSQL_RES {
+    Shape          *shape;
+    unsigned long   next;
+};
+
+static Shape   *shape;                  /* Shape results are made of. */
+static unsigned int fieldCount;         /* Of the last query. */
+static unsigned long allocs;            /* ns_malloc family calls. */
+static Ns_DbProc *driverProcs;
+static int      (*interpInit) (Tcl_Interp *, void *);
+static Ns_DbHandle *tclHandle;          /* What every handle id names. */
+
+/*
+ *----------------------------------------------------------------------
+ * Memory, counted.  An ns_realloc counts when it has to move or
+ * create the block, which is what the driver's value reuse avoids.
+ *----------------------------------------------------------------------
+ */
+
+void *
+ns_malloc(size_t size)
+{
+    allocs++;
+    return malloc(size);
+}
+
+void *
+ns_calloc(size_t num, size_t size)
+{
+    allocs++;
+    return calloc(num, size);
+}
+
+void *
+ns_realloc(void *ptr, size_t size)
+{
+    void           *new = realloc(ptr, size);
+
+    if (new != ptr) {
+        allocs++;
+    }
+    return new;
+}
+
+void
+ns_free(void *ptr)
+{
+    free(ptr);
+}
+
+char *
+ns_strdup(const char *str)
+{
+    char           *new = ns_malloc(strlen(str) + 1);
+
+    return strcpy(new, str);
+}
+
+/*
+ *----------------------------------------------------------------------
+ * Ns_Set and Ns_DString, as in AOLserver.
+ *----------------------------------------------------------------------
+ */
+
+Ns_Set *
+Ns_SetCreate(char *name)
+{
+    Ns_Set         *set = ns_malloc(sizeof(Ns_Set));
+
+    set->name = name != NULL ? ns_strdup(name) : NULL;
+    set->size = 0;
+    set->maxSize = 10;
+    set->fields = ns_malloc(set->maxSize * sizeof(Ns_SetField));
+    return set;
+}
+
+void
+Ns_SetFree(Ns_Set *set)
+{
+    Ns_SetTrunc(set, 0);
+    ns_free(set->fields);
+    ns_free(set->name);
+    ns_free(set);
+}
+
+int
+Ns_SetPut(Ns_Set *set, char *key, char *value)
+{
+    int             index = set->size;
+
+    if (set->size >= set->maxSize) {
+        set->maxSize = set->size * 2;
+        set->fields = ns_realloc(set->fields,
+                                 set->maxSize * sizeof(Ns_SetField));
+    }
+    set->fields[index].name = ns_strdup(key);
+    set->fields[index].value = value != NULL ? ns_strdup(value) : NULL;
+    set->size++;
+    return index;
+}
+
+void
+Ns_SetTrunc(Ns_Set *set, int size)
+{
+    int             i;
+
+    for (i = size; i < set->size; i++) {
+        ns_free(set->fields[i].name);
+        ns_free(set->fields[i].value);
+    }
+    if (size < set->size) {
+        set->size = size;
+    }
+}
+
+char *
+Ns_DStringVarAppend(Ns_DString *dsPtr, ...)
+{
+    va_list         ap;
+    char           *s;
+
+    va_start(ap, dsPtr);
+    while ((s = va_arg(ap, char *)) != NULL) {
+        Tcl_DStringAppend(dsPtr, s, -1);
+    }
+    va_end(ap);
+    return Ns_DStringValue(dsPtr);
+}
+
+/*
+ *----------------------------------------------------------------------
+ * The rest of AOLserver: a config in which only the "streaming" pool
+ * streams, and no server.
+ *----------------------------------------------------------------------
+ */
+
+void
+Ns_Log(Ns_LogSeverity severity, char *fmt, ...)
+{
+    va_list         ap;
+
+    if (severity == Error || severity == Fatal || severity == Bug) {
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+        fputc('\n', stderr);
+    }
+}
+
+char *
+Ns_ConfigGetPath(char *server, char *module, ...)
+{
+    Tcl_DString     ds;
+    va_list         ap;
+    char           *s, *path;
+
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, "ns", 2);
+    va_start(ap, module);
+    while ((s = va_arg(ap, char *)) != NULL) {
+        Tcl_DStringAppend(&ds, "/", 1);
+        Tcl_DStringAppend(&ds, s, -1);
+    }
+    va_end(ap);
+    path = strdup(Tcl_DStringValue(&ds));
+    Tcl_DStringFree(&ds);
+    return path;
+}
+
+char *
+Ns_ConfigGetValue(char *section, char *key)
+{
+    return NULL;
+}
+
+int
+Ns_ConfigGetInt(char *section, char *key, int *valuePtr)
+{
+    return NS_FALSE;
+}
+
+int
+Ns_ConfigGetBool(char *section, char *key, int *valuePtr)
+{
+    if (STREQ(key, "streaming") && strstr(section, "streaming") != NULL) {
+        *valuePtr = NS_TRUE;
+        return NS_TRUE;
+    }
+    return NS_FALSE;
+}
+
+void
+Ns_MutexLock(Ns_Mutex *mutexPtr)
+{
+}
+
+void
+Ns_MutexUnlock(Ns_Mutex *mutexPtr)
+{
+}
+
+/*
+ * The benchmark is single threaded and never enqueues, so the writer
+ * thread is never started.
+ */
+
+void
+Ns_CondBroadcast(Ns_Cond *condPtr)
+{
+}
+
+void
+Ns_CondWait(Ns_Cond *condPtr, Ns_Mutex *mutexPtr)
+{
+}
+
+int
+Ns_CondTimedWait(Ns_Cond *condPtr, Ns_Mutex *mutexPtr, Ns_Time *timePtr)
+{
+    return NS_TIMEOUT;
+}
+
+void
+Ns_ThreadCreate(Ns_ThreadProc *proc, void *arg, long stackSize,
+                Ns_Thread *threadPtr)
+{
+}
+
+void
+Ns_ThreadJoin(Ns_Thread *threadPtr, void **argPtr)
+{
+}
+
+void
+Ns_GetTime(Ns_Time *timePtr)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    timePtr->sec = tv.tv_sec;
+    timePtr->usec = tv.tv_usec;
+}
+
+void
+Ns_IncrTime(Ns_Time *timePtr, time_t sec, long usec)
+{
+    timePtr->usec += usec;
+    timePtr->sec += sec + timePtr->usec / 1000000;
+    timePtr->usec %= 1000000;
+}
+
+int
+Ns_DiffTime(Ns_Time *t1, Ns_Time *t0, Ns_Time *diffPtr)
+{
+    Ns_Time         diff;
+
+    diff.sec = t1->sec - t0->sec;
+    diff.usec = t1->usec - t0->usec;
+    if (diff.usec < 0) {
+        diff.sec--;
+        diff.usec += 1000000;
+    }
+    if (diffPtr != NULL) {
+        *diffPtr = diff;
+    }
+    return diff.sec < 0 ? -1 : (diff.sec == 0 && diff.usec == 0) ? 0 : 1;
+}
+
+int
+Ns_TclInitInterps(char *server, int (*proc) (Tcl_Interp *, void *),
+                  void *arg)
+{
+    interpInit = proc;
+    return NS_OK;
+}
+
+int
+Ns_TclEnterSet(Tcl_Interp *interp, Ns_Set *set, int flags)
+{
+    return TCL_OK;
+}
+
+void *
+Ns_RegisterAtStartup(Ns_Callback *proc, void *arg)
+{
+    return NULL;
+}
+
+void *
+Ns_RegisterAtShutdown(Ns_Callback *proc, void *arg)
+{
+    return NULL;
+}
+
+int
+Ns_ScheduleProc(Ns_SchedProc *proc, void *arg, int thread, int interval)
+{
+    return 0;
+}
+
+Ns_Conn *
+Ns_TclGetConn(Tcl_Interp *interp)
+{
+    return NULL;
+}
+
+int
+Ns_ConnWrite(Ns_Conn *conn, void *buf, int towrite)
+{
+    return -1;
+}
+
+int
+Ns_ConnFlushHeaders(Ns_Conn *conn, int status)
+{
+    return NS_ERROR;
+}
+
+void
+Ns_ConnSetRequiredHeaders(Ns_Conn *conn, char *type, int length)
+{
+}
+
+int
+Ns_DbRegisterDriver(char *driver, Ns_DbProc *procs)
+{
+    driverProcs = procs;
+    return NS_OK;
+}
+
+char *
+Ns_DbDriverName(Ns_DbHandle *handle)
+{
+    Ns_DbProc      *procPtr;
+
+    for (procPtr = driverProcs; procPtr->func != NULL; procPtr++) {
+        if (procPtr->id == DbFn_Name) {
+            return (*(char *(*) (void)) procPtr->func) ();
+        }
+    }
+    return NULL;
+}
+
+char *
+Ns_DbPoolList(char *server)
+{
+    return NULL;
+}
+
+int
+Ns_DbPoolTimedGetMultipleHandles(Ns_DbHandle **handles, char *pool,
+                                 int nwant, int wait)
+{
+    return NS_TIMEOUT;
+}
+
+void
+Ns_DbPoolPutHandle(Ns_DbHandle *handle)
+{
+}
+
+int
+Ns_TclDbGetHandle(Tcl_Interp *interp, char *handleId, Ns_DbHandle **handle)
+{
+    if (tclHandle == NULL) {
+        return TCL_ERROR;
+    }
+    *handle = tclHandle;
+    return TCL_OK;
+}
+
+/*
+ *----------------------------------------------------------------------
+ * libmysqlclient: every query succeeds, one that starts with "select"
+ * returns a result of the current shape and any other affects a row.
+ *----------------------------------------------------------------------
+ */
+
+MYSQL *
+mysql_init(MYSQL *mysql)
+{
+    mysql = calloc(1, sizeof(MYSQL));
+    mysql->server_status = SERVER_STATUS_AUTOCOMMIT;
+    return mysql;
+}
+
+int
+mysql_options(MYSQL *mysql, enum mysql_option option, const void *arg)
+{
+    return 0;
+}
+
+MYSQL *
+mysql_real_connect(MYSQL *mysql, const char *host, const char *user,
+                   const char *passwd, const char *db, unsigned int port,
+                   const char *unix_socket, unsigned long clientflag)
+{
+    return mysql;
+}
+
+void
+mysql_close(MYSQL *mysql)
+{
+    free(mysql);
+}
+
+int
+mysql_ping(MYSQL *mysql)
+{
+    return 0;
+}
+
+unsigned long
+mysql_thread_id(MYSQL *mysql)
+{
+    return 1;
+}
+
+int
+mysql_select_db(MYSQL *mysql, const char *db)
+{
+    return 0;
+}
+
+const char *
+mysql_get_server_info(MYSQL *mysql)
+{
+    return "bench";
+}
+
+const char *
+mysql_character_set_name(MYSQL *mysql)
+{
+    return "utf8mb4";
+}
+
+bool
+mysql_thread_init(void)
+{
+    return 0;
+}
+
+void
+mysql_thread_end(void)
+{
+}
+
+void
+my_thread_end(void)
+{
+}
+
+int
+mysql_real_query(MYSQL *mysql, const char *q, unsigned long length)
+{
+    fieldCount = strncasecmp(q, "select", 6) == 0 ? shape->numcols : 0;
+    return 0;
+}
+
+int
+mysql_query(MYSQL *mysql, const char *q)
+{
+    return mysql_real_query(mysql, q, strlen(q));
+}
+
+int
+mysql_send_query(MYSQL *mysql, const char *q, unsigned long length)
+{
+    return mysql_real_query(mysql, q, length);
+}
+
+int
+mysql_read_query_result(MYSQL *mysql)
+{
+    return 0;
+}
+
+MYSQL_RES *
+mysql_store_result(MYSQL *mysql)
+{
+    MYSQL_RES      *result;
+
+    if (fieldCount == 0) {
+        return NULL;
+    }
+    result = malloc(sizeof(MYSQL_RES));
+    result->shape = shape;
+    result->next = 0;
+    return result;
+}
+
+MYSQL_RES *
+mysql_use_result(MYSQL *mysql)
+{
+    return mysql_store_result(mysql);
+}
+
+bool
+mysql_more_results(MYSQL *mysql)
+{
+    return 0;
+}
+
+int
+mysql_next_result(MYSQL *mysql)
+{
+    return -1;
+}
+
+unsigned int
+mysql_field_count(MYSQL *mysql)
+{
+    return fieldCount;
+}
+
+my_ulonglong
+mysql_affected_rows(MYSQL *mysql)
+{
+    return fieldCount == 0 ? 1 : (my_ulonglong) shape->rows;
+}
+
+unsigned int
+mysql_warning_count(MYSQL *mysql)
+{
+    return 0;
+}
+
+unsigned int
+mysql_errno(MYSQL *mysql)
+{
+    return 0;
+}
+
+const char *
+mysql_error(MYSQL *mysql)
+{
+    return "";
+}
+
+MYSQL_RES *
+mysql_list_dbs(MYSQL *mysql, const char *wild)
+{
+    return NULL;
+}
+
+MYSQL_RES *
+mysql_list_tables(MYSQL *mysql, const char *wild)
+{
+    return NULL;
+}
+
+unsigned long
+mysql_real_escape_string(MYSQL *mysql, char *to, const char *from,
+                         unsigned long length)
+{
+    char           *start = to;
+
+    while (length-- > 0) {
+        if (*from == '\'' || *from == '\\') {
+            *to++ = '\\';
+        }
+        *to++ = *from++;
+    }
+    *to = '\0';
+    return (unsigned long) (to - start);
+}
+
+unsigned long
+mysql_real_escape_string_quote(MYSQL *mysql, char *to, const char *from,
+                               unsigned long length, char quote)
+{
+    return mysql_real_escape_string(mysql, to, from, length);
+}
+
+void
+mysql_set_local_infile_handler(MYSQL *mysql,
+    int (*local_infile_init) (void **, const char *, void *),
+    int (*local_infile_read) (void *, char *, unsigned int),
+    void (*local_infile_end) (void *),
+    int (*local_infile_error) (void *, char *, unsigned int),
+    void *userdata)
+{
+}
+
+void
+mysql_set_local_infile_default(MYSQL *mysql)
+{
+}
+
+MYSQL_ROW
+mysql_fetch_row(MYSQL_RES *result)
+{
+    if (result->next >= result->shape->rows) {
+        return NULL;
+    }
+    result->next++;
+    return result->shape->row;
+}
+
+unsigned long *
+mysql_fetch_lengths(MYSQL_RES *result)
+{
+    return result->shape->lengths;
+}
+
+MYSQL_FIELD *
+mysql_fetch_fields(MYSQL_RES *result)
+{
+    return result->shape->fields;
+}
+
+unsigned int
+mysql_num_fields(MYSQL_RES *result)
+{
+    return result->shape->numcols;
+}
+
+my_ulonglong
+mysql_num_rows(MYSQL_RES *result)
+{
+    return (my_ulonglong) result->shape->rows;
+}
+
+void
+mysql_data_seek(MYSQL_RES *result, my_ulonglong offset)
+{
+    result->next = (unsigned long) offset;
+}
+
+void
+mysql_free_result(MYSQL_RES *result)
+{
+    free(result);
+}
+
+/*
+ * Prepared statements are not part of the benchmark.
+ */
+
+MYSQL_STMT *
+mysql_stmt_init(MYSQL *mysql)
+{
+    return NULL;
+}
+
+int
+mysql_stmt_prepare(MYSQL_STMT *stmt, const char *query, unsigned long length)
+{
+    return 1;
+}
+
+unsigned long
+mysql_stmt_param_count(MYSQL_STMT *stmt)
+{
+    return 0;
+}
+
+bool
+mysql_stmt_bind_param(MYSQL_STMT *stmt, MYSQL_BIND *bnd)
+{
+    return 1;
+}
+
+bool
+mysql_stmt_bind_result(MYSQL_STMT *stmt, MYSQL_BIND *bnd)
+{
+    return 1;
+}
+
+int
+mysql_stmt_execute(MYSQL_STMT *stmt)
+{
+    return 1;
+}
+
+bool
+mysql_stmt_send_long_data(MYSQL_STMT *stmt, unsigned int param_number,
+                          const char *data, unsigned long length)
+{
+    return 1;
+}
+
+int
+mysql_stmt_store_result(MYSQL_STMT *stmt)
+{
+    return 1;
+}
+
+int
+mysql_stmt_fetch(MYSQL_STMT *stmt)
+{
+    return MYSQL_NO_DATA;
+}
+
+int
+mysql_stmt_fetch_column(MYSQL_STMT *stmt, MYSQL_BIND *bind,
+                        unsigned int column, unsigned long offset)
+{
+    return 1;
+}
+
+MYSQL_RES *
+mysql_stmt_result_metadata(MYSQL_STMT *stmt)
+{
+    return NULL;
+}
+
+my_ulonglong
+mysql_stmt_affected_rows(MYSQL_STMT *stmt)
+{
+    return 0;
+}
+
+my_ulonglong
+mysql_stmt_num_rows(MYSQL_STMT *stmt)
+{
+    return 0;
+}
+
+bool
+mysql_stmt_free_result(MYSQL_STMT *stmt)
+{
+    return 0;
+}
+
+bool
+mysql_stmt_close(MYSQL_STMT *stmt)
+{
+    return 0;
+}
+
+unsigned int
+mysql_stmt_errno(MYSQL_STMT *stmt)
+{
+    return 0;
+}
+
+const char *
+mysql_stmt_error(MYSQL_STMT *stmt)
+{
+    return "";
+}
+
+/*
+ *----------------------------------------------------------------------
+ * The benchmark.
+ *----------------------------------------------------------------------
+ */
+
+/*
+ * BuildShape - Make the column descriptions and the row a shape's
+ * results return.
+ */
+
+static void
+BuildShape(Shape *s)
+{
+    unsigned int    i;
+    char            buf[32];
+
+    s->fields = calloc(s->numcols, sizeof(MYSQL_FIELD));
+    s->row = calloc(s->numcols, sizeof(char *));
+    s->lengths = calloc(s->numcols, sizeof(unsigned long));
+    for (i = 0; i < s->numcols; i++) {
+        sprintf(buf, "column_%u", i);
+        s->fields[i].name = strdup(buf);
+        s->fields[i].name_length = strlen(buf);
+        s->fields[i].org_table = s->fields[i].table = "bench";
+        s->fields[i].table_length = 5;
+        s->fields[i].type = MYSQL_TYPE_VAR_STRING;
+        s->fields[i].charsetnr = 33;
+        if ((int) (i % 10) * 10 < s->nullpct) {
+            continue;
+        }
+        s->row[i] = malloc(s->length + 1);
+        memset(s->row[i], 'x', s->length);
+        s->row[i][s->length] = '\0';
+        s->lengths[i] = s->length;
+    }
+}
+
+/*
+ * Run - Send a shape's queries through [ns_db select] or [ns_db exec]
+ * and read every row with [ns_db getrow], returning the rows read.
+ */
+
+static unsigned long
+Run(Ns_DbHandle *handle, Shape *s, int exec, int queries)
+{
+    Ns_Set         *(*selectProc) (Ns_DbHandle *, char *) = NULL;
+    int             (*execProc) (Ns_DbHandle *, char *) = NULL;
+    Ns_Set         *(*bindRowProc) (Ns_DbHandle *) = NULL;
+    int             (*getRowProc) (Ns_DbHandle *, Ns_Set *) = NULL;
+    Ns_DbProc      *procPtr;
+    Ns_Set         *row;
+    unsigned long   rows = 0;
+    int             q, status;
+
+    for (procPtr = driverProcs; procPtr->func != NULL; procPtr++) {
+        switch (procPtr->id) {
+        case DbFn_Select:  selectProc = procPtr->func;  break;
+        case DbFn_Exec:    execProc = procPtr->func;    break;
+        case DbFn_BindRow: bindRowProc = procPtr->func; break;
+        case DbFn_GetRow:  getRowProc = procPtr->func;  break;
+        default:                                        break;
+        }
+    }
+
+    /* nsdb empties the row set before each select and bindrow. */
+    shape = s;
+    for (q = 0; q < queries; q++) {
+        Ns_SetTrunc(handle->row, 0);
+        if (exec) {
+            if ((*execProc) (handle, "select * from bench") != NS_ROWS) {
+                return rows;
+            }
+            Ns_SetTrunc(handle->row, 0);
+            row = (*bindRowProc) (handle);
+        } else {
+            row = (*selectProc) (handle, "select * from bench");
+        }
+        if (row == NULL) {
+            return rows;
+        }
+        while ((status = (*getRowProc) (handle, row)) == NS_OK) {
+            rows++;
+        }
+        if (status != NS_END_DATA) {
+            return rows;
+        }
+    }
+    return rows;
+}
+
+/*
+ * RunCached - Send a shape's queries through [ns_mysql cached_select]
+ * and check every value of every row against the shape, returning the
+ * rows read.
+ */
+
+static unsigned long
+RunCached(Tcl_Interp *interp, Shape *s, int queries)
+{
+    Tcl_Obj       **rowObjs, **valueObjs;
+    unsigned long   rows = 0;
+    int             q, r, nrows, nvalues, i, length;
+    char           *value;
+
+    shape = s;
+    for (q = 0; q < queries; q++) {
+        if (Tcl_Eval(interp, "ns_mysql cached_select bench"
+                     " {select * from bench}") != TCL_OK
+            || Tcl_ListObjGetElements(interp, Tcl_GetObjResult(interp),
+                                      &nrows, &rowObjs) != TCL_OK) {
+            fprintf(stderr, "bench: %s\n", Tcl_GetStringResult(interp));
+            return rows;
+        }
+        for (r = 0; r < nrows; r++) {
+            if (Tcl_ListObjGetElements(interp, rowObjs[r], &nvalues,
+                                       &valueObjs) != TCL_OK
+                || (unsigned int) nvalues != s->numcols) {
+                return rows;
+            }
+            for (i = 0; i < nvalues; i++) {
+                value = Tcl_GetStringFromObj(valueObjs[i], &length);
+                if (s->row[i] == NULL ? length != 0
+                    : ((unsigned long) length != s->lengths[i]
+                       || memcmp(value, s->row[i], length) != 0)) {
+                    fprintf(stderr, "bench: %s cached row %d column %d"
+                            " differs\n", s->name, r, i);
+                    return rows;
+                }
+            }
+            rows++;
+        }
+    }
+    return rows;
+}
+
+static Ns_DbHandle *
+OpenHandle(char *pool)
+{
+    Ns_DbHandle    *handle = calloc(1, sizeof(Ns_DbHandle));
+    Ns_DbProc      *procPtr;
+
+    handle->driver = "mysql";
+    handle->datasource = "localhost:3306:bench";
+    handle->poolname = pool;
+    handle->row = Ns_SetCreate(NULL);
+    Ns_DStringInit(&handle->dsExceptionMsg);
+
+    for (procPtr = driverProcs; procPtr->func != NULL; procPtr++) {
+        if (procPtr->id == DbFn_OpenDb
+            && (*(int (*) (Ns_DbHandle *)) procPtr->func) (handle)
+            != NS_OK) {
+            fprintf(stderr, "bench: could not open a handle\n");
+            exit(1);
+        }
+    }
+    return handle;
+}
+
+int
+main(int argc, char **argv)
+{
+    static struct {
+        char           *name;
+        char           *pool;
+        int             exec;
+    } paths[] = {                       /* exec -1 is the query cache. */
+        { "select",    "bench",     0 },
+        { "exec",      "bench",     1 },
+        { "streaming", "streaming", 0 },
+        { "cached",    "bench",     -1 },
+        { NULL }
+    };
+    Ns_DbHandle    *handles[4];
+    Ns_DbProc      *procPtr;
+    Tcl_Interp     *interp;
+    Shape          *s;
+    struct timespec t0, t1;
+    unsigned long   rows, before;
+    double          ns;
+    int             i, p, queries;
+
+    if (Ns_DbDriverInit("mysql", NULL) != NS_OK || driverProcs == NULL) {
+        fprintf(stderr, "bench: driver did not register\n");
+        return 1;
+    }
+    for (p = 0; paths[p].name != NULL; p++) {
+        handles[p] = OpenHandle(paths[p].pool);
+    }
+    for (procPtr = driverProcs; procPtr->func != NULL; procPtr++) {
+        if (procPtr->id == DbFn_ServerInit) {
+            (*(int (*) (char *, char *, char *)) procPtr->func)
+                ("bench", "nsdb", "mysql");
+        }
+    }
+    interp = Tcl_CreateInterp();
+    if (interpInit == NULL || (*interpInit) (interp, NULL) != NS_OK) {
+        fprintf(stderr, "bench: ns_mysql was not installed\n");
+        return 1;
+    }
+
+    printf("%-8s %-10s %10s %12s %14s\n",
+           "shape", "path", "ns/row", "allocs/row", "rows/sec");
+    for (s = shapes; s->name != NULL; s++) {
+        if (argc > 1) {
+            for (i = 1; i < argc && !STREQ(argv[i], s->name); i++)
+                ;
+            if (i == argc) {
+                continue;
+            }
+        }
+        BuildShape(s);
+        for (p = 0; paths[p].name != NULL; p++) {
+            /* Once untimed, so the column keys are cached as in a server. */
+            tclHandle = handles[p];
+            if (paths[p].exec < 0) {
+                RunCached(interp, s, 1);
+            } else {
+                Run(handles[p], s, paths[p].exec, 1);
+            }
+
+            /* The cached path builds Tcl lists; a tenth is plenty. */
+            queries = paths[p].exec < 0 ? (s->queries + 9) / 10
+                : s->queries;
+            before = allocs;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            rows = paths[p].exec < 0 ? RunCached(interp, s, queries)
+                : Run(handles[p], s, paths[p].exec, queries);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            if (rows != s->rows * queries) {
+                fprintf(stderr, "bench: %s %s read %lu of %lu rows\n",
+                        s->name, paths[p].name, rows, s->rows * queries);
+                return 1;
+            }
+            ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+            printf("%-8s %-10s %10.1f %12.2f %14.0f\n", s->name,
+                   paths[p].name, ns / rows,
+                   (double) (allocs - before) / rows, rows / (ns / 1e9));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,7 @@
+/*
+ * Stand-in for libmysqlclient's errmsg.h, see mysql.h.
+ */
+
+#define CR_UNKNOWN_ERROR        2000
+#define CR_SERVER_GONE_ERROR    2006
+#define CR_SERVER_LOST          2013
@@ -0,0 +1,570 @@
+/*
+ * faultproxy.c --
+ *
+ *      A TCP proxy to put between the driver and a local mysqld, that
+ *      injects faults on a schedule: added latency, a bandwidth cap,
+ *      stalls, resets of idle connections and resets in the middle of
+ *      a result.  Point a pool's datasource at the proxy's port to see
+ *      how the driver and the handles of the pool behave, and recover,
+ *      under each.
+ *
+ *      Usage: faultproxy ?-v? port host:port ?seconds:fault ...?
+ *
+ *      The phases are run in turn and the schedule repeats.  A fault
+ *      is one of:
+ *
+ *          none                forward as is
+ *          latency=ms          hold everything for ms each way
+ *          bandwidth=bytes     at most bytes/second each way and
+ *                              connection
+ *          stall               forward nothing, keep connections open
+ *          reset               reset every connection when the phase
+ *                              starts and new ones as they come; the
+ *                              client sees error 2006 or 2013
+ *          drop=bytes          reset a connection once it has sent
+ *                              bytes to the client in this phase, in
+ *                              the middle of a result: error 2013
+ *
+ *      Without phases the proxy only forwards.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define FAULT_NONE      0
+#define FAULT_LATENCY   1
+#define FAULT_BANDWIDTH 2
+#define FAULT_STALL     3
+#define FAULT_RESET     4
+#define FAULT_DROP      5
+
+#define MAX_QUEUED      (256 * 1024)    /* Bytes held per direction. */
+#define CHUNK_SIZE      16384
+
+static char    *faultNames[] = {
+    "none", "latency", "bandwidth", "stall", "reset", "drop", NULL
+};
+
+typedef struct Phase {
+    long            ms;
+    int             fault;
+    long            value;
+} Phase;
+
+/*
+ * Data read from one side and not yet written to the other, in the
+ * order it arrived, each chunk due at the time latency allows.
+ */
+
+typedef struct Chunk {
+    struct Chunk   *next;
+    long long       due;
+    size_t          len;
+    size_t          off;
+    char            data[1];
+} Chunk;
+
+typedef struct Pipe {
+    int             from;
+    int             to;
+    Chunk          *head;
+    Chunk          *tail;
+    size_t          queued;
+    int             eof;                /* from has no more. */
+    int             shut;               /* to has been shut down. */
+    double          tokens;             /* Bandwidth allowance. */
+    long long       sent;               /* Bytes written this phase. */
+} Pipe;
+
+typedef struct Conn {
+    struct Conn    *next;
+    int             id;
+    Pipe            up;                 /* Client to server. */
+    Pipe            down;               /* Server to client. */
+} Conn;
+
+static Phase   *phases;
+static int      nphases;
+static long     cycle;
+static int      verbose;
+static Conn    *conns;
+
+/*
+ * Now - Milliseconds since the epoch.
+ */
+
+static long long
+Now(void)
+{
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+static void
+Log(char *fmt, ...)
+{
+    va_list         ap;
+    struct timeval  tv;
+
+    gettimeofday(&tv, NULL);
+    fprintf(stderr, "%ld.%03ld faultproxy: ", (long) tv.tv_sec,
+            (long) tv.tv_usec / 1000);
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+}
+
+/*
+ * ParsePhase - Parse "seconds:fault[=value]".
+ */
+
+static int
+ParsePhase(char *spec, Phase *phase)
+{
+    char           *fault, *value;
+    double          secs;
+    int             i;
+
+    secs = strtod(spec, &fault);
+    if (fault == spec || *fault != ':' || secs <= 0) {
+        return -1;
+    }
+    fault++;
+    value = strchr(fault, '=');
+    if (value != NULL) {
+        *value++ = '\0';
+    }
+    for (i = 0; faultNames[i] != NULL; i++) {
+        if (strcmp(fault, faultNames[i]) == 0) {
+            break;
+        }
+    }
+    if (faultNames[i] == NULL) {
+        return -1;
+    }
+    if ((value != NULL) != (i == FAULT_LATENCY || i == FAULT_BANDWIDTH
+                            || i == FAULT_DROP)) {
+        return -1;
+    }
+    phase->ms = (long) (secs * 1000);
+    phase->fault = i;
+    phase->value = value != NULL ? atol(value) : 0;
+    if (value != NULL && phase->value <= 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * CurrentPhase - The phase the schedule is in at time now.
+ */
+
+static Phase *
+CurrentPhase(long long start, long long now, long long *endPtr)
+{
+    long long       t, base;
+    int             i;
+
+    if (nphases == 0) {
+        return NULL;
+    }
+    base = now - (now - start) % cycle;
+    t = (now - start) % cycle;
+    for (i = 0; i < nphases - 1 && t >= phases[i].ms; i++) {
+        t -= phases[i].ms;
+        base += phases[i].ms;
+    }
+    *endPtr = base + phases[i].ms;
+
+    return &phases[i];
+}
+
+static Conn *
+OpenConn(int client, struct addrinfo *target, int id)
+{
+    Conn           *c;
+    int             server, on = 1;
+
+    server = socket(target->ai_family, SOCK_STREAM, 0);
+    if (server < 0 || connect(server, target->ai_addr,
+                              target->ai_addrlen) != 0) {
+        Log("conn %d: connect to server failed: %s", id, strerror(errno));
+        if (server >= 0) {
+            close(server);
+        }
+        close(client);
+        return NULL;
+    }
+    setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    setsockopt(server, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    fcntl(server, F_SETFL, fcntl(server, F_GETFL) | O_NONBLOCK);
+
+    c = calloc(1, sizeof(Conn));
+    c->id = id;
+    c->up.from = c->down.to = client;
+    c->up.to = c->down.from = server;
+    c->next = conns;
+    conns = c;
+
+    return c;
+}
+
+/*
+ * CloseConn - Close both sides of a connection; with reset, abortively
+ * so that the client gets a RST rather than a FIN.
+ */
+
+static void
+CloseConn(Conn *c, int reset)
+{
+    struct linger   lg = { 1, 0 };
+    Conn          **cp;
+    Chunk          *ch;
+
+    if (verbose || reset) {
+        Log("conn %d: %s after %lld bytes up, %lld down", c->id,
+            reset ? "reset" : "closed", c->up.sent, c->down.sent);
+    }
+    if (reset) {
+        setsockopt(c->up.from, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+        setsockopt(c->up.to, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    close(c->up.from);
+    close(c->up.to);
+    while ((ch = c->up.head) != NULL) {
+        c->up.head = ch->next;
+        free(ch);
+    }
+    while ((ch = c->down.head) != NULL) {
+        c->down.head = ch->next;
+        free(ch);
+    }
+    for (cp = &conns; *cp != c; cp = &(*cp)->next)
+        ;
+    *cp = c->next;
+    free(c);
+}
+
+/*
+ * PipeRead - Queue what has arrived on a pipe's from side.  Returns -1
+ * on an error.
+ */
+
+static int
+PipeRead(Pipe *p, Phase *phase, long long now)
+{
+    Chunk          *ch;
+    ssize_t         n;
+
+    ch = malloc(sizeof(Chunk) + CHUNK_SIZE);
+    n = read(p->from, ch->data, CHUNK_SIZE);
+    if (n <= 0) {
+        free(ch);
+        if (n == 0) {
+            p->eof = 1;
+            return 0;
+        }
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    }
+    ch->next = NULL;
+    ch->len = (size_t) n;
+    ch->off = 0;
+    ch->due = now;
+    if (phase != NULL && phase->fault == FAULT_LATENCY) {
+        ch->due += phase->value;
+    }
+    if (p->tail != NULL) {
+        p->tail->next = ch;
+    } else {
+        p->head = ch;
+    }
+    p->tail = ch;
+    p->queued += ch->len;
+
+    return 0;
+}
+
+/*
+ * PipeWrite - Write what is due and the bandwidth allows.  Returns -1
+ * on an error.
+ */
+
+static int
+PipeWrite(Pipe *p, Phase *phase, long long now)
+{
+    Chunk          *ch;
+    size_t          len;
+    ssize_t         n;
+
+    while ((ch = p->head) != NULL && ch->due <= now) {
+        len = ch->len - ch->off;
+        if (phase != NULL && phase->fault == FAULT_BANDWIDTH) {
+            if (p->tokens < 1) {
+                break;
+            }
+            if (len > (size_t) p->tokens) {
+                len = (size_t) p->tokens;
+            }
+        } else if (phase != NULL && phase->fault == FAULT_DROP) {
+            if (p->sent >= phase->value) {
+                break;
+            }
+            if (len > (size_t) (phase->value - p->sent)) {
+                len = (size_t) (phase->value - p->sent);
+            }
+        }
+        n = write(p->to, ch->data + ch->off, len);
+        if (n < 0) {
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        }
+        ch->off += (size_t) n;
+        p->queued -= (size_t) n;
+        p->sent += n;
+        if (phase != NULL && phase->fault == FAULT_BANDWIDTH) {
+            p->tokens -= n;
+        }
+        if (ch->off < ch->len) {
+            break;
+        }
+        p->head = ch->next;
+        if (p->head == NULL) {
+            p->tail = NULL;
+        }
+        free(ch);
+    }
+    if (p->eof && p->head == NULL && !p->shut) {
+        shutdown(p->to, SHUT_WR);
+        p->shut = 1;
+    }
+
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    struct addrinfo hints, *target;
+    struct sockaddr_in addr;
+    struct pollfd  *pfds = NULL;
+    Phase          *phase, *last = NULL;
+    Conn           *c, *next;
+    char           *host, *port;
+    long long       start, now, end, wake, lastTick;
+    int             lsock, on = 1, i, n, nconns, npfds = 0, nextId = 1;
+    int             timeout, fd;
+
+    if (argc > 1 && strcmp(argv[1], "-v") == 0) {
+        verbose = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 3 || (port = strrchr(argv[2], ':')) == NULL) {
+        fprintf(stderr, "usage: faultproxy ?-v? port host:port "
+                "?seconds:fault ...?\n");
+        return 2;
+    }
+    host = argv[2];
+    *port++ = '\0';
+
+    nphases = argc - 3;
+    phases = calloc(nphases + 1, sizeof(Phase));
+    for (i = 0; i < nphases; i++) {
+        if (ParsePhase(argv[i + 3], &phases[i]) != 0) {
+            fprintf(stderr, "faultproxy: bad phase \"%s\"\n", argv[i + 3]);
+            return 2;
+        }
+        cycle += phases[i].ms;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &target) != 0) {
+        fprintf(stderr, "faultproxy: cannot resolve %s:%s\n", host, port);
+        return 1;
+    }
+
+    lsock = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((unsigned short) atoi(argv[1]));
+    if (bind(lsock, (struct sockaddr *) &addr, sizeof(addr)) != 0
+        || listen(lsock, 64) != 0) {
+        fprintf(stderr, "faultproxy: cannot listen on port %s: %s\n",
+                argv[1], strerror(errno));
+        return 1;
+    }
+    fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);
+
+    Log("forwarding 127.0.0.1:%s to %s:%s", argv[1], host, port);
+    start = lastTick = Now();
+
+    for (;;) {
+        now = Now();
+        phase = CurrentPhase(start, now, &end);
+
+        if (phase != last) {
+            if (phase->value) {
+                Log("phase %d: %s=%ld for %ld ms", (int) (phase - phases),
+                    faultNames[phase->fault], phase->value, phase->ms);
+            } else {
+                Log("phase %d: %s for %ld ms", (int) (phase - phases),
+                    faultNames[phase->fault], phase->ms);
+            }
+            for (c = conns; c != NULL; c = next) {
+                next = c->next;
+                c->up.sent = c->down.sent = 0;
+                c->up.tokens = c->down.tokens = 0;
+                if (phase->fault == FAULT_RESET) {
+                    CloseConn(c, 1);
+                }
+            }
+            last = phase;
+        }
+
+        /* Refill the bandwidth allowance, up to one second's worth. */
+        if (phase != NULL && phase->fault == FAULT_BANDWIDTH) {
+            for (c = conns; c != NULL; c = c->next) {
+                c->up.tokens += (double) phase->value * (now - lastTick)
+                    / 1000;
+                c->down.tokens += (double) phase->value * (now - lastTick)
+                    / 1000;
+                if (c->up.tokens > phase->value) {
+                    c->up.tokens = phase->value;
+                }
+                if (c->down.tokens > phase->value) {
+                    c->down.tokens = phase->value;
+                }
+            }
+        }
+        lastTick = now;
+
+        /* Move data, unless stalled. */
+        if (phase == NULL || phase->fault != FAULT_STALL) {
+            for (c = conns; c != NULL; c = next) {
+                next = c->next;
+                if (PipeWrite(&c->up, phase, now) != 0
+                    || PipeWrite(&c->down, phase, now) != 0) {
+                    CloseConn(c, 0);
+                } else if (phase != NULL && phase->fault == FAULT_DROP
+                           && c->down.sent >= phase->value) {
+                    CloseConn(c, 1);
+                } else if (c->up.shut && c->down.shut) {
+                    CloseConn(c, 0);
+                }
+            }
+        }
+
+        /* Wait for sockets or the next chunk, tick or phase. */
+        for (nconns = 0, c = conns; c != NULL; c = c->next) {
+            nconns++;
+        }
+        if (npfds < 2 * nconns + 1) {
+            npfds = 2 * nconns + 16;
+            pfds = realloc(pfds, npfds * sizeof(struct pollfd));
+        }
+        pfds[0].fd = lsock;
+        pfds[0].events = POLLIN;
+        n = 1;
+        wake = phase != NULL ? end : now + 1000;
+        for (c = conns; c != NULL; c = c->next) {
+            pfds[n].fd = c->up.from;
+            pfds[n + 1].fd = c->up.to;
+            pfds[n].events = pfds[n + 1].events = 0;
+            if (phase == NULL || phase->fault != FAULT_STALL) {
+                if (!c->up.eof && c->up.queued < MAX_QUEUED) {
+                    pfds[n].events |= POLLIN;
+                }
+                if (!c->down.eof && c->down.queued < MAX_QUEUED) {
+                    pfds[n + 1].events |= POLLIN;
+                }
+                if (c->up.head != NULL) {
+                    if (c->up.head->due > now) {
+                        wake = c->up.head->due < wake ? c->up.head->due
+                            : wake;
+                    } else {
+                        pfds[n + 1].events |= POLLOUT;
+                    }
+                }
+                if (c->down.head != NULL) {
+                    if (c->down.head->due > now) {
+                        wake = c->down.head->due < wake ? c->down.head->due
+                            : wake;
+                    } else {
+                        pfds[n].events |= POLLOUT;
+                    }
+                }
+            }
+
+            /* A side that has hung up would wake poll() for ever. */
+            if (c->up.eof && pfds[n].events == 0) {
+                pfds[n].fd = -1;
+            }
+            if (c->down.eof && pfds[n + 1].events == 0) {
+                pfds[n + 1].fd = -1;
+            }
+            n += 2;
+        }
+        if (phase != NULL && phase->fault == FAULT_BANDWIDTH
+            && now + 10 < wake) {
+            wake = now + 10;
+        }
+        timeout = wake > now ? (int) (wake - now) : 0;
+
+        if (poll(pfds, n, timeout) < 0 && errno != EINTR) {
+            Log("poll: %s", strerror(errno));
+            return 1;
+        }
+        now = Now();
+
+        for (i = 1, c = conns; c != NULL; c = next, i += 2) {
+            next = c->next;
+            if (phase != NULL && phase->fault == FAULT_STALL) {
+                continue;
+            }
+            if ((!c->up.eof
+                 && (pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+                 && PipeRead(&c->up, phase, now) != 0)
+                || (!c->down.eof
+                    && (pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+                    && PipeRead(&c->down, phase, now) != 0)) {
+                CloseConn(c, 0);
+            }
+        }
+
+        while ((pfds[0].revents & POLLIN)
+               && (fd = accept(lsock, NULL, NULL)) >= 0) {
+            if (phase != NULL && phase->fault == FAULT_RESET) {
+                struct linger   lg = { 1, 0 };
+
+                setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+                close(fd);
+                Log("conn %d: reset on accept", nextId++);
+                continue;
+            }
+            if (OpenConn(fd, target, nextId) != NULL && verbose) {
+                Log("conn %d: opened", nextId);
+            }
+            nextId++;
+        }
+    }
+}
@@ -0,0 +1,195 @@
+#
+# faulttest.tcl --
+#
+#       Runs a pool through each fault of bench/faultproxy in turn and
+#       checks that the driver copes: queries per second over the run,
+#       the 99th percentile latency of the queries that succeeded, and
+#       how long after the fault ends every handle of the pool answers
+#       again.  Each profile starts the proxy with a schedule of
+#       -before seconds of none, -during seconds of the fault and
+#       -after seconds of none, runs the workload for exactly that
+#       long, kills the proxy and bounces the pool.
+#
+#       Meant for a test server whose pool has its datasource pointed
+#       at the proxy's port, a querytimeout (1000 ms, say) so that a
+#       stall costs a timeout rather than a hung thread, and at least
+#       -handles connections.  From the control port:
+#
+#           source /path/to/bench/faulttest.tcl
+#           faulttest::run -pool faultdb -proxy /path/to/bench/faultproxy \
+#               -port 3307 -server localhost:3306
+#
+#       Each round checks out -handles handles at once, as that many
+#       concurrent requests would, runs -query on each and releases
+#       them.  Returns one line per profile; raises an error naming the
+#       profiles that missed a threshold.
+#
+
+namespace eval faulttest {
+
+    # Where the proxy is looked for by default.
+    variable dir [file dirname [file normalize [info script]]]
+
+    #
+    # name, fault, minimum queries/second, maximum p99 ms and maximum
+    # recovery ms.  The defaults suit a mysqld on the same host; pass
+    # -profiles to tighten or loosen them.
+    #
+
+    variable profiles {
+        none       none             50   200   1000
+        latency    latency=200      2    1500  2000
+        bandwidth  bandwidth=65536  5    3000  3000
+        stall      stall            5    1000  3000
+        reset      reset            20   200   3000
+        drop       drop=65536       20   500   3000
+    }
+}
+
+#
+# faulttest::run - Run every profile and check its thresholds.
+#
+
+proc faulttest::run {args} {
+    variable profiles
+    variable dir
+
+    array set opt [list \
+        -pool     "" \
+        -proxy    [file join $dir faultproxy] \
+        -port     3307 \
+        -server   localhost:3306 \
+        -query    "SELECT REPEAT('x', 1000) AS x FROM information_schema.COLUMNS LIMIT 100" \
+        -handles  2 \
+        -before   5 \
+        -during   5 \
+        -after    10 \
+        -profiles $profiles]
+    foreach {name value} $args {
+        if {![info exists opt($name)]} {
+            error "unknown option \"$name\": should be one of\
+                [join [lsort [array names opt]] {, }]"
+        }
+        set opt($name) $value
+    }
+    if {$opt(-pool) eq ""} {
+        error "missing value for -pool"
+    }
+
+    set report {}
+    set failed {}
+    foreach {name fault minqps maxp99 maxrecovery} $opt(-profiles) {
+        set phases [list $opt(-before):none $opt(-during):$fault \
+                        $opt(-after):none]
+        set pid [eval [list exec $opt(-proxy) $opt(-port) $opt(-server)] \
+                     $phases &]
+        after 200
+        if {[catch {Workload opt} result]} {
+            catch {exec kill $pid}
+            error "$name: $result"
+        }
+        catch {exec kill $pid}
+        ns_db bouncepool $opt(-pool)
+
+        foreach {qps p99 recovery errors} $result break
+        set misses {}
+        if {$qps < $minqps} {
+            lappend misses "queries/s $qps < $minqps"
+        }
+        if {$p99 > $maxp99} {
+            lappend misses "p99 $p99 ms > $maxp99"
+        }
+        if {$recovery < 0} {
+            lappend misses "a handle never recovered"
+        } elseif {$recovery > $maxrecovery} {
+            lappend misses "recovery $recovery ms > $maxrecovery"
+        }
+        if {[llength $misses]} {
+            set verdict "FAIL: [join $misses {, }]"
+        } else {
+            set verdict ok
+        }
+        set line [format "%-10s %-16s %8.1f queries/s  p99 %6d ms" \
+                      $name $fault $qps $p99]
+        append line [format "  recovery %6d ms  %5d errors  %s" \
+                         $recovery $errors $verdict]
+        ns_log Notice "faulttest: $line"
+        lappend report $line
+        if {[llength $misses]} {
+            lappend failed $name
+        }
+    }
+
+    if {[llength $failed]} {
+        error "[join $report \n]\nfailed: [join $failed {, }]"
+    }
+    return [join $report \n]
+}
+
+#
+# faulttest::Workload - Run the query on a round of handles at a time
+# until the proxy's schedule has run once.  Returns queries/second,
+# the p99 latency in ms of the queries that succeeded, the ms from the
+# end of the fault until every handle had answered a query started
+# after it (-1 if one never did), and the number of errors.
+#
+
+proc faulttest::Workload {optVar} {
+    upvar $optVar opt
+
+    set start [clock clicks -milliseconds]
+    set faultEnd [expr {$start + 1000 * ($opt(-before) + $opt(-during))}]
+    set end [expr {$faultEnd + 1000 * $opt(-after)}]
+    set latencies {}
+    set errors 0
+    array set recovered {}
+    set names {}
+
+    while {[clock clicks -milliseconds] < $end} {
+        set dbs [ns_db gethandle -timeout 10 $opt(-pool) $opt(-handles)]
+        foreach db $dbs {
+            if {[lsearch -exact $names $db] < 0} {
+                lappend names $db
+            }
+            set t0 [clock clicks -milliseconds]
+            if {[catch {
+                set row [ns_db select $db $opt(-query)]
+                while {[ns_db getrow $db $row]} {
+                }
+            }]} {
+                incr errors
+                catch {ns_db flush $db}
+                continue
+            }
+            set t1 [clock clicks -milliseconds]
+            lappend latencies [expr {$t1 - $t0}]
+            if {$t0 >= $faultEnd && ![info exists recovered($db)]} {
+                set recovered($db) [expr {$t1 - $faultEnd}]
+            }
+        }
+        foreach db $dbs {
+            ns_db releasehandle $db
+        }
+    }
+
+    set elapsed [expr {[clock clicks -milliseconds] - $start}]
+    set n [llength $latencies]
+    set qps [expr {$n * 1000.0 / $elapsed}]
+    set p99 0
+    if {$n > 0} {
+        set sorted [lsort -integer $latencies]
+        set p99 [lindex $sorted [expr {int(ceil($n * 0.99)) - 1}]]
+    }
+    set recovery 0
+    foreach db $names {
+        if {![info exists recovered($db)]} {
+            set recovery -1
+            break
+        }
+        if {$recovered($db) > $recovery} {
+            set recovery $recovered($db)
+        }
+    }
+
+    return [list $qps $p99 $recovery $errors]
+}
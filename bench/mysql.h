@@ -0,0 +1,173 @@
+/*
+ * Stand-in for libmysqlclient's mysql.h, declaring just what mysql.c
+ * uses.  The result and row calls are implemented in bench.c over
+ * synthetic results; the rest fail or do nothing.
+ */
+
+#ifndef MYSQL_H
+#define MYSQL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MYSQL_VERSION_ID                80030
+
+#define MYSQL_AUTODETECT_CHARSET_NAME   "auto"
+
+#define CLIENT_MULTI_STATEMENTS         (1UL << 16)
+#define CLIENT_MULTI_RESULTS            (1UL << 17)
+
+#define UNSIGNED_FLAG                   32
+#define ZEROFILL_FLAG                   64
+
+#define SERVER_STATUS_IN_TRANS          1
+#define SERVER_STATUS_AUTOCOMMIT        2
+
+#define MYSQL_NO_DATA                   100
+#define MYSQL_DATA_TRUNCATED            101
+
+typedef unsigned long long my_ulonglong;
+
+enum enum_field_types {
+    MYSQL_TYPE_DECIMAL, MYSQL_TYPE_TINY, MYSQL_TYPE_SHORT, MYSQL_TYPE_LONG,
+    MYSQL_TYPE_FLOAT, MYSQL_TYPE_DOUBLE, MYSQL_TYPE_NULL,
+    MYSQL_TYPE_TIMESTAMP, MYSQL_TYPE_LONGLONG, MYSQL_TYPE_INT24,
+    MYSQL_TYPE_DATE, MYSQL_TYPE_TIME, MYSQL_TYPE_DATETIME, MYSQL_TYPE_YEAR,
+    MYSQL_TYPE_NEWDATE, MYSQL_TYPE_VARCHAR, MYSQL_TYPE_BIT,
+    MYSQL_TYPE_JSON = 245, MYSQL_TYPE_NEWDECIMAL, MYSQL_TYPE_ENUM,
+    MYSQL_TYPE_SET, MYSQL_TYPE_TINY_BLOB, MYSQL_TYPE_MEDIUM_BLOB,
+    MYSQL_TYPE_LONG_BLOB, MYSQL_TYPE_BLOB, MYSQL_TYPE_VAR_STRING,
+    MYSQL_TYPE_STRING, MYSQL_TYPE_GEOMETRY
+};
+
+enum mysql_option {
+    MYSQL_OPT_CONNECT_TIMEOUT, MYSQL_OPT_COMPRESS, MYSQL_SET_CHARSET_NAME,
+    MYSQL_OPT_LOCAL_INFILE, MYSQL_OPT_READ_TIMEOUT, MYSQL_OPT_WRITE_TIMEOUT,
+    MYSQL_OPT_COMPRESSION_ALGORITHMS, MYSQL_OPT_ZSTD_COMPRESSION_LEVEL
+};
+
+typedef struct NET {
+    int             fd;
+} NET;
+
+typedef struct MYSQL {
+    NET             net;
+    char           *db;
+    unsigned int    server_status;
+} MYSQL;
+
+typedef struct MYSQL_FIELD {
+    char           *name;
+    char           *org_name;
+    char           *table;
+    char           *org_table;
+    char           *db;
+    unsigned long   length;
+    unsigned long   max_length;
+    unsigned int    name_length;
+    unsigned int    org_name_length;
+    unsigned int    table_length;
+    unsigned int    org_table_length;
+    unsigned int    db_length;
+    unsigned int    flags;
+    unsigned int    decimals;
+    unsigned int    charsetnr;
+    enum enum_field_types type;
+} MYSQL_FIELD;
+
+typedef struct MYSQL_BIND {
+    unsigned long  *length;
+    bool           *is_null;
+    void           *buffer;
+    bool           *error;
+    enum enum_field_types buffer_type;
+    unsigned long   buffer_length;
+    bool            is_unsigned;
+} MYSQL_BIND;
+
+typedef struct MYSQL_RES MYSQL_RES;
+typedef struct MYSQL_STMT MYSQL_STMT;
+typedef char  **MYSQL_ROW;
+
+extern MYSQL   *mysql_init(MYSQL *mysql);
+extern int      mysql_options(MYSQL *mysql, enum mysql_option option,
+                              const void *arg);
+extern MYSQL   *mysql_real_connect(MYSQL *mysql, const char *host,
+                                   const char *user, const char *passwd,
+                                   const char *db, unsigned int port,
+                                   const char *unix_socket,
+                                   unsigned long clientflag);
+extern void     mysql_close(MYSQL *mysql);
+extern int      mysql_ping(MYSQL *mysql);
+extern unsigned long mysql_thread_id(MYSQL *mysql);
+extern int      mysql_select_db(MYSQL *mysql, const char *db);
+extern const char *mysql_get_server_info(MYSQL *mysql);
+extern const char *mysql_character_set_name(MYSQL *mysql);
+extern bool     mysql_thread_init(void);
+extern void     mysql_thread_end(void);
+
+extern int      mysql_query(MYSQL *mysql, const char *q);
+extern int      mysql_real_query(MYSQL *mysql, const char *q,
+                                 unsigned long length);
+extern int      mysql_send_query(MYSQL *mysql, const char *q,
+                                 unsigned long length);
+extern int      mysql_read_query_result(MYSQL *mysql);
+extern MYSQL_RES *mysql_store_result(MYSQL *mysql);
+extern MYSQL_RES *mysql_use_result(MYSQL *mysql);
+extern bool     mysql_more_results(MYSQL *mysql);
+extern int      mysql_next_result(MYSQL *mysql);
+extern unsigned int mysql_field_count(MYSQL *mysql);
+extern my_ulonglong mysql_affected_rows(MYSQL *mysql);
+extern unsigned int mysql_warning_count(MYSQL *mysql);
+extern unsigned int mysql_errno(MYSQL *mysql);
+extern const char *mysql_error(MYSQL *mysql);
+extern MYSQL_RES *mysql_list_dbs(MYSQL *mysql, const char *wild);
+extern MYSQL_RES *mysql_list_tables(MYSQL *mysql, const char *wild);
+extern unsigned long mysql_real_escape_string(MYSQL *mysql, char *to,
+                                              const char *from,
+                                              unsigned long length);
+extern unsigned long mysql_real_escape_string_quote(MYSQL *mysql, char *to,
+                                                    const char *from,
+                                                    unsigned long length,
+                                                    char quote);
+extern void     mysql_set_local_infile_handler(MYSQL *mysql,
+                    int (*local_infile_init) (void **, const char *, void *),
+                    int (*local_infile_read) (void *, char *, unsigned int),
+                    void (*local_infile_end) (void *),
+                    int (*local_infile_error) (void *, char *, unsigned int),
+                    void *userdata);
+extern void     mysql_set_local_infile_default(MYSQL *mysql);
+
+extern MYSQL_ROW mysql_fetch_row(MYSQL_RES *result);
+extern unsigned long *mysql_fetch_lengths(MYSQL_RES *result);
+extern MYSQL_FIELD *mysql_fetch_fields(MYSQL_RES *result);
+extern unsigned int mysql_num_fields(MYSQL_RES *result);
+extern my_ulonglong mysql_num_rows(MYSQL_RES *result);
+extern void     mysql_data_seek(MYSQL_RES *result, my_ulonglong offset);
+extern void     mysql_free_result(MYSQL_RES *result);
+
+extern MYSQL_STMT *mysql_stmt_init(MYSQL *mysql);
+extern int      mysql_stmt_prepare(MYSQL_STMT *stmt, const char *query,
+                                   unsigned long length);
+extern unsigned long mysql_stmt_param_count(MYSQL_STMT *stmt);
+extern bool     mysql_stmt_bind_param(MYSQL_STMT *stmt, MYSQL_BIND *bnd);
+extern bool     mysql_stmt_bind_result(MYSQL_STMT *stmt, MYSQL_BIND *bnd);
+extern int      mysql_stmt_execute(MYSQL_STMT *stmt);
+extern bool     mysql_stmt_send_long_data(MYSQL_STMT *stmt,
+                                          unsigned int param_number,
+                                          const char *data,
+                                          unsigned long length);
+extern int      mysql_stmt_store_result(MYSQL_STMT *stmt);
+extern int      mysql_stmt_fetch(MYSQL_STMT *stmt);
+extern int      mysql_stmt_fetch_column(MYSQL_STMT *stmt, MYSQL_BIND *bind,
+                                        unsigned int column,
+                                        unsigned long offset);
+extern MYSQL_RES *mysql_stmt_result_metadata(MYSQL_STMT *stmt);
+extern my_ulonglong mysql_stmt_affected_rows(MYSQL_STMT *stmt);
+extern my_ulonglong mysql_stmt_num_rows(MYSQL_STMT *stmt);
+extern bool     mysql_stmt_free_result(MYSQL_STMT *stmt);
+extern bool     mysql_stmt_close(MYSQL_STMT *stmt);
+extern unsigned int mysql_stmt_errno(MYSQL_STMT *stmt);
+extern const char *mysql_stmt_error(MYSQL_STMT *stmt);
+
+#endif /* MYSQL_H */
@@ -0,0 +1,134 @@
+/*
+ * Stand-in for AOLserver's ns.h, declaring just what mysql.c uses so
+ * that the driver can be built into the benchmark in bench.c without an
+ * AOLserver tree.  Types that the driver looks inside of have the same
+ * layout as in AOLserver 4.
+ */
+
+#ifndef NS_H
+#define NS_H
+
+#include <tcl.h>
+#include <time.h>
+#include <string.h>
+#include <strings.h>
+
+#define DllExport
+
+#define NS_OK           0
+#define NS_ERROR        (-1)
+#define NS_TIMEOUT      (-2)
+#define NS_TRUE         1
+#define NS_FALSE        0
+
+#define NS_DML          1
+#define NS_ROWS         2
+#define NS_END_DATA     4
+
+#define STREQ(a,b)      (strcmp((a),(b)) == 0)
+#define STRIEQ(a,b)     (strcasecmp((a),(b)) == 0)
+#define UCHAR(c)        ((unsigned char) (c))
+
+#define INT64                   long long
+#define NS_INT_64_FORMAT_STRING "%lld"
+
+#define NS_TCL_SET_STATIC   0
+#define NS_TCL_SET_DYNAMIC  1
+
+#define NS_CONN_SENTHDRS    4
+
+typedef enum {
+    Notice, Warning, Error, Fatal, Bug, Debug
+} Ns_LogSeverity;
+
+typedef struct Ns_Time {
+    time_t          sec;
+    long            usec;
+} Ns_Time;
+
+typedef struct Ns_SetField {
+    char           *name;
+    char           *value;
+} Ns_SetField;
+
+typedef struct Ns_Set {
+    char           *name;
+    int             size;
+    int             maxSize;
+    Ns_SetField    *fields;
+} Ns_Set;
+
+typedef struct Ns_Conn {
+    int             flags;
+} Ns_Conn;
+
+typedef void   *Ns_Mutex;
+typedef void   *Ns_Cond;
+typedef void   *Ns_Thread;
+typedef void    (Ns_ThreadProc) (void *arg);
+typedef void    (Ns_Callback) (void *arg);
+typedef void    (Ns_SchedProc) (void *arg, int id);
+
+/* As in AOLserver 4, Ns_DString is a Tcl_DString. */
+#define Ns_DString              Tcl_DString
+#define Ns_DStringInit          Tcl_DStringInit
+#define Ns_DStringFree          Tcl_DStringFree
+#define Ns_DStringTrunc         Tcl_DStringTrunc
+#define Ns_DStringSetLength     Tcl_DStringSetLength
+#define Ns_DStringValue         Tcl_DStringValue
+#define Ns_DStringLength        Tcl_DStringLength
+#define Ns_DStringNAppend       Tcl_DStringAppend
+#define Ns_DStringAppend(d,s)   Tcl_DStringAppend((d), (s), -1)
+extern char *Ns_DStringVarAppend(Ns_DString *dsPtr, ...);
+
+#define Ns_SetSize(s)           ((s)->size)
+#define Ns_SetKey(s,i)          ((s)->fields[(i)].name)
+#define Ns_SetValue(s,i)        ((s)->fields[(i)].value)
+extern Ns_Set  *Ns_SetCreate(char *name);
+extern void     Ns_SetFree(Ns_Set *set);
+extern int      Ns_SetPut(Ns_Set *set, char *key, char *value);
+extern void     Ns_SetTrunc(Ns_Set *set, int size);
+
+extern void    *ns_malloc(size_t size);
+extern void    *ns_calloc(size_t num, size_t size);
+extern void    *ns_realloc(void *ptr, size_t size);
+extern void     ns_free(void *ptr);
+extern char    *ns_strdup(const char *str);
+
+extern void     Ns_Log(Ns_LogSeverity severity, char *fmt, ...);
+
+extern char    *Ns_ConfigGetPath(char *server, char *module, ...);
+extern char    *Ns_ConfigGetValue(char *section, char *key);
+extern int      Ns_ConfigGetInt(char *section, char *key, int *valuePtr);
+extern int      Ns_ConfigGetBool(char *section, char *key, int *valuePtr);
+
+extern void     Ns_MutexLock(Ns_Mutex *mutexPtr);
+extern void     Ns_MutexUnlock(Ns_Mutex *mutexPtr);
+extern void     Ns_CondBroadcast(Ns_Cond *condPtr);
+extern void     Ns_CondWait(Ns_Cond *condPtr, Ns_Mutex *mutexPtr);
+extern int      Ns_CondTimedWait(Ns_Cond *condPtr, Ns_Mutex *mutexPtr,
+                                 Ns_Time *timePtr);
+extern void     Ns_ThreadCreate(Ns_ThreadProc *proc, void *arg,
+                                long stackSize, Ns_Thread *threadPtr);
+extern void     Ns_ThreadJoin(Ns_Thread *threadPtr, void **argPtr);
+
+extern void     Ns_GetTime(Ns_Time *timePtr);
+extern void     Ns_IncrTime(Ns_Time *timePtr, time_t sec, long usec);
+extern int      Ns_DiffTime(Ns_Time *t1, Ns_Time *t0, Ns_Time *diffPtr);
+
+extern int      Ns_TclInitInterps(char *server,
+                                  int (*proc) (Tcl_Interp *, void *),
+                                  void *arg);
+extern int      Ns_TclEnterSet(Tcl_Interp *interp, Ns_Set *set, int flags);
+extern void    *Ns_RegisterAtStartup(Ns_Callback *proc, void *arg);
+extern void    *Ns_RegisterAtShutdown(Ns_Callback *proc, void *arg);
+extern int      Ns_ScheduleProc(Ns_SchedProc *proc, void *arg, int thread,
+                                int interval);
+
+extern Ns_Conn *Ns_TclGetConn(Tcl_Interp *interp);
+extern int      Ns_ConnWrite(Ns_Conn *conn, void *buf, int towrite);
+extern int      Ns_ConnFlushHeaders(Ns_Conn *conn, int status);
+extern void     Ns_ConnSetRequiredHeaders(Ns_Conn *conn, char *type,
+                                          int length);
+
+#endif /* NS_H */
@@ -0,0 +1,67 @@
+/*
+ * Stand-in for AOLserver's nsdb.h, see ns.h.
+ */
+
+#ifndef NSDB_H
+#define NSDB_H
+
+#include "ns.h"
+
+typedef enum {
+    DbFn_End = -1,
+    DbFn_Name,
+    DbFn_DbType,
+    DbFn_ServerInit,
+    DbFn_OpenDb,
+    DbFn_CloseDb,
+    DbFn_DML,
+    DbFn_Select,
+    DbFn_GetRow,
+    DbFn_Flush,
+    DbFn_Cancel,
+    DbFn_GetTableInfo,
+    DbFn_TableList,
+    DbFn_BestRowId,
+    DbFn_Exec,
+    DbFn_BindRow,
+    DbFn_ResetHandle,
+    DbFn_SpStart,
+    DbFn_SpSetParam,
+    DbFn_SpExec,
+    DbFn_SpReturnCode,
+    DbFn_SpGetParams
+} Ns_DbProcId;
+
+typedef struct Ns_DbProc {
+    Ns_DbProcId     id;
+    void           *func;
+} Ns_DbProc;
+
+typedef struct Ns_DbHandle {
+    char           *driver;
+    char           *datasource;
+    char           *user;
+    char           *password;
+    void           *connection;
+    char           *poolname;
+    int             connected;
+    int             verbose;
+    Ns_Set         *row;
+    char            cExceptionCode[6];
+    Ns_DString      dsExceptionMsg;
+    void           *context;
+    void           *statement;
+    int             fetchingRows;
+} Ns_DbHandle;
+
+extern int      Ns_DbRegisterDriver(char *driver, Ns_DbProc *procs);
+extern char    *Ns_DbDriverName(Ns_DbHandle *handle);
+extern char    *Ns_DbPoolList(char *server);
+extern int      Ns_DbPoolTimedGetMultipleHandles(Ns_DbHandle **handles,
+                                                 char *pool, int nwant,
+                                                 int wait);
+extern void     Ns_DbPoolPutHandle(Ns_DbHandle *handle);
+extern int      Ns_TclDbGetHandle(Tcl_Interp *interp, char *handleId,
+                                  Ns_DbHandle **handle);
+
+#endif /* NSDB_H */
@@ -19,6 +19,7 @@ static char     rcsid[] = "$Id: mysql.c,v 1.6 2005/10/06 20:16:33 shmooved Exp $
 
 /* MySQL API headers */
 #include <mysql.h>
+#include <errmsg.h>
 extern void my_thread_end(void);
 
 /* Common system headers */
@@ -27,10 +28,50 @@ extern void my_thread_end(void);
 #include <string.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <errno.h>
+#ifdef WIN32
+#define poll WSAPoll
+#define SHUT_RDWR SD_BOTH
+#else
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+/*
+ * MariaDB's client library has a real non-blocking API; with
+ * libmysqlclient a query is sent with mysql_send_query() and its
+ * response read with mysql_read_query_result() once the socket is
+ * readable.
+ */
+
+#if defined(MARIADB_BASE_VERSION) || defined(LIBMARIADB)
+#define HAVE_MARIADB_ASYNC 1
+#endif
+
+/*
+ * Session state tracking and mysql_reset_connection() came with MySQL
+ * 5.7; MariaDB's client library names the capability differently.
+ */
+
+#if defined(CLIENT_SESSION_TRACK)
+#define HAVE_SESSION_TRACK 1
+#elif defined(CLIENT_SESSION_TRACKING)
+#define CLIENT_SESSION_TRACK CLIENT_SESSION_TRACKING
+#define HAVE_SESSION_TRACK 1
+#endif
+
+#define ASYNC_PENDING   0
+#define ASYNC_DONE      1
+#define ASYNC_FAILED    (-1)
 
 #define MAX_ERROR_MSG	1024
 #define MAX_IDENTIFIER	1024
 
+/* MySQL 8.0 dropped my_bool in favour of bool. */
+#if MYSQL_VERSION_ID >= 80001 && !defined(MARIADB_BASE_VERSION)
+typedef bool my_bool;
+#endif
+
 static char    *mysql_driver_name = "MySQL";
 static char    *mysql_driver_version = "Panoptic MySQL Driver v0.6";
 
@@ -46,13 +87,526 @@ static int      Ns_MySQL_GetRow(Ns_DbHandle *handle, Ns_Set *row);
 static int      Ns_MySQL_Flush(Ns_DbHandle *handle);
 static int      Ns_MySQL_Cancel(Ns_DbHandle *handle);
 static int      Ns_MySQL_Exec(Ns_DbHandle *handle, char *sql);
+static int      ExecResult(Ns_DbHandle *handle);
 static Ns_Set  *Ns_MySQL_BindRow(Ns_DbHandle *handle);
+static int      Ns_MySQL_ResetHandle(Ns_DbHandle *handle);
+
+/*
+ * Counters are updated without a lock by every thread using the pool.
+ */
+
+#if defined(__GNUC__)
+#define ATOMIC_ADD(p, n)   __sync_fetch_and_add((p), (n))
+#elif defined(_MSC_VER)
+#define ATOMIC_ADD(p, n)   InterlockedExchangeAdd((LONG volatile *) (p), (n))
+#else
+#define ATOMIC_ADD(p, n)   (*(p) += (n))
+#endif
+
+/*
+ * Latency histogram with four buckets per power of two microseconds,
+ * so a percentile read from it is within 25% of the true value.
+ */
+
+#define HIST_BUCKETS    128
+
+typedef struct MySQLHist {
+    unsigned long   count;
+    unsigned long   max;                /* Microseconds. */
+    unsigned long   buckets[HIST_BUCKETS];
+} MySQLHist;
+
+typedef struct MySQLStats {
+    unsigned long   queries;
+    unsigned long   errors;
+    unsigned long   slow;
+    unsigned long   timeouts;
+    unsigned long   skipped;            /* USE and SET already in effect. */
+    unsigned long   resets;             /* mysql_reset_connection(). */
+    unsigned long   rows;
+    unsigned long   bytes;
+    MySQLHist       query;              /* mysql_query() and its result. */
+    MySQLHist       fetch;              /* One row of a result. */
+} MySQLStats;
+
+/*
+ * A replica named after the primary in a pool's datasource list, with
+ * the health and lag last seen by any handle of the pool.
+ */
+
+typedef struct MySQLReplica {
+    char           *datasource;
+    int             up;
+    long            lag;                /* Seconds, -1 if not known. */
+    time_t          checked;
+    MYSQL          *check;              /* Connection of the lag checks. */
+    unsigned long   queries;
+} MySQLReplica;
+
+/*
+ * How [ns_mysql shard] maps a key to one of a pool's shards: the
+ * key's CRC32, as MySQL's CRC32() computes it, or the key itself as
+ * an integer, modulo the number of shards.
+ */
+
+#define SHARD_CRC32     0
+#define SHARD_MODULO    1
+
+/*
+ * A pool's write-behind queue: statements handed to [ns_mysql enqueue]
+ * that its writer thread has not run yet, and what has become of the
+ * others.  "writeoverflow" says what to do when it is full.
+ */
+
+#define OVERFLOW_DROP       0           /* Drop the new statement. */
+#define OVERFLOW_DROPOLDEST 1           /* Drop the oldest to make room. */
+#define OVERFLOW_BLOCK      2           /* Wait for room. */
+
+typedef struct WriteItem {
+    struct WriteItem *next;
+    char            sql[1];
+} WriteItem;
+
+typedef struct WriteQueue {
+    Ns_Mutex        lock;
+    Ns_Cond         cond;
+    Ns_Thread       thread;
+    int             running;            /* Writer thread started. */
+    int             stopping;           /* Server shutting down. */
+    int             max_depth;          /* "writequeue", statements. */
+    int             interval;           /* "writeinterval", milliseconds. */
+    int             max_batch;          /* "writebatch", per transaction. */
+    int             overflow;           /* OVERFLOW_*. */
+    int             stop_timeout;       /* "writestoptimeout", seconds. */
+    int             exited;             /* Writer thread done. */
+    Ns_Time         deadline;           /* Stopping: give up on the rest. */
+    Ns_DbHandle     handle;             /* The writer's own connection. */
+    unsigned long   max_packet;
+    WriteItem      *head;
+    WriteItem      *tail;
+    int             depth;
+    int             peak;
+    unsigned long   enqueued;
+    unsigned long   dropped;
+    unsigned long   written;
+    unsigned long   failed;
+    unsigned long   sent;               /* Statements after coalescing. */
+    unsigned long   flushes;
+    unsigned long   retried;            /* Batches rerun after a deadlock. */
+    MySQLHist       flush;
+} WriteQueue;
+
+/*
+ * Per-pool settings, read from "ns/db/pool/<pool>" the first time a
+ * handle of that pool is opened.
+ */
+
+typedef struct MySQLPool {
+    char           *name;
+    int             streaming;          /* Use mysql_use_result(). */
+    int             max_buffered;       /* Read-ahead limit in bytes. */
+    int             max_stmts;          /* Prepared statements per handle. */
+    int             multistatements;    /* CLIENT_MULTI_STATEMENTS. */
+    int             connections;        /* Handles in the pool. */
+    int             prewarm;            /* Connect them all at startup. */
+    int             keepalive;          /* Seconds between idle pings. */
+    int             scheduled;          /* Above already registered. */
+    int             slow_ms;            /* Log queries slower than this. */
+    int             explain_slow;       /* And EXPLAIN them. */
+    int             explain_interval;   /* Seconds between EXPLAINs. */
+    int             explaining;         /* An EXPLAIN thread is running. */
+    time_t          explained;          /* When the last one started. */
+    Ns_DbHandle     explainer;          /* Its credentials. */
+    char           *compression;        /* Algorithms, NULL for none. */
+    int             compression_level;  /* zstd level, 0 for default. */
+    int             local_infile;       /* Allow LOAD DATA LOCAL. */
+    int             connect_timeout;    /* Seconds, 0 for the library's. */
+    int             read_timeout;       /* Likewise. */
+    int             write_timeout;      /* Likewise. */
+    int             query_timeout;      /* Milliseconds, 0 for no limit. */
+    char           *primary;            /* First entry of the datasource. */
+    MySQLReplica   *replicas;           /* And the rest. */
+    int             nreplicas;
+    int             max_lag;            /* Seconds a replica may lag. */
+    int             replica_check;      /* Seconds between lag checks. */
+    Ns_DbHandle     checker;            /* Credentials for the checks. */
+    unsigned int    replica_next;       /* Round robin among equals. */
+    char          **shards;             /* "shards" datasources. */
+    int             nshards;
+    int             shard_hash;         /* SHARD_CRC32 or SHARD_MODULO. */
+    int             reset_session;      /* Reset changed sessions on release. */
+    MySQLStats      stats;
+    WriteQueue      queue;              /* [ns_mysql enqueue]. */
+} MySQLPool;
+
+/*
+ * A slow query to be explained in the background.
+ */
+
+typedef struct ExplainJob {
+    MySQLPool      *pool;
+    char           *source;             /* Datasource of the primary. */
+    char           *db;                 /* Current database, or NULL. */
+    char            sql[1];
+} ExplainJob;
+
+/*
+ * A server-side prepared statement, cached per handle by SQL text.
+ */
+
+typedef struct StmtColumn {
+    enum enum_field_types type;         /* Type the column is bound as. */
+    my_bool         is_unsigned;
+    char           *buf;                /* Bound buffer for strings. */
+    unsigned long   size;
+    unsigned long   length;
+    my_bool         is_null;
+    my_bool         error;
+    union {
+        long long       i;
+        double          d;
+        float           f;
+    } num;
+    char            text[32];           /* Text form of numeric values. */
+} StmtColumn;
+
+typedef struct MySQLStmt {
+    Tcl_HashEntry  *hPtr;               /* Entry in ctx->stmts, key is SQL. */
+    MYSQL_STMT     *stmt;
+    struct MySQLStmt *prev;             /* LRU list, most recent first. */
+    struct MySQLStmt *next;
+    unsigned long   nparams;
+    MYSQL_BIND     *params;
+    unsigned int    numcols;
+    MYSQL_BIND     *binds;
+    StmtColumn     *cols;
+    MYSQL_ROW       values;
+    unsigned long  *lengths;
+} MySQLStmt;
+
+/*
+ * The Ns_Set keys for a result's columns, cached per handle so that a
+ * repeated query does not rebuild them.  Templates are found by a hash
+ * of the column and table names.
+ */
+
+#define COLCACHE_BUCKETS 64
+#define COLCACHE_MAX     256
+
+typedef struct ColTemplate {
+    struct ColTemplate *next;
+    unsigned int    hash;
+    int             tablenames;         /* include_tablenames when built. */
+    unsigned int    numcols;
+    char          **keys;               /* "table.name" or "name". */
+    char          **names;
+    char          **tables;
+} ColTemplate;
+
+/*
+ * A result kept in the process-wide query cache.  Entries remember the
+ * generation of each table their columns came from; a write naming one
+ * of those tables bumps its generation and so invalidates the entry.
+ */
+
+typedef struct CacheTable {
+    unsigned long   generation;
+} CacheTable;
+
+typedef struct CacheEntry {
+    Tcl_HashEntry  *hPtr;               /* NULL once dropped from the cache. */
+    struct CacheEntry *prev;            /* LRU list, most recent first. */
+    struct CacheEntry *next;
+    int             refs;               /* Threads building a result from it. */
+    time_t          expires;
+    size_t          size;
+    int             ntables;
+    CacheTable    **tables;
+    unsigned long  *generations;
+    unsigned int    numcols;
+    unsigned long   nrows;
+    char           *kinds;              /* KIND_* of each column. */
+    char          **names;
+    char          **values;             /* nrows * numcols, NULL for NULL. */
+    unsigned long  *lengths;
+} CacheEntry;
+
+/*
+ * How a column's values are handed to Tcl, see NewValueObj().
+ */
+
+#define KIND_STRING     0
+#define KIND_INT        1
+#define KIND_DOUBLE     2
+#define KIND_BINARY     3
+
+/*
+ * Session variables whose value is tracked per connection, see
+ * SessionLoad().  The four from SESSION_CHARSET on are what SET NAMES
+ * sets.
+ */
+
+static char    *sessionVars[] = {
+    "time_zone", "character_set_client", "character_set_connection",
+    "character_set_results", "collation_connection", "sql_mode", NULL
+};
+
+#define SESSION_VARS    6
+#define SESSION_CHARSET 1
 
+#define SESSION_NONE    0               /* Not a USE or SET. */
+#define SESSION_OTHER   1               /* One not understood. */
+#define SESSION_USE     2
+#define SESSION_NAMES   3
+#define SESSION_VAR     4
+
+/*
+ * Per-handle driver state, kept in handle->context.
+ */
+
+typedef struct MySQLContext {
+    MySQLPool      *pool;
+    int             streaming;
+    int             max_buffered;
+
+    /*
+     * Connections to the primary and, opened when first routed to,
+     * the pool's replicas.  handle->connection is the primary except
+     * while a read sent to replica number "replica" is being read.
+     */
+    MYSQL          *primary;
+    MYSQL         **replicas;
+    int             replica;            /* -1 for the primary. */
+    int             force_primary;      /* [ns_mysql primary $db on]. */
+
+    /*
+     * Connections to the pool's shards, opened when first needed.
+     * While the handle is pinned to shard number "shard", that shard's
+     * connection stands in for the primary, "home" is the pool's own.
+     */
+    MYSQL          *home;
+    MYSQL         **shards;
+    int             shard;              /* -1 for home. */
+
+    /*
+     * Session state of the home connection, NULL where not known: its
+     * schema, if the server reports changes of it, the sessionVars it
+     * reports changes of, and the character set of the last SET NAMES
+     * while nothing has changed it.
+     */
+    char           *schema;
+    int             schema_tracked;
+    char           *session[SESSION_VARS];
+    char           *names;
+    int             session_dirty;      /* Changed since connect or reset. */
+
+    /* Milliseconds a statement may run before it is killed, 0 for ever. */
+    int             timeout;
+
+    /* The primary connection was lost in a transaction, see Reopen(). */
+    int             lost;
+
+    /*
+     * Words of the writes in the open transaction, whose tables are
+     * invalidated in the query cache again when it ends.
+     */
+    Tcl_HashTable   txn_words;
+
+    /* A write sent with [ns_mysql send], invalidated once collected. */
+    char           *async_sql;
+
+    /* State of the result in handle->statement. */
+    int             unbuffered;         /* Result came from mysql_use_result(). */
+    unsigned int    numcols;
+
+    /* Row data received on this connection, before any compression. */
+    unsigned long   bytes_received;
+
+    /*
+     * Fingerprint of the last statement, see QueryDone(), and whether
+     * the rows of its unbuffered result are still being counted.
+     */
+    unsigned int    fp_hash;
+    int             fp_pending;
+    Tcl_WideInt     fetched;
+
+    /* The server's max_allowed_packet, 0 until first needed. */
+    unsigned long   max_packet;
+
+    /* Statement built by [ns_mysql exec -bind], kept for its space. */
+    Ns_DString      bindsql;
+
+    /* Columns of the last row returned by Ns_MySQL_GetRow that were NULL. */
+    char           *nulls;
+    unsigned int    nulls_count;
+    unsigned int    nulls_size;
+
+    /* Rows read ahead from an unbuffered result. */
+    MYSQL_ROW      *ahead;
+    int             ahead_count;
+    int             ahead_next;
+    int             ahead_size;
+
+    /* Prepared statements and the one currently returning rows. */
+    Tcl_HashTable   stmts;
+    int             nstmts;
+    MySQLStmt      *lru_head;
+    MySQLStmt      *lru_tail;
+    MySQLStmt      *stmt;
+    int             failed;             /* Last fetch failed. */
+
+    /* Query started by [ns_mysql send]. */
+    int             async;              /* Not yet collected by wait. */
+    int             async_state;        /* ASYNC_PENDING, _DONE, _FAILED. */
+    int             async_wait;         /* See AsyncStart(). */
+
+    /* Column key templates. */
+    ColTemplate    *colcache[COLCACHE_BUCKETS];
+    ColTemplate    *last_template;
+    int             ntemplates;
+    unsigned long   colcache_hits;
+    unsigned long   colcache_misses;
+} MySQLContext;
+
+static MySQLPool *GetPool(char *poolname);
+static MySQLPool *FindPool(char *poolname);
+static void     WriterThread(void *arg);
+static void     WriterStop(void *arg);
+static void     WriterFlush(MySQLPool *pool, WriteItem *items, int n);
+static int      WriterLate(WriteQueue *q);
+static int      ColumnKind(MYSQL_FIELD *field);
+static Tcl_Obj *NewValueObj(int kind, char *value, unsigned long length);
+static int      Ns_MySQL_ExecBind(Tcl_Interp *interp, char *sql, int bind,
+                                  int objc, Tcl_Obj *CONST objv[],
+                                  Ns_DbHandle *handle);
+static void     PrewarmPool(void *arg);
+static void     KeepalivePool(void *arg, int id);
+static void     CheckPool(void *arg, int id);
+static void     ExplainThread(void *arg);
+static void     PoolHandle(MySQLPool *pool, Ns_DbHandle *handle);
+static MYSQL_RES *StoreResult(Ns_DbHandle *handle);
+static MYSQL_ROW  FetchRow(Ns_DbHandle *handle, unsigned long **lengthsPtr,
+                           int text);
+static void     FreeResult(Ns_DbHandle *handle);
+static void     FreePending(Ns_DbHandle *handle);
+static int      DrainResults(Ns_DbHandle *handle);
+static int      AsyncStart(MYSQL *mysql, char *sql, unsigned long len,
+                           int *waitPtr);
+static int      AsyncWait(MYSQL **conns, int *waits, int *states, int n,
+                          Ns_Time *timeout, int any);
+static int      AsyncSocket(MYSQL *mysql);
+static int      AsyncKill(Ns_DbHandle *handle, char *source, MYSQL *mysql,
+                          unsigned long id, int *waitPtr, int *statePtr);
+static int      AsyncCollect(Ns_DbHandle *handle);
+static void     CacheInvalidate(Ns_DbHandle *handle, char *sql);
+static void     SchemaFlush(void);
+static void     AppendIdent(Ns_DString *dsPtr, char *name, int qualified);
+static int      IsWrite(char *sql);
+static void     Route(Ns_DbHandle *handle, char *sql);
+static int      Query(Ns_DbHandle *handle, char *sql);
+static int      TimedQuery(Ns_DbHandle *handle, char *sql,
+                           unsigned long id);
+static int      KillQuery(Ns_DbHandle *handle, char *source,
+                          unsigned long id);
+static char    *ConnSource(Ns_DbHandle *handle);
+static void     Reopen(Ns_DbHandle *handle);
+static void     Reconnect(Ns_DbHandle *handle);
+static int      UseShard(Ns_DbHandle *handle, int shard);
+static char    *PrimarySource(Ns_DbHandle *handle);
+static unsigned long ClientFlags(MySQLPool *pool);
+static void     UsePrimary(Ns_DbHandle *handle, int always);
+static void     SessionClear(MySQLContext *ctx);
+static void     SessionLoad(Ns_DbHandle *handle);
+static void     SessionTrack(Ns_DbHandle *handle);
+static int      SessionSkip(Ns_DbHandle *handle, char *sql);
+static void     SessionDone(Ns_DbHandle *handle, char *sql);
+static void     SessionReset(Ns_DbHandle *handle);
+static unsigned long HistAdd(MySQLHist *hist, Ns_Time *start);
+static void     AppendCount(Tcl_Obj *listObj, char *name,
+                            unsigned long count);
+static void     QueryDone(Ns_DbHandle *handle, Ns_Time *start, char *sql,
+                          int failed, Tcl_WideInt rows);
+static void     ProfileRows(unsigned int hash, Tcl_WideInt rows);
+static unsigned int ProfileAdd(char *sql, unsigned long us, int failed,
+                               Tcl_WideInt rows);
+static Tcl_WideInt ResultRows(Ns_DbHandle *handle);
+static void     CloseStmts(MySQLContext *ctx);
+static void     BindColumns(Ns_DbHandle *handle, MYSQL_RES *result);
+static void     FlushColCache(MySQLContext *ctx);
+static MYSQL_ROW StmtFetchRow(Ns_DbHandle *handle, MySQLStmt *st,
+                                unsigned long **lengthsPtr, int text);
+static unsigned long StmtText(StmtColumn *col);
+static Tcl_Obj *StmtValueObj(StmtColumn *col);
 static void     Log(Ns_DbHandle *handle, MYSQL *mysql);
+static void     StmtLog(Ns_DbHandle *handle, MYSQL_STMT *stmt);
 
 /* Include tablename in resultset?  Default is no. */
 static int      include_tablenames = 0;
 
+/* Pools seen so far, keyed by pool name. */
+static Tcl_HashTable poolTable;
+static Ns_Mutex      poolLock;
+static int           poolTableInit = 0;
+
+/* The query cache, shared by all pools. */
+static Tcl_HashTable cacheEntries;      /* Key is datasource, db and SQL. */
+static Tcl_HashTable cacheTables;       /* Key is lower case table name. */
+static Ns_Mutex      cacheLock;
+static CacheEntry   *cacheHead;
+static CacheEntry   *cacheTail;
+static size_t        cacheSize;
+static int           cacheMax;          /* "cachesize", bytes. */
+static int           cacheTtl;          /* "cachettl", seconds. */
+static unsigned long cacheHits, cacheMisses, cacheEvictions,
+                     cacheExpirations, cacheInvalidations, cacheUncached;
+
+/*
+ * The schema cache, for list_dbs, list_tables and columns.  Values are
+ * Tcl list strings keyed by lookup, pool, datasource, database and
+ * argument.
+ */
+static Tcl_HashTable schemaCache;
+static Ns_Mutex      schemaLock;
+static int           schemaTtl;         /* "schemattl", seconds. */
+static int           schemaMax;         /* "schemasize", entries. */
+static unsigned long schemaGeneration;  /* Bumped by every DDL. */
+
+typedef struct SchemaEntry {
+    time_t          expires;
+    char           *value;
+} SchemaEntry;
+
+/*
+ * The statement profile behind [ns_mysql top]: totals per fingerprint,
+ * in PROFILE_STRIPES tables with a lock each, "topsize" entries in
+ * all.  A new fingerprint that finds no free slot among the
+ * PROFILE_PROBES it may use takes the one that has cost least time.
+ */
+
+#define FP_MAX          1024
+#define FP_TIGHT        ",;.=<>!"       /* No space next to these. */
+#define PROFILE_STRIPES 16
+#define PROFILE_PROBES  8
+
+typedef struct ProfileEntry {
+    unsigned int    hash;               /* 0 for a free slot. */
+    char           *fingerprint;
+    unsigned long   calls;
+    unsigned long   errors;
+    Tcl_WideInt     rows;
+    Tcl_WideInt     time;               /* Microseconds. */
+    unsigned long   max;
+} ProfileEntry;
+
+typedef struct ProfileStripe {
+    Ns_Mutex        lock;
+    ProfileEntry   *slots;
+    int             size;
+} ProfileStripe;
+
+static ProfileStripe profile[PROFILE_STRIPES];
+static int           profileSize;       /* "topsize", 0 for off. */
+
 static Ns_DbProc mysqlProcs[] = {
     { DbFn_Name,         (void *) Ns_MySQL_Name },
     { DbFn_DbType,       (void *) Ns_MySQL_DbType },
@@ -66,6 +620,7 @@ static Ns_DbProc mysqlProcs[] = {
     { DbFn_Cancel,       (void *) Ns_MySQL_Cancel },
     { DbFn_Exec,         (void *) Ns_MySQL_Exec },
     { DbFn_BindRow,      (void *) Ns_MySQL_BindRow },
+    { DbFn_ResetHandle,  (void *) Ns_MySQL_ResetHandle },
     { 0, NULL }
 };
 
@@ -80,6 +635,35 @@ Ns_DbDriverInit(char *hDriver, char *configPath)
         return NS_ERROR;
     }
 
+    if (configPath == NULL
+        || !Ns_ConfigGetInt(configPath, "cachesize", &cacheMax)
+        || cacheMax < 0) {
+        cacheMax = 10 * 1024 * 1024;
+    }
+    if (configPath == NULL
+        || !Ns_ConfigGetInt(configPath, "cachettl", &cacheTtl)
+        || cacheTtl < 0) {
+        cacheTtl = 60;
+    }
+    if (configPath == NULL
+        || !Ns_ConfigGetInt(configPath, "schemattl", &schemaTtl)
+        || schemaTtl < 0) {
+        schemaTtl = 0;
+    }
+    if (configPath == NULL
+        || !Ns_ConfigGetInt(configPath, "schemasize", &schemaMax)
+        || schemaMax < 0) {
+        schemaMax = 1000;
+    }
+    if (configPath == NULL
+        || !Ns_ConfigGetInt(configPath, "topsize", &profileSize)
+        || profileSize < 0) {
+        profileSize = 1000;
+    }
+    Tcl_InitHashTable(&cacheEntries, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&cacheTables, TCL_STRING_KEYS);
+    Tcl_InitHashTable(&schemaCache, TCL_STRING_KEYS);
+
     if (Ns_DbRegisterDriver(hDriver, &(mysqlProcs[0])) != NS_OK) {
         Ns_Log(Error,
             "Ns_MySQL_DriverInit(%s):  Could not register the %s driver.",
@@ -118,26 +702,28 @@ Ns_MySQL_DbType(Ns_DbHandle *handle)
     return strdup(buf);
 }
 
-static int
-Ns_MySQL_OpenDb(Ns_DbHandle *handle)
+/*
+ * Connect - Open a connection to a "host:port:database" datasource with
+ * the handle's user and password and, when pool is given, the pool's
+ * connection options.  Used for the handle's own connection and for
+ * side connections made on its behalf.
+ */
+
+static MYSQL *
+Connect(Ns_DbHandle *handle, MySQLPool *pool, char *source,
+        unsigned long client_flag)
 {
     MYSQL          *dbh;
-    int             rc;
     char            *datasource;
     char            *host = NULL;
     char            *database = NULL;
     char            *port = NULL;
     unsigned int    tcp_port = 0;
     char           *unix_socket = NULL;
-    unsigned int    client_flag = 0;
-    unsigned int    x, y, len;
-
-    assert(handle != NULL);
-    assert(handle->datasource != NULL);
 
-    /* handle->datasource = "host:port:database" */
-    datasource = ns_malloc(strlen(handle->datasource) + 1);
-    strcpy(datasource, handle->datasource);
+    /* source = "host:port:database" */
+    datasource = ns_malloc(strlen(source) + 1);
+    strcpy(datasource, source);
     host = datasource;
     for (port = host; port != NULL && *port != ':'; port++);
     *port = '\0';
@@ -147,22 +733,70 @@ Ns_MySQL_OpenDb(Ns_DbHandle *handle)
     database++;
 
     if (host == NULL || port == NULL || database == NULL) {
-        Ns_Log(Error, "Ns_MySQL_OpenDb(%s): '%s' is an invalid datasource string.", handle->driver, handle->datasource);
+        Ns_Log(Error, "Ns_MySQL_OpenDb(%s): '%s' is an invalid datasource string.", handle->driver, source);
         ns_free(datasource);
-        return NS_ERROR;
+        return NULL;
     }
 
     tcp_port = atoi(port);
 
     dbh = mysql_init(NULL);
     if (dbh == NULL) {
-        Ns_Log(Error, "Ns_MySQL_OpenDb(%s): mysql_init() failed.",
-            handle->datasource);
+        Ns_Log(Error, "Ns_MySQL_OpenDb(%s): mysql_init() failed.", source);
         ns_free(datasource);
-        return NS_ERROR;
+        return NULL;
     }
 
     mysql_options(dbh, MYSQL_SET_CHARSET_NAME, MYSQL_AUTODETECT_CHARSET_NAME);
+#ifdef HAVE_MARIADB_ASYNC
+    mysql_options(dbh, MYSQL_OPT_NONBLOCK, 0);
+#endif
+
+    /*
+     * Since 8.0.18 the client library negotiates the algorithm, zlib
+     * or zstd, and the zstd level; older ones only know zlib.
+     */
+
+    if (pool != NULL && pool->compression != NULL) {
+#if MYSQL_VERSION_ID >= 80018 && !defined(MARIADB_BASE_VERSION)
+        mysql_options(dbh, MYSQL_OPT_COMPRESSION_ALGORITHMS,
+                      pool->compression);
+        if (pool->compression_level > 0) {
+            unsigned int    level = (unsigned int) pool->compression_level;
+
+            mysql_options(dbh, MYSQL_OPT_ZSTD_COMPRESSION_LEVEL, &level);
+        }
+#else
+        mysql_options(dbh, MYSQL_OPT_COMPRESS, NULL);
+#endif
+    }
+    if (pool != NULL && pool->local_infile) {
+        unsigned int    on = 1;
+
+        mysql_options(dbh, MYSQL_OPT_LOCAL_INFILE, &on);
+    }
+
+    /*
+     * The client library gives up on a read only after retrying it, so
+     * a read can take up to three times readtimeout.
+     */
+
+    if (pool != NULL) {
+        unsigned int    secs;
+
+        if (pool->connect_timeout > 0) {
+            secs = (unsigned int) pool->connect_timeout;
+            mysql_options(dbh, MYSQL_OPT_CONNECT_TIMEOUT, &secs);
+        }
+        if (pool->read_timeout > 0) {
+            secs = (unsigned int) pool->read_timeout;
+            mysql_options(dbh, MYSQL_OPT_READ_TIMEOUT, &secs);
+        }
+        if (pool->write_timeout > 0) {
+            secs = (unsigned int) pool->write_timeout;
+            mysql_options(dbh, MYSQL_OPT_WRITE_TIMEOUT, &secs);
+        }
+    }
   
     Ns_Log(Notice, "mysql_real_connect(%s, %s, %s, %s, %s)",
         host,
@@ -177,13 +811,82 @@ Ns_MySQL_OpenDb(Ns_DbHandle *handle)
         Log(handle, dbh);
         mysql_close(dbh);
         ns_free(datasource);
-        return NS_ERROR;
+        return NULL;
     }
     
     ns_free(datasource);
 
+    return dbh;
+}
+
+/*
+ * ClientFlags - The flags a pool's connections are opened with.
+ * Multiple results are always accepted so that CALL works; multiple
+ * statements per query only when the pool asks for them.  Changes to
+ * the session are tracked where the library can.
+ */
+
+static unsigned long
+ClientFlags(MySQLPool *pool)
+{
+    unsigned long   client_flag = 0;
+
+    client_flag |= CLIENT_MULTI_RESULTS;
+    if (pool->multistatements) {
+        client_flag |= CLIENT_MULTI_STATEMENTS;
+    }
+#ifdef HAVE_SESSION_TRACK
+    client_flag |= CLIENT_SESSION_TRACK;
+#endif
+
+    return client_flag;
+}
+
+static int
+Ns_MySQL_OpenDb(Ns_DbHandle *handle)
+{
+    MYSQL          *dbh;
+    MySQLPool      *pool;
+
+    assert(handle != NULL);
+    assert(handle->datasource != NULL);
+
+    pool = GetPool(handle->poolname);
+
+    dbh = Connect(handle, pool, pool->primary != NULL ? pool->primary
+                  : handle->datasource, ClientFlags(pool));
+    if (dbh == NULL) {
+        return NS_ERROR;
+    }
+
+    if (handle->context == NULL) {
+        MySQLContext   *ctx;
+
+        ctx = ns_calloc(1, sizeof(MySQLContext));
+        ctx->pool = pool;
+        ctx->streaming = ctx->pool->streaming;
+        ctx->max_buffered = ctx->pool->max_buffered;
+        ctx->timeout = pool->query_timeout;
+        if (pool->nreplicas > 0) {
+            ctx->replicas = ns_calloc(pool->nreplicas, sizeof(MYSQL *));
+        }
+        if (pool->nshards > 0) {
+            ctx->shards = ns_calloc(pool->nshards, sizeof(MYSQL *));
+        }
+        Tcl_InitHashTable(&ctx->stmts, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&ctx->txn_words, TCL_STRING_KEYS);
+        Ns_DStringInit(&ctx->bindsql);
+        handle->context = (void *) ctx;
+    }
+    ((MySQLContext *) handle->context)->primary = dbh;
+    ((MySQLContext *) handle->context)->home = dbh;
+    ((MySQLContext *) handle->context)->replica = -1;
+    ((MySQLContext *) handle->context)->shard = -1;
+    ((MySQLContext *) handle->context)->max_packet = 0;
+
     handle->connection = (void *) dbh;
     handle->connected = NS_TRUE;
+    SessionLoad(handle);
 
     return NS_OK;
 }
@@ -196,9 +899,50 @@ Ns_MySQL_CloseDb(Ns_DbHandle *handle)
     if (handle->verbose)
         Ns_Log(Notice, "Ns_MySQL_CloseDb(%s) called.", handle->datasource);
 
+    /*
+     * An unread unbuffered result has to be drained before the
+     * connection goes away, the client library still points at it.
+     */
+
+    FreeResult(handle);
+
+    if (handle->context != NULL) {
+        CloseStmts((MySQLContext *) handle->context);
+        handle->connection = ((MySQLContext *) handle->context)->home;
+    }
+
     mysql_close((MYSQL *) handle->connection);
+    handle->connection = NULL;
     handle->connected = NS_FALSE;
 
+    if (handle->context != NULL) {
+        MySQLContext   *ctx = (MySQLContext *) handle->context;
+        int             i;
+
+        for (i = 0; i < ctx->pool->nreplicas; i++) {
+            if (ctx->replicas[i] != NULL) {
+                mysql_close(ctx->replicas[i]);
+            }
+        }
+        ns_free(ctx->replicas);
+        for (i = 0; i < ctx->pool->nshards; i++) {
+            if (ctx->shards[i] != NULL) {
+                mysql_close(ctx->shards[i]);
+            }
+        }
+        ns_free(ctx->shards);
+        Ns_DStringFree(&ctx->bindsql);
+        SessionClear(ctx);
+        Tcl_DeleteHashTable(&ctx->stmts);
+        Tcl_DeleteHashTable(&ctx->txn_words);
+        ns_free(ctx->async_sql);
+        FlushColCache(ctx);
+        ns_free(ctx->ahead);
+        ns_free(ctx->nulls);
+        ns_free(ctx);
+        handle->context = NULL;
+    }
+
     /*
      * From http://www.mysql.com/documentation/mysql/bychapter/manual_Clients.html#mysql_thread_end
      *
@@ -222,6 +966,7 @@ Ns_MySQL_CloseDb(Ns_DbHandle *handle)
 static int
 Ns_MySQL_DML(Ns_DbHandle *handle, char *sql)
 {
+    Ns_Time         start;
     int             rc;
 
     assert(handle != NULL);
@@ -231,12 +976,38 @@ Ns_MySQL_DML(Ns_DbHandle *handle, char *sql)
     if (handle->verbose)
         Ns_Log(Notice, "Ns_MySQL_DML(%s) called.", handle->datasource);
 
-    rc = mysql_query((MYSQL *) handle->connection, sql);
+    FreePending(handle);
+
+    if (SessionSkip(handle, sql)) {
+        return NS_OK;
+    }
+
+    Ns_GetTime(&start);
+    rc = Query(handle, sql);
     Log(handle, (MYSQL *) handle->connection);
+    CacheInvalidate(handle, sql);
 
     if (rc) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        return NS_ERROR;
+    }
+    SessionDone(handle, sql);
+
+    /* A DML that returned rows anyway, e.g. CALL. */
+    if (mysql_field_count((MYSQL *) handle->connection) > 0) {
+        MYSQL_RES      *result;
+
+        result = mysql_use_result((MYSQL *) handle->connection);
+        if (result != NULL) {
+            mysql_free_result(result);
+        }
+    }
+    if (DrainResults(handle) != NS_OK) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
         return NS_ERROR;
     }
+    QueryDone(handle, &start, sql, NS_FALSE,
+              (Tcl_WideInt) mysql_affected_rows((MYSQL *) handle->connection));
 
     return NS_OK;
 }
@@ -245,11 +1016,9 @@ static Ns_Set  *
 Ns_MySQL_Select(Ns_DbHandle *handle, char *sql)
 {
     MYSQL_RES      *result;   
-    MYSQL_FIELD    *fields;
+    Ns_Time         start;
     int             rc;
-    unsigned int    i;
     unsigned int    numcols;
-    Ns_DString     key;
 
     assert(handle != NULL);
     assert(handle->connection != NULL);
@@ -258,23 +1027,27 @@ Ns_MySQL_Select(Ns_DbHandle *handle, char *sql)
     if (handle->verbose)
         Ns_Log(Notice, "Ns_MySQL_Select(%s) called.", handle->datasource);
 
-    rc = mysql_query((MYSQL *) handle->connection, sql);
+    FreeResult(handle);
+    Route(handle, sql);
+
+    Ns_GetTime(&start);
+    rc = Query(handle, sql);
     Log(handle, (MYSQL *) handle->connection);
 
     if (rc) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        UsePrimary(handle, NS_TRUE);
         return NULL;
     }
 
-    result = mysql_store_result((MYSQL *) handle->connection);
-    Log(handle, (MYSQL *) handle->connection);
+    result = StoreResult(handle);
+    QueryDone(handle, &start, sql, result == NULL, ResultRows(handle));
 
     if (result == NULL) {
+        UsePrimary(handle, NS_TRUE);
         return NULL;
     }
 
-    handle->statement = (void *) result;
-    handle->fetchingRows = NS_TRUE;
-
     numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
     Log(handle, (MYSQL *) handle->connection);
 
@@ -282,38 +1055,33 @@ Ns_MySQL_Select(Ns_DbHandle *handle, char *sql)
         Ns_Log(Error, "Ns_MySQL_Select(%s):  Query did not return rows:  %s",
            handle->datasource, sql);
 
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        FreeResult(handle);
         return NULL;
     }
 
-    numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
-    fields = mysql_fetch_fields((MYSQL_RES *) handle->statement);
-
-    for (i = 0; i < numcols; i++) {
-        Ns_DStringInit(&key);
-
-        if (include_tablenames && strlen(fields[i].table) > 0) {
-            Ns_DStringVarAppend(&key, fields[i].table, ".", NULL);
-        }
-
-        Ns_DStringAppend(&key, fields[i].name);
-
-        Ns_SetPut((Ns_Set *) handle->row, Ns_DStringValue(&key), NULL);
-
-        Ns_DStringFree(&key);
-    }
+    BindColumns(handle, (MYSQL_RES *) handle->statement);
+    UsePrimary(handle, NS_FALSE);
 
     return (Ns_Set *) handle->row;
 }
 
+/*
+ * Ns_MySQL_GetRow - Copy the next row into the set.  The column count
+ * comes from the handle, saved when the result was picked up, and each
+ * value is copied with its length into the storage its predecessor in
+ * the same column had, so the usual case does not allocate.
+ */
+
 static int
 Ns_MySQL_GetRow(Ns_DbHandle *handle, Ns_Set *row)
 {
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
     MYSQL_ROW       my_row;
-    int             i;
-    int             numcols;
+    Ns_Time         start;
+    unsigned long  *lengths;
+    unsigned int    i;
+    unsigned int    numcols;
+    unsigned long   bytes = 0;
 
     if (handle->verbose)
         Ns_Log(Notice, "Ns_MySQL_GetRow(%s) called.", handle->datasource);
@@ -324,42 +1092,74 @@ Ns_MySQL_GetRow(Ns_DbHandle *handle, Ns_Set *row)
         return NS_ERROR;
     }
 
-    numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
-    Log(handle, (MYSQL *) handle->connection);
+    if (ctx != NULL) {
+        numcols = ctx->numcols;
+    } else {
+        numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
+    }
 
     if (numcols == 0) {
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        FreeResult(handle);
         return NS_ERROR;
     }
 
-    if (numcols != Ns_SetSize(row)) {
+    if (numcols != (unsigned int) Ns_SetSize(row)) {
         Ns_Log(Error, "Ns_MySQL_GetRow: Number of columns in row (%d)"
-            " not equal to number of columns in row fetched (%d).",
+            " not equal to number of columns in row fetched (%u).",
             Ns_SetSize(row), numcols);
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        FreeResult(handle);
         return NS_ERROR;
     }
 
-    my_row = mysql_fetch_row((MYSQL_RES *) handle->statement);
-    Log(handle, (MYSQL *) handle->connection);
+    Ns_GetTime(&start);
+    my_row = FetchRow(handle, &lengths, NS_TRUE);
 
     if (my_row == NULL) {
-        mysql_free_result((MYSQL_RES *) handle->statement);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        /*
+         * For an unbuffered result a NULL row is also how the client
+         * library reports a network or server error.
+         */
+
+        if (ctx != NULL && (ctx->failed || (ctx->unbuffered
+            && mysql_errno((MYSQL *) handle->connection)))) {
+            Log(handle, (MYSQL *) handle->connection);
+            FreeResult(handle);
+            return NS_ERROR;
+        }
+        FreeResult(handle);
         return NS_END_DATA;
     }
 
+    if (ctx != NULL && ctx->nulls_size < numcols) {
+        ctx->nulls = ns_realloc(ctx->nulls, numcols);
+        ctx->nulls_size = numcols;
+    }
+    if (ctx != NULL) {
+        ctx->nulls_count = numcols;
+    }
+
     for (i = 0; i < numcols; i++) {
-        if (my_row[i] == NULL) {
-            Ns_SetPutValue(row, i, "");
-        } else {
-            Ns_SetPutValue(row, i, my_row[i]);
+        unsigned long   len = (my_row[i] == NULL) ? 0 : lengths[i];
+        char           *value;
+
+        value = ns_realloc(Ns_SetValue(row, i), len + 1);
+        if (len > 0) {
+            memcpy(value, my_row[i], len);
         }
+        value[len] = '\0';
+        row->fields[i].value = value;
+        if (ctx != NULL) {
+            ctx->nulls[i] = (my_row[i] == NULL);
+        }
+        bytes += len;
+    }
+
+    if (ctx != NULL) {
+        MySQLStats     *stats = &ctx->pool->stats;
+
+        HistAdd(&stats->fetch, &start);
+        ATOMIC_ADD(&stats->rows, 1);
+        ATOMIC_ADD(&stats->bytes, bytes);
     }
 
     return NS_OK;
@@ -374,24 +1174,36 @@ Ns_MySQL_Flush(Ns_DbHandle *handle)
 static int
 Ns_MySQL_Cancel(Ns_DbHandle *handle)
 {
+    MySQLContext   *ctx;
+
     assert(handle != NULL);
     assert(handle->connection != NULL);
 
-    if (handle->fetchingRows == NS_TRUE) {
-        MYSQL_RES      *result;
+    /*
+     * A result still being streamed is killed first, so that disposing
+     * of it below does not have to wait it out.  FreeResult() does the
+     * same for a query sent with [ns_mysql send].
+     */
 
-        result = (MYSQL_RES *) handle->statement;
+    ctx = (MySQLContext *) handle->context;
+    if (ctx != NULL && handle->fetchingRows == NS_TRUE && ctx->unbuffered) {
+        KillQuery(handle, ConnSource(handle),
+                  mysql_thread_id((MYSQL *) handle->connection));
+    }
 
-        assert(result != NULL);
+    if (handle->fetchingRows == NS_TRUE || (ctx != NULL && ctx->async)) {
+        assert(handle->fetchingRows == NS_FALSE || handle->statement != NULL);
 
         /*
          * TODO:  I'm not sure what is supposed to happen here, so I'll
          * just dispose of the statement.  Now that MySQL supports
          * transactions, we probably should be issuing a ROLLBACK, too.
+         *
+         * Freeing an unbuffered result reads and discards whatever the
+         * server has not sent yet, so the handle can go back to the
+         * pool in sync.
          */
-        mysql_free_result(result);
-        handle->statement = NULL;
-        handle->fetchingRows = NS_FALSE;
+        FreeResult(handle);
     }
 
     return NS_OK;
@@ -401,9 +1213,8 @@ Ns_MySQL_Cancel(Ns_DbHandle *handle)
 static int
 Ns_MySQL_Exec(Ns_DbHandle *handle, char *sql)
 {
-    MYSQL_RES      *result;
+    Ns_Time         start;
     int             rc;
-    unsigned int    numcols, fieldcount;
 
     assert(handle != NULL);
     assert(handle->connection != NULL);
@@ -414,21 +1225,55 @@ Ns_MySQL_Exec(Ns_DbHandle *handle, char *sql)
         Ns_Log(Notice, "Ns_MySQL_Exec(sql) = '%s'", sql);
     }
 
-    rc = mysql_query((MYSQL *) handle->connection, sql);
+    FreeResult(handle);
+    if (SessionSkip(handle, sql)) {
+        return NS_DML;
+    }
+    Route(handle, sql);
+
+    Ns_GetTime(&start);
+    rc = Query(handle, sql);
     Log(handle, (MYSQL *) handle->connection);
+    CacheInvalidate(handle, sql);
 
     if (rc) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        UsePrimary(handle, NS_TRUE);
         return NS_ERROR;
     }
 
-    result = mysql_store_result((MYSQL *) handle->connection);
-    Log(handle, (MYSQL *) handle->connection);
+    rc = ExecResult(handle);
+    if (rc != NS_ERROR) {
+        SessionDone(handle, sql);
+    }
+    QueryDone(handle, &start, sql, rc == NS_ERROR, ResultRows(handle));
+    UsePrimary(handle, rc != NS_ROWS);
 
-    fieldcount = mysql_field_count((MYSQL *) handle->connection);
-    Log(handle, (MYSQL *) handle->connection);
+    return rc;
+}
 
-    if (result == NULL) {
+/*
+ * ExecResult - Pick up the result of a query that has been sent and
+ * whose response has started to arrive, and classify it the way
+ * Ns_MySQL_Exec does.
+ */
+
+static int
+ExecResult(Ns_DbHandle *handle)
+{
+    MYSQL_RES      *result;
+    unsigned int    numcols, fieldcount;
+
+    result = StoreResult(handle);
+
+    fieldcount = mysql_field_count((MYSQL *) handle->connection);
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (result == NULL) {
     	if (fieldcount == 0) {	
+    		if (DrainResults(handle) != NS_OK) {
+    			return NS_ERROR;
+    		}
     		if (handle->verbose)
     			Ns_Log(Notice, "Ns_MySQL_Exec(status) = NS_DML");
 
@@ -436,6 +1281,7 @@ Ns_MySQL_Exec(Ns_DbHandle *handle, char *sql)
     	} else {
     		Ns_Log(Error, "Ns_MySQL_Exec() has columns but result set is NULL");
 
+    		DrainResults(handle);
     		return NS_ERROR;
     	}
     }
@@ -447,15 +1293,12 @@ Ns_MySQL_Exec(Ns_DbHandle *handle, char *sql)
         Ns_Log(Notice, "Ns_MySQL_Exec(numcols) = %u", numcols);
 
     if (numcols != 0) {
-        handle->statement = (void *) result;
-        handle->fetchingRows = NS_TRUE;
-
         if (handle->verbose)
             Ns_Log(Notice, "Ns_MySQL_Exec(status) = NS_ROWS");
 
         return NS_ROWS;
     } else {
-        mysql_free_result(result);
+        FreeResult(handle);
 
         if (handle->verbose)
             Ns_Log(Notice, "Ns_MySQL_Exec(status) = NS_DML");
@@ -467,13 +1310,37 @@ Ns_MySQL_Exec(Ns_DbHandle *handle, char *sql)
     return NS_ERROR;
 }
 
+/*
+ * Ns_MySQL_ResetHandle - Called by nsdb when a handle goes back to its
+ * pool, so that a handle told to stay on the primary, pinned to a
+ * shard or given its own timeout does not stay so for its next user.
+ */
+
+static int
+Ns_MySQL_ResetHandle(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    if (ctx != NULL) {
+        if (ctx->lost) {
+            FreeResult(handle);
+            Reconnect(handle);
+        }
+        ctx->force_primary = NS_FALSE;
+        ctx->timeout = ctx->pool->query_timeout;
+        UseShard(handle, -1);
+        if (ctx->pool->reset_session && ctx->home != NULL) {
+            SessionReset(handle);
+        }
+    }
+
+    return NS_OK;
+}
+
 static Ns_Set  *
 Ns_MySQL_BindRow(Ns_DbHandle *handle)
 {
-    MYSQL_FIELD    *fields;
-    unsigned int    i;
     unsigned int    numcols;
-    Ns_DString     key;
 
     assert(handle != NULL);
     assert(handle->statement != NULL);
@@ -486,292 +1353,7647 @@ Ns_MySQL_BindRow(Ns_DbHandle *handle)
     if (handle->verbose)
         Ns_Log(Notice, "Ns_MySQL_BindRow(numcols) = %u", numcols);
 
-    fields = mysql_fetch_fields((MYSQL_RES *) handle->statement);
-
-    for (i = 0; i < numcols; i++) {
-        Ns_DStringInit(&key);
-
-        if (include_tablenames && strlen(fields[i].table) > 0) {
-            Ns_DStringVarAppend(&key, fields[i].table, ".", NULL);
-        }
-
-        Ns_DStringAppend(&key, fields[i].name);
-
-        Ns_SetPut((Ns_Set *) handle->row, Ns_DStringValue(&key), NULL);
-
-        Ns_DStringFree(&key);
-    }
+    BindColumns(handle, (MYSQL_RES *) handle->statement);
 
     return (Ns_Set *) handle->row;
 }
 
-/* ************************************************************ */
+/*
+ * NewTemplate - Build the column keys for a result layout.  The keys,
+ * names and tables are packed into a single allocation.
+ */
 
-static int 
-Ns_MySQL_List_Dbs(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+static ColTemplate *
+NewTemplate(MYSQL_FIELD *fields, unsigned int numcols, unsigned int hash,
+            int tablenames)
 {
-    MYSQL_RES      *result;
-    MYSQL_ROW       row;
-    unsigned int    numcols;
+    ColTemplate    *tmpl;
     unsigned int    i;
+    size_t          size;
+    char           *p;
 
-    assert(handle != NULL);
-    assert(handle->connection != NULL);
-
-    if (handle->verbose)
-        Ns_Log(Notice, "Ns_MySQL_List_Dbs(%s) called.", handle->datasource);
-
-    result = mysql_list_dbs((MYSQL *) handle->connection, wild);
-    Log(handle, (MYSQL *) handle->connection);
-
-    if (result == NULL) {
-        Tcl_AppendResult(interp, "mysql_list_dbs failed.", NULL);
-        return TCL_ERROR;
+    size = sizeof(ColTemplate) + 3 * numcols * sizeof(char *);
+    for (i = 0; i < numcols; i++) {
+        size += 2 * (fields[i].name_length + 1) + fields[i].table_length + 1;
+        if (tablenames) {
+            size += fields[i].table_length + 1;
+        }
     }
 
-    numcols = mysql_num_fields(result);
-    Log(handle, (MYSQL *) handle->connection);
+    tmpl = ns_malloc(size);
+    tmpl->next = NULL;
+    tmpl->hash = hash;
+    tmpl->tablenames = tablenames;
+    tmpl->numcols = numcols;
+    tmpl->keys = (char **) (tmpl + 1);
+    tmpl->names = tmpl->keys + numcols;
+    tmpl->tables = tmpl->names + numcols;
 
-    while ((row = mysql_fetch_row(result)) != NULL) {
-        for (i = 0; i < numcols; i++) {
-            Tcl_AppendElement(interp, row[i]);
+    p = (char *) (tmpl->tables + numcols);
+    for (i = 0; i < numcols; i++) {
+        tmpl->names[i] = p;
+        memcpy(p, fields[i].name, fields[i].name_length + 1);
+        p += fields[i].name_length + 1;
+
+        tmpl->tables[i] = p;
+        memcpy(p, fields[i].table, fields[i].table_length + 1);
+        p += fields[i].table_length + 1;
+
+        tmpl->keys[i] = p;
+        if (tablenames && fields[i].table_length > 0) {
+            memcpy(p, fields[i].table, fields[i].table_length);
+            p += fields[i].table_length;
+            *p++ = '.';
         }
+        memcpy(p, fields[i].name, fields[i].name_length + 1);
+        p += fields[i].name_length + 1;
     }
 
-    mysql_free_result(result);
-
-    return TCL_OK;
+    return tmpl;
 }
 
-static int 
-Ns_MySQL_List_Tables(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+static int
+MatchTemplate(ColTemplate *tmpl, MYSQL_FIELD *fields, unsigned int numcols,
+              unsigned int hash, int tablenames)
 {
-    MYSQL_RES      *result;
-    MYSQL_ROW       row;
-    unsigned int    numcols;
     unsigned int    i;
 
-    assert(handle != NULL);
-    assert(handle->connection != NULL);
-
-    if (handle->verbose)
-        Ns_Log(Notice, "Ns_MySQL_List_Tables(%s) called.", handle->datasource);
-
-    result = mysql_list_tables((MYSQL *) handle->connection, wild);
-    Log(handle, (MYSQL *) handle->connection);
-
-    if (result == NULL) {
-        Tcl_AppendResult(interp, "mysql_list_tables failed.", NULL);
-        return TCL_ERROR;
+    if (tmpl->hash != hash || tmpl->numcols != numcols
+        || tmpl->tablenames != tablenames) {
+        return 0;
     }
-
-    numcols = mysql_num_fields(result);
-    Log(handle, (MYSQL *) handle->connection);
-
-    while ((row = mysql_fetch_row(result)) != NULL) {
-        for (i = 0; i < numcols; i++) {
-            Tcl_AppendElement(interp, row[i]);
+    for (i = 0; i < numcols; i++) {
+        if (strcmp(tmpl->names[i], fields[i].name) != 0
+            || strcmp(tmpl->tables[i], fields[i].table) != 0) {
+            return 0;
         }
     }
 
-    mysql_free_result(result);
+    return 1;
+}
 
-    return TCL_OK;
+static void
+FlushColCache(MySQLContext *ctx)
+{
+    ColTemplate    *tmpl, *next;
+    int             i;
+
+    for (i = 0; i < COLCACHE_BUCKETS; i++) {
+        for (tmpl = ctx->colcache[i]; tmpl != NULL; tmpl = next) {
+            next = tmpl->next;
+            ns_free(tmpl);
+        }
+        ctx->colcache[i] = NULL;
+    }
+    ctx->last_template = NULL;
+    ctx->ntemplates = 0;
 }
 
-static int 
-Ns_MySQL_Select_Db(Tcl_Interp *interp, const char *db, Ns_DbHandle *handle)
+/*
+ * BindColumns - Add a key to handle->row for each column of result.
+ * The keys come from the handle's template cache; only the first query
+ * with a given column layout builds them.
+ */
+
+static void
+BindColumns(Ns_DbHandle *handle, MYSQL_RES *result)
 {
-    unsigned int    rc;
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL_FIELD    *fields;
+    ColTemplate    *tmpl;
+    unsigned int    numcols, hash, i;
+    unsigned char  *p;
+    int             tablenames = include_tablenames;
 
-    assert(handle != NULL);
-    assert(handle->connection != NULL);
+    numcols = mysql_num_fields(result);
+    fields = mysql_fetch_fields(result);
 
-    if (handle->verbose)
-        Ns_Log(Notice, "Ns_MySQL_Select_Db(%s) called.", db);
+    /* FNV-1a over the column and table names. */
+    hash = 2166136261U;
+    for (i = 0; i < numcols; i++) {
+        for (p = (unsigned char *) fields[i].name; *p != '\0'; p++) {
+            hash = (hash ^ *p) * 16777619U;
+        }
+        hash = (hash ^ '.') * 16777619U;
+        for (p = (unsigned char *) fields[i].table; *p != '\0'; p++) {
+            hash = (hash ^ *p) * 16777619U;
+        }
+        hash = (hash ^ ',') * 16777619U;
+    }
 
-    rc = mysql_select_db((MYSQL *) handle->connection, db);
-    Log(handle, (MYSQL *) handle->connection);
+    tmpl = NULL;
+    if (ctx != NULL) {
+        tmpl = ctx->last_template;
+        if (tmpl == NULL
+            || !MatchTemplate(tmpl, fields, numcols, hash, tablenames)) {
+            for (tmpl = ctx->colcache[hash % COLCACHE_BUCKETS];
+                 tmpl != NULL; tmpl = tmpl->next) {
+                if (MatchTemplate(tmpl, fields, numcols, hash, tablenames)) {
+                    break;
+                }
+            }
+        }
 
-    if (rc) {
-        Tcl_AppendResult(interp, "mysql_select_db failed.", NULL);
-        return TCL_ERROR;
+        if (tmpl != NULL) {
+            ctx->colcache_hits++;
+        } else {
+            ctx->colcache_misses++;
+            if (ctx->ntemplates >= COLCACHE_MAX) {
+                FlushColCache(ctx);
+            }
+            tmpl = NewTemplate(fields, numcols, hash, tablenames);
+            tmpl->next = ctx->colcache[hash % COLCACHE_BUCKETS];
+            ctx->colcache[hash % COLCACHE_BUCKETS] = tmpl;
+            ctx->ntemplates++;
+        }
+        ctx->last_template = tmpl;
+    } else {
+        tmpl = NewTemplate(fields, numcols, hash, tablenames);
     }
 
-    Tcl_SetResult(interp, (char *) db, TCL_STATIC);
+    for (i = 0; i < numcols; i++) {
+        Ns_SetPut((Ns_Set *) handle->row, tmpl->keys[i], NULL);
+    }
 
-    return TCL_OK;
+    if (ctx == NULL) {
+        ns_free(tmpl);
+    }
 }
 
-static int 
-Ns_MySQL_Resultrows(Tcl_Interp *interp, Ns_DbHandle *handle)
+/*
+ * SplitDatasource - Split a pool's datasource, a comma separated list of
+ * "host:port:database", into the primary and its replicas.
+ */
+
+static void
+SplitDatasource(MySQLPool *pool, char *datasource)
 {
-    INT64            rows;
-    char            *rows_str;
+    Tcl_DString     ds;
+    char           *p, *start, *end;
+    int             n;
 
-    assert(handle != NULL);
-    assert(handle->connection != NULL);
-    
-    if (handle->verbose)
-        Ns_Log(Notice, "Ns_MySQL_Resultrows(%s) called.", handle->datasource);
+    if (datasource == NULL) {
+        return;
+    }
 
-    rows = mysql_affected_rows((MYSQL *) handle->connection);
-    Log(handle, (MYSQL *) handle->connection);
+    for (n = 0, p = datasource; (p = strchr(p, ',')) != NULL; p++) {
+        n++;
+    }
+    if (n > 0) {
+        pool->replicas = ns_calloc(n, sizeof(MySQLReplica));
+    }
 
-    if (rows < 0) {
-        Tcl_AppendResult(interp, "mysql_affected_rows failed.", NULL);
-        return TCL_ERROR;
+    Tcl_DStringInit(&ds);
+    for (p = datasource; p != NULL; p = (*end == ',') ? end + 1 : NULL) {
+        for (start = p; isspace(UCHAR(*start)); start++)
+            ;
+        for (end = start; *end != '\0' && *end != ','; end++)
+            ;
+        for (p = end; p > start && isspace(UCHAR(p[-1])); p--)
+            ;
+        Tcl_DStringSetLength(&ds, 0);
+        Tcl_DStringAppend(&ds, start, p - start);
+        if (pool->primary == NULL) {
+            pool->primary = ns_strdup(Tcl_DStringValue(&ds));
+        } else if (ds.length > 0) {
+            pool->replicas[pool->nreplicas].datasource =
+                ns_strdup(Tcl_DStringValue(&ds));
+            pool->replicas[pool->nreplicas].lag = -1;
+            pool->nreplicas++;
+        }
     }
+    Tcl_DStringFree(&ds);
+}
 
-    /*
-     * an unsigned long long (64 bits) will never have a character
-     * representation longer than 20 characters.
-     */
+/*
+ * SplitShards - Set a pool's shards from the comma separated list of
+ * datasources in "shards".
+ */
 
-    rows_str = Tcl_Alloc(21);
-    sprintf(rows_str, NS_INT_64_FORMAT_STRING, rows);
+static void
+SplitShards(MySQLPool *pool, char *shards)
+{
+    Tcl_DString     ds;
+    char           *p, *start, *end;
+    int             n;
 
-    Tcl_SetResult(interp, rows_str, TCL_DYNAMIC);
+    if (shards == NULL) {
+        return;
+    }
 
-    return TCL_OK;
+    for (n = 1, p = shards; (p = strchr(p, ',')) != NULL; p++) {
+        n++;
+    }
+    pool->shards = ns_calloc(n, sizeof(char *));
+
+    Tcl_DStringInit(&ds);
+    for (p = shards; p != NULL; p = (*end == ',') ? end + 1 : NULL) {
+        for (start = p; isspace(UCHAR(*start)); start++)
+            ;
+        for (end = start; *end != '\0' && *end != ','; end++)
+            ;
+        for (p = end; p > start && isspace(UCHAR(p[-1])); p--)
+            ;
+        if (p > start) {
+            Tcl_DStringSetLength(&ds, 0);
+            Tcl_DStringAppend(&ds, start, p - start);
+            pool->shards[pool->nshards++] = ns_strdup(Tcl_DStringValue(&ds));
+        }
+    }
+    Tcl_DStringFree(&ds);
 }
 
 /*
- * Ns_MySQL_Cmd - This function implements the "ns_mysql" Tcl command
- * installed into each interpreter of each virtual server.  It provides
- * access to features specific to the MySQL driver.
+ * GetPool - Return the settings for the named pool, reading them from
+ * the pool's config section the first time the pool is seen.
  */
 
-static int
-Ns_MySQL_Cmd(ClientData dummy, Tcl_Interp *interp, int argc, char **argv)
+static MySQLPool *
+GetPool(char *poolname)
 {
-    Ns_DbHandle    *handle;
+    MySQLPool      *pool;
+    Tcl_HashEntry  *hPtr;
+    char           *path, *value;
+    int             new;
 
-    if (argc < 3 || argc > 4) {
-        Tcl_AppendResult(interp, "wrong # args: should be \"",
-            argv[0], " cmd handle ?args?\"", NULL);
-        return TCL_ERROR;
+    if (poolname == NULL) {
+        poolname = "";
     }
 
-    if (Ns_TclDbGetHandle(interp, argv[2], &handle) != TCL_OK) {
-        return TCL_ERROR;
+    Ns_MutexLock(&poolLock);
+    if (!poolTableInit) {
+        Tcl_InitHashTable(&poolTable, TCL_STRING_KEYS);
+        poolTableInit = 1;
     }
 
-    /*
-     * Make sure this is a MySQL handle before accessing
-     * handle->connection.
-     */
-
-    if (Ns_DbDriverName(handle) != mysql_driver_name) {
-        Tcl_AppendResult(interp, "handle \"", argv[1], "\" is not of type \"",
-            mysql_driver_name, "\"", NULL);
-        return TCL_ERROR;
-    }
+    hPtr = Tcl_CreateHashEntry(&poolTable, poolname, &new);
+    if (new) {
+        pool = ns_calloc(1, sizeof(MySQLPool));
+        pool->name = Tcl_GetHashKey(&poolTable, hPtr);
 
-    if (STREQ(argv[1], "include_tablenames")) {
-        /* == [ns_mysql include_tablenames $db (on|off)] == */
-        if (argc != 4) {
-            Tcl_AppendResult(interp, "wrong # args: should be \"",
-                argv[0], " include_tablenames handle boolean\"", NULL);
-            return TCL_ERROR;
+        path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", poolname, NULL);
+        if (path == NULL
+            || !Ns_ConfigGetBool(path, "streaming", &pool->streaming)) {
+            pool->streaming = NS_FALSE;
         }
-        return Tcl_GetBoolean(interp, argv[3], &include_tablenames);
-    } else if (STREQ(argv[1], "list_dbs")) {
-        /* == [ns_mysql list_dbs $db ?wild?] == */
-        char           *wild;
-
-        if (argc < 3 || argc > 4) {
-            Tcl_AppendResult(interp, "wrong # args: should be \"",
-                argv[0], " list_dbs handle ?wild?\"", NULL);
-            return TCL_ERROR;
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "maxbufferedbytes",
+                                &pool->max_buffered)
+            || pool->max_buffered < 0) {
+            pool->max_buffered = 0;
         }
-        if (argc == 3) {
-            wild = NULL;
-        } else {
-            wild = argv[3];
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "stmtcachesize", &pool->max_stmts)) {
+            pool->max_stmts = 32;
         }
-        return Ns_MySQL_List_Dbs(interp, wild, handle);
-    } else if (STREQ(argv[1], "list_tables")) {
-        /* == [ns_mysql list_tables $db ?wild?] == */
-        char           *wild;
-
-        if (argc < 3 || argc > 4) {
-            Tcl_AppendResult(interp, "wrong # args: should be \"",
-                argv[0], " list_tables handle ?wild?\"", NULL);
-            return TCL_ERROR;
+        if (pool->max_stmts < 1) {
+            pool->max_stmts = 1;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetBool(path, "multistatements",
+                                 &pool->multistatements)) {
+            pool->multistatements = NS_FALSE;
         }
-        if (argc == 3) {
-            wild = NULL;
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "connections", &pool->connections)
+            || pool->connections < 1) {
+            pool->connections = 2;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetBool(path, "prewarm", &pool->prewarm)) {
+            pool->prewarm = NS_FALSE;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "keepalive", &pool->keepalive)
+            || pool->keepalive < 0) {
+            pool->keepalive = 0;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "slowquerytime", &pool->slow_ms)
+            || pool->slow_ms < 0) {
+            pool->slow_ms = 0;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetBool(path, "explainslow", &pool->explain_slow)) {
+            pool->explain_slow = NS_FALSE;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "explaininterval",
+                                &pool->explain_interval)
+            || pool->explain_interval < 0) {
+            pool->explain_interval = 10;
+        }
+        pool->compression = path == NULL ? NULL
+            : Ns_ConfigGetValue(path, "compression");
+        if (pool->compression != NULL
+            && (pool->compression[0] == '\0'
+                || STRIEQ(pool->compression, "off")
+                || STRIEQ(pool->compression, "uncompressed"))) {
+            pool->compression = NULL;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "compressionlevel",
+                                &pool->compression_level)
+            || pool->compression_level < 0) {
+            pool->compression_level = 0;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetBool(path, "localinfile", &pool->local_infile)) {
+            pool->local_infile = NS_FALSE;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "connecttimeout",
+                                &pool->connect_timeout)
+            || pool->connect_timeout < 0) {
+            pool->connect_timeout = 0;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "readtimeout", &pool->read_timeout)
+            || pool->read_timeout < 0) {
+            pool->read_timeout = 0;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "writetimeout", &pool->write_timeout)
+            || pool->write_timeout < 0) {
+            pool->write_timeout = 0;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "querytimeout", &pool->query_timeout)
+            || pool->query_timeout < 0) {
+            pool->query_timeout = 0;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "maxreplicalag", &pool->max_lag)
+            || pool->max_lag < 0) {
+            pool->max_lag = 30;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "replicacheck", &pool->replica_check)
+            || pool->replica_check < 1) {
+            pool->replica_check = 5;
+        }
+        SplitDatasource(pool, path == NULL ? NULL
+                        : Ns_ConfigGetValue(path, "datasource"));
+        SplitShards(pool, path == NULL ? NULL
+                    : Ns_ConfigGetValue(path, "shards"));
+        value = path == NULL ? NULL : Ns_ConfigGetValue(path, "shardhash");
+        if (value != NULL && STRIEQ(value, "modulo")) {
+            pool->shard_hash = SHARD_MODULO;
         } else {
-            wild = argv[3];
+            if (value != NULL && !STRIEQ(value, "crc32")) {
+                Ns_Log(Warning, "GetPool(%s): unknown shardhash '%s', "
+                    "using crc32.", poolname, value);
+            }
+            pool->shard_hash = SHARD_CRC32;
         }
-        return Ns_MySQL_List_Tables(interp, wild, handle);
-    } else if (STREQ(argv[1], "resultrows")) {
-        /* == [ns_mysql resultrows $db] == */
-        if (argc != 3) {
-            Tcl_AppendResult(interp, "wrong # args: should be \"",
-                argv[0], " resultrows handle\"", NULL);
-            return TCL_ERROR;
+        if (path == NULL
+            || !Ns_ConfigGetBool(path, "resetsession",
+                                 &pool->reset_session)) {
+            pool->reset_session = NS_FALSE;
         }
-        return Ns_MySQL_Resultrows(interp, handle);
-    } else if (STREQ(argv[1], "select_db")) {
-        /* == [ns_mysql select_db $db database] == */
-        if (argc != 4) {
-            Tcl_AppendResult(interp, "wrong # args: should be \"",
-                argv[0], " select_db handle database\"", NULL);
-            return TCL_ERROR;
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "writequeue", &pool->queue.max_depth)
+            || pool->queue.max_depth < 1) {
+            pool->queue.max_depth = 10000;
         }
-        return Ns_MySQL_Select_Db(interp, argv[3], handle);
-    } else if (STREQ(argv[1], "version")) {
-        /* == [ns_mysql version $db] == */
-        if (argc != 3) {
-            Tcl_AppendResult(interp, "wrong # args: should be \"",
-                argv[0], " version handle\"", NULL);
-            return TCL_ERROR;
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "writeinterval", &pool->queue.interval)
+            || pool->queue.interval < 0) {
+            pool->queue.interval = 1000;
         }
-        Tcl_SetResult(interp, mysql_driver_version, TCL_STATIC);
-        return TCL_OK;
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "writebatch", &pool->queue.max_batch)
+            || pool->queue.max_batch < 1) {
+            pool->queue.max_batch = 1000;
+        }
+        value = path == NULL ? NULL : Ns_ConfigGetValue(path, "writeoverflow");
+        if (value != NULL && STRIEQ(value, "dropoldest")) {
+            pool->queue.overflow = OVERFLOW_DROPOLDEST;
+        } else if (value != NULL && STRIEQ(value, "block")) {
+            pool->queue.overflow = OVERFLOW_BLOCK;
+        } else {
+            if (value != NULL && !STRIEQ(value, "drop")) {
+                Ns_Log(Warning, "GetPool(%s): unknown writeoverflow '%s', "
+                    "using drop.", poolname, value);
+            }
+            pool->queue.overflow = OVERFLOW_DROP;
+        }
+        if (path == NULL
+            || !Ns_ConfigGetInt(path, "writestoptimeout",
+                                &pool->queue.stop_timeout)
+            || pool->queue.stop_timeout < 0) {
+            pool->queue.stop_timeout = 30;
+        }
+
+        Tcl_SetHashValue(hPtr, pool);
     } else {
-        Tcl_AppendResult(interp, "unknown command \"", argv[1],
-            "\": should be list_dbs, list_tables, select_db, or "
-            "version.", NULL);
-        return TCL_ERROR;
+        pool = (MySQLPool *) Tcl_GetHashValue(hPtr);
     }
-    
-    return TCL_OK;
+    Ns_MutexUnlock(&poolLock);
+
+    return pool;
 }
 
+/*
+ * FindPool - The pool of that name if it uses the driver, else NULL.
+ * Ns_MySQL_ServerInit() has seen all of those.
+ */
 
-static int
-Ns_MySQLInterpInit(Tcl_Interp *interp, void *ignored)
+static MySQLPool *
+FindPool(char *poolname)
 {
-    Tcl_CreateCommand(interp, "ns_mysql", Ns_MySQL_Cmd, NULL, NULL);
+    Tcl_HashEntry  *hPtr = NULL;
 
-    return NS_OK;
+    Ns_MutexLock(&poolLock);
+    if (poolTableInit) {
+        hPtr = Tcl_FindHashEntry(&poolTable, poolname);
+    }
+    Ns_MutexUnlock(&poolLock);
+
+    return hPtr == NULL ? NULL : (MySQLPool *) Tcl_GetHashValue(hPtr);
 }
 
+/*
+ * PoolHandle - Fill in a handle that is none of the pool's with the
+ * pool's datasource and credentials, for the driver's own connections
+ * to its servers.
+ */
 
-static int
-Ns_MySQL_ServerInit(char *hServer, char *hModule, char *hDriver)
+static void
+PoolHandle(MySQLPool *pool, Ns_DbHandle *handle)
 {
-    return Ns_TclInitInterps(hServer, Ns_MySQLInterpInit, NULL);
+    char           *path;
+
+    path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", pool->name, NULL);
+    handle->driver = path == NULL ? NULL : Ns_ConfigGetValue(path, "driver");
+    if (handle->driver == NULL) {
+        handle->driver = mysql_driver_name;
+    }
+    handle->user = path == NULL ? NULL : Ns_ConfigGetValue(path, "user");
+    handle->password = path == NULL ? NULL
+        : Ns_ConfigGetValue(path, "password");
+    handle->datasource = pool->primary;
+    handle->poolname = pool->name;
+    Ns_DStringInit(&handle->dsExceptionMsg);
 }
 
+/*
+ * PrewarmPool - Startup callback that checks out every handle of a pool
+ * at once, which makes nsdb connect them, and returns them so the first
+ * requests find open connections.
+ */
 
 static void
-Log(Ns_DbHandle *handle, MYSQL *mysql)
+PrewarmPool(void *arg)
 {
-    Ns_LogSeverity  severity = Error;
-    unsigned int    nErr;
-    char            msg[MAX_ERROR_MSG + 1];
+    MySQLPool      *pool = (MySQLPool *) arg;
+    Ns_DbHandle   **handles;
+    int             i;
 
-    nErr = mysql_errno(mysql);
-    if (nErr) {
-        strncpy(msg, mysql_error(mysql), MAX_ERROR_MSG);
-        Ns_Log(severity, "MySQL log message: (%u) '%s'", nErr, msg);
+    handles = ns_malloc(pool->connections * sizeof(Ns_DbHandle *));
+    if (Ns_DbPoolTimedGetMultipleHandles(handles, pool->name,
+                                         pool->connections, 30) != NS_OK) {
+        Ns_Log(Warning, "PrewarmPool(%s): could not open %d connections.",
+            pool->name, pool->connections);
+    } else {
+        for (i = 0; i < pool->connections; i++) {
+            Ns_DbPoolPutHandle(handles[i]);
+        }
+        Ns_Log(Notice, "PrewarmPool(%s): opened %d connections.",
+            pool->name, pool->connections);
+    }
+    ns_free(handles);
+}
 
-        if (handle != NULL) {
-            sprintf(handle->cExceptionCode, "%u", nErr);
+/*
+ * KeepalivePool - Scheduled every "keepalive" seconds to keep a pool's
+ * idle connections alive, so that request threads do not find them
+ * dropped and pay for the reconnect.  As many idle handles as come
+ * free within a second are checked out, up to the pool's connections,
+ * and each is pinged; one whose connection has been dropped is
+ * reconnected in place before the handles go back to the pool.
+ */
+
+static void
+KeepalivePool(void *arg, int id)
+{
+    MySQLPool      *pool = (MySQLPool *) arg;
+    Ns_DbHandle   **handles;
+    MYSQL          *dbh;
+    int             i, n;
+
+    /* nsdb hands out all of the handles asked for or none. */
+    handles = ns_malloc(pool->connections * sizeof(Ns_DbHandle *));
+    for (n = pool->connections; n > 0; n /= 2) {
+        if (Ns_DbPoolTimedGetMultipleHandles(handles, pool->name, n, 1)
+            == NS_OK) {
+            break;
+        }
+    }
+
+    mysql_thread_init();
+    for (i = 0; i < n; i++) {
+        dbh = (MYSQL *) handles[i]->connection;
+        if (dbh == NULL || handles[i]->context == NULL
+            || mysql_ping(dbh) == 0) {
+            continue;
+        }
+        Log(handles[i], dbh);
+        Reopen(handles[i]);
+        if (handles[i]->connection == (void *) dbh) {
+            Ns_Log(Warning, "KeepalivePool(%s): could not reconnect %s.",
+                pool->name, handles[i]->datasource);
+        } else {
+            Ns_Log(Notice, "KeepalivePool(%s): reconnected %s.",
+                pool->name, handles[i]->datasource);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        Ns_DbPoolPutHandle(handles[i]);
+    }
+    mysql_thread_end();
+    ns_free(handles);
+}
+
+/*
+ * IsReplicaRead - Whether a statement may be sent to a replica: a read
+ * that neither locks rows nor depends on state of the session on the
+ * primary.  The words are matched anywhere in the statement, so a
+ * column that happens to contain one only costs a trip to the primary.
+ */
+
+static int
+IsReplicaRead(char *sql)
+{
+    static char    *session[] = {
+        "for update", "lock in share mode", "for share", "into",
+        "last_insert_id", "found_rows", "row_count", "get_lock",
+        "release_lock", "is_used_lock", "is_free_lock", "@", NULL
+    };
+    char          **w;
+    char           *p;
+
+    if (IsWrite(sql)) {
+        return 0;
+    }
+    for (p = sql; *p != '\0'; p++) {
+        for (w = session; *w != NULL; w++) {
+            if (strncasecmp(p, *w, strlen(*w)) == 0) {
+                return 0;
+            }
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * ReplicaLag - Ask replica i, over the pool's check connection to it,
+ * how many seconds it is behind.  A server that is not replicating is
+ * not behind at all.  Returns -1 if the replica cannot be reached or
+ * its replication has stopped.
+ */
+
+static long
+ReplicaLag(MySQLPool *pool, int i)
+{
+    MYSQL          *mysql = pool->replicas[i].check;
+    MYSQL_RES      *result;
+    MYSQL_FIELD    *fields;
+    MYSQL_ROW       row;
+    unsigned int    numcols, j;
+    long            lag;
+
+    if (mysql != NULL && mysql_ping(mysql) != 0) {
+        Log(NULL, mysql);
+        mysql_close(mysql);
+        pool->replicas[i].check = mysql = NULL;
+    }
+    if (mysql == NULL) {
+        mysql = Connect(&pool->checker, pool, pool->replicas[i].datasource,
+                        CLIENT_MULTI_RESULTS);
+        if (mysql == NULL) {
+            return -1;
+        }
+        pool->replicas[i].check = mysql;
+    }
+
+    /* SHOW SLAVE STATUS is gone from MySQL 8.4, its successor is new in 8.0.22. */
+    if (mysql_query(mysql, "SHOW REPLICA STATUS") != 0
+        && mysql_query(mysql, "SHOW SLAVE STATUS") != 0) {
+        Log(NULL, mysql);
+        return -1;
+    }
+    result = mysql_store_result(mysql);
+    if (result == NULL) {
+        Log(NULL, mysql);
+        return -1;
+    }
+
+    lag = 0;
+    row = mysql_fetch_row(result);
+    if (row != NULL) {
+        fields = mysql_fetch_fields(result);
+        numcols = mysql_num_fields(result);
+        lag = -1;
+        for (j = 0; j < numcols; j++) {
+            if (STRIEQ(fields[j].name, "Seconds_Behind_Source")
+                || STRIEQ(fields[j].name, "Seconds_Behind_Master")) {
+                lag = row[j] == NULL ? -1 : atol(row[j]);
+                break;
+            }
+        }
+    }
+    mysql_free_result(result);
+
+    return lag;
+}
+
+/*
+ * CheckPool - Scheduled every "replicacheck" seconds to refresh the
+ * health and lag of a pool's replicas, over connections of its own,
+ * so that no request waits for a slow or unreachable replica.
+ */
+
+static void
+CheckPool(void *arg, int id)
+{
+    MySQLPool      *pool = (MySQLPool *) arg;
+    MySQLReplica   *r;
+    long            lag;
+    int             i;
+
+    mysql_thread_init();
+    for (i = 0; i < pool->nreplicas; i++) {
+        r = &pool->replicas[i];
+        lag = ReplicaLag(pool, i);
+
+        Ns_MutexLock(&poolLock);
+        if (r->up != (lag >= 0)) {
+            Ns_Log(Notice, "CheckPool(%s): replica %s is %s, lag %ld.",
+                pool->name, r->datasource, lag >= 0 ? "up" : "down", lag);
+        }
+        r->up = (lag >= 0);
+        r->lag = lag;
+        r->checked = time(NULL);
+        Ns_MutexUnlock(&poolLock);
+    }
+    mysql_thread_end();
+}
+
+/*
+ * ReplicaDown - Take replica i out of rotation until its next check.
+ */
+
+static void
+ReplicaDown(MySQLPool *pool, int i)
+{
+    Ns_MutexLock(&poolLock);
+    pool->replicas[i].up = NS_FALSE;
+    pool->replicas[i].checked = time(NULL);
+    Ns_MutexUnlock(&poolLock);
+    Ns_Log(Warning, "ReplicaDown(%s): replica %s is down.",
+        pool->name, pool->replicas[i].datasource);
+}
+
+/*
+ * Route - Point handle->connection at the connection a statement should
+ * run on.  Reads go to the least lagging replica within "maxreplicalag",
+ * taking turns among equals; writes, statements in a transaction, and
+ * everything on a handle told to stay on the primary go to the primary,
+ * as does all of it when no replica qualifies.  So does everything once
+ * the home session has changed, by a USE, SET or temporary table, that
+ * the replica connections know nothing of.
+ */
+
+static void
+Route(Ns_DbHandle *handle, char *sql)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLPool      *pool;
+    MySQLReplica   *r;
+    int             i, n, best;
+
+    if (ctx == NULL || ctx->pool->nreplicas == 0 || ctx->force_primary
+        || ctx->shard >= 0) {
+        return;
+    }
+    pool = ctx->pool;
+
+    if ((ctx->primary->server_status & SERVER_STATUS_IN_TRANS)
+        || !(ctx->primary->server_status & SERVER_STATUS_AUTOCOMMIT)
+        || ctx->session_dirty || !IsReplicaRead(sql)) {
+        return;
+    }
+
+    best = -1;
+    Ns_MutexLock(&poolLock);
+    i = pool->replica_next++ % pool->nreplicas;
+    for (n = 0; n < pool->nreplicas; n++, i = (i + 1) % pool->nreplicas) {
+        r = &pool->replicas[i];
+        if (r->up && r->lag <= pool->max_lag
+            && (best < 0 || r->lag < pool->replicas[best].lag)) {
+            best = i;
+        }
+    }
+    Ns_MutexUnlock(&poolLock);
+    if (best < 0) {
+        return;
+    }
+
+    if (ctx->replicas[best] == NULL) {
+        ctx->replicas[best] = Connect(handle, pool,
+            pool->replicas[best].datasource, ClientFlags(pool));
+        if (ctx->replicas[best] == NULL) {
+            ReplicaDown(pool, best);
+            return;
+        }
+    }
+
+    ctx->replica = best;
+    handle->connection = (void *) ctx->replicas[best];
+    ATOMIC_ADD(&pool->replicas[best].queries, 1);
+}
+
+/*
+ * Query - Send a statement on handle->connection, giving up on it after
+ * the handle's timeout.  If that is a replica and the replica has gone
+ * away, take it out of rotation and send the statement to the primary
+ * instead.  Either way handle->connection may have changed on return.
+ */
+
+static int
+Query(Ns_DbHandle *handle, char *sql)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    Ns_Time         start, now, diff;
+    unsigned long   id;
+    unsigned int    nErr;
+    int             rc;
+
+    if (ctx == NULL) {
+        return mysql_query(mysql, sql);
+    }
+    if (ctx->lost) {
+        Ns_DStringFree(&handle->dsExceptionMsg);
+        Ns_DStringAppend(&handle->dsExceptionMsg,
+            "connection lost in a transaction, release the handle");
+        return 1;
+    }
+
+    id = mysql_thread_id(mysql);
+    if (ctx->timeout > 0) {
+        rc = TimedQuery(handle, sql, id);
+        if (rc == 0) {
+            SessionTrack(handle);
+        }
+        return rc;
+    }
+    Ns_GetTime(&start);
+    rc = mysql_query(mysql, sql);
+    if (rc == 0) {
+        SessionTrack(handle);
+        return rc;
+    }
+    nErr = mysql_errno(mysql);
+
+    /*
+     * The client library closes a connection whose read timed out, but
+     * the server goes on with the statement until it is killed.
+     */
+
+    if (nErr == CR_SERVER_LOST && ctx->pool->read_timeout > 0) {
+        Ns_GetTime(&now);
+        Ns_DiffTime(&now, &start, &diff);
+        if (diff.sec >= ctx->pool->read_timeout) {
+            Ns_Log(Warning, "Query(%s): no response in %ld seconds, "
+                "killing query %lu.", handle->datasource, (long) diff.sec,
+                id);
+            ATOMIC_ADD(&ctx->pool->stats.timeouts, 1);
+            KillQuery(handle, ConnSource(handle), id);
+            Log(handle, mysql);
+            Reopen(handle);
+            return rc;
+        }
+    }
+
+    if (ctx->replica < 0
+        || (nErr != CR_SERVER_GONE_ERROR && nErr != CR_SERVER_LOST)) {
+        return rc;
+    }
+    Log(NULL, mysql);
+    mysql_close(mysql);
+    ctx->replicas[ctx->replica] = NULL;
+    ReplicaDown(ctx->pool, ctx->replica);
+    ctx->replica = -1;
+    handle->connection = (void *) ctx->primary;
+
+    return mysql_query(ctx->primary, sql);
+}
+
+/*
+ * TimedQuery - Query for a handle with a timeout: send the statement
+ * and wait for its response for at most that long.  A statement still
+ * running then is killed, which makes the server answer with an error
+ * and leaves the connection usable.  Should the kill fail, the
+ * connection is shut down and reopened.  A replica is not failed over
+ * from here, a statement that timed out is not worth a second try.
+ */
+
+static int
+TimedQuery(Ns_DbHandle *handle, char *sql, unsigned long id)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    Ns_Time         timeout;
+    int             wait, state;
+
+    state = AsyncStart(mysql, sql, (unsigned long) strlen(sql), &wait);
+    if (state == ASYNC_PENDING) {
+        timeout.sec = ctx->timeout / 1000;
+        timeout.usec = (ctx->timeout % 1000) * 1000;
+        AsyncWait(&mysql, &wait, &state, 1, &timeout, 0);
+    }
+    if (state == ASYNC_PENDING) {
+        Ns_Log(Warning, "Query(%s): no response in %d ms, killing query %lu.",
+            handle->datasource, ctx->timeout, id);
+        ATOMIC_ADD(&ctx->pool->stats.timeouts, 1);
+        if (AsyncKill(handle, ConnSource(handle), mysql, id, &wait, &state)
+            != NS_OK) {
+            Log(handle, mysql);
+            Reopen(handle);
+            return 1;
+        }
+    }
+
+    return state == ASYNC_FAILED;
+}
+
+/*
+ * PrimarySource - The datasource of the handle's primary connection:
+ * the shard it is pinned to, if any, or the pool's primary.
+ */
+
+static char *
+PrimarySource(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    if (ctx != NULL && ctx->shard >= 0) {
+        return ctx->pool->shards[ctx->shard];
+    }
+    if (ctx != NULL && ctx->pool->primary != NULL) {
+        return ctx->pool->primary;
+    }
+    return handle->datasource;
+}
+
+/*
+ * ConnSource - The datasource of handle->connection.
+ */
+
+static char *
+ConnSource(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    if (ctx->replica >= 0) {
+        return ctx->pool->replicas[ctx->replica].datasource;
+    }
+    return PrimarySource(handle);
+}
+
+/*
+ * KillQuery - Stop the statement running on the connection with the
+ * given thread id, over a side connection to the same server.
+ */
+
+static int
+KillQuery(Ns_DbHandle *handle, char *source, unsigned long id)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *side;
+    char            sql[64];
+    int             status = NS_OK;
+
+    side = Connect(handle, ctx->pool, source, 0);
+    if (side == NULL) {
+        return NS_ERROR;
+    }
+    sprintf(sql, "KILL QUERY %lu", id);
+    if (mysql_query(side, sql) != 0) {
+        Log(NULL, side);
+        status = NS_ERROR;
+    }
+    mysql_close(side);
+
+    return status;
+}
+
+/*
+ * Reopen - Replace the connection of handle->connection, one that can
+ * no longer be used, with a new one.  A replica's is just closed and
+ * reopened when the next read is routed to it.  A primary that was in
+ * a transaction, or had autocommit off, is not: the rest of the
+ * transaction would run on the new connection in autocommit.  The
+ * handle is failed instead, the dead connection makes every statement
+ * fail, and it is reopened when the handle is released.
+ */
+
+static void
+Reopen(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    if (ctx->replica >= 0) {
+        mysql_close(ctx->replicas[ctx->replica]);
+        ctx->replicas[ctx->replica] = NULL;
+        ctx->replica = -1;
+        handle->connection = (void *) ctx->primary;
+        return;
+    }
+
+    if ((ctx->primary->server_status & SERVER_STATUS_IN_TRANS)
+        || !(ctx->primary->server_status & SERVER_STATUS_AUTOCOMMIT)) {
+        if (!ctx->lost) {
+            Ns_Log(Warning, "Reopen(%s): connection lost in a transaction, "
+                "failing the handle until it is released.",
+                handle->datasource);
+        }
+        ctx->lost = NS_TRUE;
+        return;
+    }
+    Reconnect(handle);
+}
+
+/*
+ * Reconnect - Replace the primary connection with a new one.  If the
+ * server cannot be reached, the old connection stays, and its errors,
+ * until the keepalive or the next user of the handle tries again.
+ */
+
+static void
+Reconnect(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLPool      *pool = ctx->pool;
+    MYSQL          *dbh;
+
+    ctx->lost = NS_FALSE;
+    dbh = Connect(handle, pool, PrimarySource(handle), ClientFlags(pool));
+    if (dbh == NULL) {
+        return;
+    }
+    CloseStmts(ctx);
+    mysql_close(ctx->primary);
+    if (ctx->shard >= 0) {
+        ctx->shards[ctx->shard] = dbh;
+    } else {
+        ctx->home = dbh;
+    }
+    ctx->primary = dbh;
+    ctx->max_packet = 0;
+    handle->connection = (void *) dbh;
+    if (dbh == ctx->home) {
+        SessionLoad(handle);
+    }
+}
+
+/*
+ * UseShard - Pin the handle to a shard, or with -1 take it back to the
+ * pool's own primary.  The shard's connection then stands in for the
+ * primary in everything the handle does.  Prepared statements belong
+ * to the connection they were prepared on, so they are closed.
+ */
+
+static int
+UseShard(Ns_DbHandle *handle, int shard)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLPool      *pool = ctx->pool;
+
+    if (shard == ctx->shard) {
+        return NS_OK;
+    }
+    FreeResult(handle);
+    if (shard >= 0 && ctx->shards[shard] == NULL) {
+        ctx->shards[shard] = Connect(handle, pool, pool->shards[shard],
+                                     ClientFlags(pool));
+        if (ctx->shards[shard] == NULL) {
+            return NS_ERROR;
+        }
+    }
+    CloseStmts(ctx);
+    ctx->shard = shard;
+    ctx->primary = shard >= 0 ? ctx->shards[shard] : ctx->home;
+    ctx->max_packet = 0;
+    handle->connection = (void *) ctx->primary;
+
+    return NS_OK;
+}
+
+/*
+ * ShardOf - The shard a key belongs to under the pool's shardhash, or
+ * -1 for a key that is not an integer under "modulo".  CRC32 is
+ * computed bit by bit; keys are short.
+ */
+
+static int
+ShardOf(MySQLPool *pool, Tcl_Obj *keyObj)
+{
+    Tcl_WideInt     n;
+    unsigned char  *p;
+    unsigned long   crc;
+    int             len, bit;
+
+    if (pool->shard_hash == SHARD_MODULO) {
+        if (Tcl_GetWideIntFromObj(NULL, keyObj, &n) != TCL_OK) {
+            return -1;
+        }
+        n %= pool->nshards;
+        return (int) (n < 0 ? n + pool->nshards : n);
+    }
+
+    p = (unsigned char *) Tcl_GetStringFromObj(keyObj, &len);
+    crc = 0xFFFFFFFFUL;
+    while (len-- > 0) {
+        crc ^= *p++;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320UL & (0UL - (crc & 1)));
+        }
+    }
+    crc ^= 0xFFFFFFFFUL;
+
+    return (int) (crc % (unsigned long) pool->nshards);
+}
+
+/*
+ * SessionClear - Forget what is known of the home connection's session.
+ */
+
+static void
+SessionClear(MySQLContext *ctx)
+{
+    int             i;
+
+    for (i = 0; i < SESSION_VARS; i++) {
+        ns_free(ctx->session[i]);
+        ctx->session[i] = NULL;
+    }
+    ns_free(ctx->schema);
+    ns_free(ctx->names);
+    ctx->schema = NULL;
+    ctx->names = NULL;
+    ctx->schema_tracked = NS_FALSE;
+    ctx->session_dirty = NS_FALSE;
+}
+
+#ifdef HAVE_SESSION_TRACK
+/*
+ * SessionListed - Whether name is in a session_track_system_variables
+ * list.
+ */
+
+static int
+SessionListed(char *list, char *name)
+{
+    size_t          len = strlen(name);
+    char           *p;
+
+    for (p = list; *p != '\0'; p++) {
+        while (*p == ',' || isspace(UCHAR(*p))) {
+            p++;
+        }
+        if (*p == '*' || (strncasecmp(p, name, len) == 0
+                          && (p[len] == ',' || p[len] == '\0'
+                              || isspace(UCHAR(p[len]))))) {
+            return NS_TRUE;
+        }
+        p = strchr(p, ',');
+        if (p == NULL) {
+            break;
+        }
+    }
+
+    return NS_FALSE;
+}
+#endif
+
+/*
+ * SessionLoad - Read the session state of a new or reset home
+ * connection.  Only the schema and the variables the server will
+ * report changes of are kept; the rest stay unknown and statements
+ * setting them are always sent.
+ */
+
+static void
+SessionLoad(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+#ifdef HAVE_SESSION_TRACK
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    int             i;
+#endif
+
+    SessionClear(ctx);
+
+#ifdef HAVE_SESSION_TRACK
+    /* The variables in the order of sessionVars. */
+    if (mysql_query(ctx->home, "SELECT DATABASE(), @@session_track_schema, "
+            "@@session_track_system_variables, @@time_zone, "
+            "@@character_set_client, @@character_set_connection, "
+            "@@character_set_results, @@collation_connection, "
+            "@@sql_mode") != 0
+        || (result = mysql_store_result(ctx->home)) == NULL) {
+        Ns_Log(Notice, "SessionLoad(%s): not tracking session state: %s",
+            handle->datasource, mysql_error(ctx->home));
+        return;
+    }
+    row = mysql_fetch_row(result);
+    if (row != NULL) {
+        ctx->schema_tracked = row[1] != NULL
+            && (STREQ(row[1], "1") || STRIEQ(row[1], "ON"));
+        if (ctx->schema_tracked && row[0] != NULL) {
+            ctx->schema = ns_strdup(row[0]);
+        }
+        for (i = 0; i < SESSION_VARS; i++) {
+            if (row[2] != NULL && row[3 + i] != NULL
+                && SessionListed(row[2], sessionVars[i])) {
+                ctx->session[i] = ns_strdup(row[3 + i]);
+            }
+        }
+    }
+    mysql_free_result(result);
+#endif
+}
+
+/*
+ * SessionTrack - Take in the changes to the session the server
+ * reported with the last response on the home connection.
+ */
+
+static void
+SessionTrack(Ns_DbHandle *handle)
+{
+#ifdef HAVE_SESSION_TRACK
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    const char     *data, *value;
+    size_t          len, vlen;
+    int             i;
+
+    if (ctx == NULL || mysql == NULL || mysql != ctx->home) {
+        return;
+    }
+    if (mysql_session_track_get_first(mysql, SESSION_TRACK_STATE_CHANGE,
+                                      &data, &len) == 0) {
+        ctx->session_dirty = NS_TRUE;
+    }
+    if (mysql_session_track_get_first(mysql, SESSION_TRACK_SCHEMA,
+                                      &data, &len) == 0) {
+        ctx->session_dirty = NS_TRUE;
+        if (ctx->schema_tracked) {
+            ns_free(ctx->schema);
+            ctx->schema = ns_malloc(len + 1);
+            memcpy(ctx->schema, data, len);
+            ctx->schema[len] = '\0';
+        }
+    }
+
+    /* Name and value come in turn. */
+    if (mysql_session_track_get_first(mysql, SESSION_TRACK_SYSTEM_VARIABLES,
+                                      &data, &len) != 0) {
+        return;
+    }
+    do {
+        if (mysql_session_track_get_next(mysql,
+                SESSION_TRACK_SYSTEM_VARIABLES, &value, &vlen) != 0) {
+            break;
+        }
+        ctx->session_dirty = NS_TRUE;
+        for (i = 0; i < SESSION_VARS; i++) {
+            if (strlen(sessionVars[i]) != len
+                || strncasecmp(sessionVars[i], data, len) != 0) {
+                continue;
+            }
+            if (ctx->session[i] != NULL) {
+                ns_free(ctx->session[i]);
+                ctx->session[i] = ns_malloc(vlen + 1);
+                memcpy(ctx->session[i], value, vlen);
+                ctx->session[i][vlen] = '\0';
+            }
+            if (i >= SESSION_CHARSET && i < SESSION_CHARSET + 4) {
+                ns_free(ctx->names);
+                ctx->names = NULL;
+            }
+            break;
+        }
+    } while (mysql_session_track_get_next(mysql,
+                 SESSION_TRACK_SYSTEM_VARIABLES, &data, &len) == 0);
+#endif
+}
+
+/*
+ * SessionWord - Parse a bare or quoted word at p, setting *startPtr and
+ * *lenPtr to it without quotes.  Returns where it ends, or NULL for
+ * anything else, including quoted words with escapes in them.
+ */
+
+static char *
+SessionWord(char *p, char **startPtr, int *lenPtr)
+{
+    char           *start, quote;
+
+    if (*p == '\'' || *p == '"' || *p == '`') {
+        quote = *p++;
+        for (start = p; *p != quote; p++) {
+            if (*p == '\0' || *p == '\\') {
+                return NULL;
+            }
+        }
+        *startPtr = start;
+        *lenPtr = (int) (p - start);
+        return p + 1;
+    }
+    for (start = p; isalnum(UCHAR(*p))
+         || (*p != '\0' && strchr("_+-:./", *p) != NULL); p++)
+        ;
+    if (p == start) {
+        return NULL;
+    }
+    *startPtr = start;
+    *lenPtr = (int) (p - start);
+
+    return p;
+}
+
+/*
+ * SessionParse - Classify a statement as one that may change the
+ * session: "USE db", "SET NAMES charset" or "SET [SESSION] var = value"
+ * on their own, with *valuePtr and for SET also *namePtr set, or some
+ * other USE or SET.
+ */
+
+static int
+SessionParse(char *sql, char **namePtr, int *nlenPtr, char **valuePtr,
+             int *vlenPtr)
+{
+    char           *p = sql, *name;
+    int             kind;
+
+    while (isspace(UCHAR(*p))) {
+        p++;
+    }
+    if (strncasecmp(p, "use", 3) == 0 && isspace(UCHAR(p[3]))) {
+        kind = SESSION_USE;
+        p += 3;
+    } else if (strncasecmp(p, "set", 3) == 0 && isspace(UCHAR(p[3]))) {
+        for (p += 3; isspace(UCHAR(*p)); p++)
+            ;
+        if (strncasecmp(p, "names", 5) == 0 && isspace(UCHAR(p[5]))) {
+            kind = SESSION_NAMES;
+            p += 5;
+        } else {
+            if (strncasecmp(p, "session", 7) == 0 && isspace(UCHAR(p[7]))) {
+                p += 7;
+            } else if (strncasecmp(p, "local", 5) == 0
+                       && isspace(UCHAR(p[5]))) {
+                p += 5;
+            }
+            while (isspace(UCHAR(*p))) {
+                p++;
+            }
+            if (strncasecmp(p, "@@session.", 10) == 0) {
+                p += 10;
+            } else if (strncasecmp(p, "@@local.", 8) == 0) {
+                p += 8;
+            } else if (p[0] == '@' && p[1] == '@' && strchr(p, '.') == NULL) {
+                p += 2;
+            }
+            for (name = p; isalnum(UCHAR(*p)) || *p == '_'; p++)
+                ;
+            if (p == name) {
+                return SESSION_OTHER;
+            }
+            *namePtr = name;
+            *nlenPtr = (int) (p - name);
+            while (isspace(UCHAR(*p))) {
+                p++;
+            }
+            if (*p == ':' && p[1] == '=') {
+                p += 2;
+            } else if (*p == '=') {
+                p++;
+            } else {
+                return SESSION_OTHER;
+            }
+            kind = SESSION_VAR;
+        }
+    } else {
+        return SESSION_NONE;
+    }
+
+    while (isspace(UCHAR(*p))) {
+        p++;
+    }
+    p = SessionWord(p, valuePtr, vlenPtr);
+    if (p == NULL) {
+        return SESSION_OTHER;
+    }
+    while (isspace(UCHAR(*p)) || *p == ';') {
+        p++;
+    }
+
+    return *p == '\0' ? kind : SESSION_OTHER;
+}
+
+/*
+ * SessionSkip - Whether a statement about to be sent on the home
+ * connection would leave its session as it is, so that it need not
+ * be sent.
+ */
+
+static int
+SessionSkip(Ns_DbHandle *handle, char *sql)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    char           *name = NULL, *value = NULL, *known = NULL;
+    int             nlen = 0, vlen = 0, i, on, skip = NS_FALSE;
+
+    if (ctx == NULL || mysql == NULL || mysql != ctx->home) {
+        return NS_FALSE;
+    }
+
+    switch (SessionParse(sql, &name, &nlen, &value, &vlen)) {
+    case SESSION_USE:
+        known = ctx->schema;
+        skip = known != NULL && strlen(known) == (size_t) vlen
+            && strncmp(known, value, (size_t) vlen) == 0;
+        break;
+
+    case SESSION_NAMES:
+        known = ctx->names;
+        break;
+
+    case SESSION_VAR:
+        /* The server tells whether autocommit is on with every response. */
+        if (nlen == 10 && strncasecmp(name, "autocommit", 10) == 0) {
+            on = (vlen == 1 && *value == '1')
+                || (vlen == 2 && strncasecmp(value, "on", 2) == 0)
+                || (vlen == 4 && strncasecmp(value, "true", 4) == 0);
+            if (on || (vlen == 1 && *value == '0')
+                || (vlen == 3 && strncasecmp(value, "off", 3) == 0)
+                || (vlen == 5 && strncasecmp(value, "false", 5) == 0)) {
+                skip = on == ((mysql->server_status
+                               & SERVER_STATUS_AUTOCOMMIT) != 0);
+            }
+            break;
+        }
+        for (i = 0; i < SESSION_VARS; i++) {
+            if (strlen(sessionVars[i]) == (size_t) nlen
+                && strncasecmp(sessionVars[i], name, (size_t) nlen) == 0) {
+                known = ctx->session[i];
+                break;
+            }
+        }
+        break;
+
+    default:
+        return NS_FALSE;
+    }
+
+    if (known != NULL && !skip) {
+        skip = strlen(known) == (size_t) vlen
+            && strncasecmp(known, value, (size_t) vlen) == 0;
+    }
+    if (skip) {
+        ATOMIC_ADD(&ctx->pool->stats.skipped, 1);
+        if (handle->verbose)
+            Ns_Log(Notice, "SessionSkip(%s): already in effect: %s",
+                handle->datasource, sql);
+    }
+
+    return skip;
+}
+
+/*
+ * SessionDone - Note a statement that has run on the home connection.
+ * A USE, SET or CREATE TEMPORARY TABLE leaves the session to be reset,
+ * and after SET NAMES the character set is known for as long as the
+ * server reports no change to it.
+ */
+
+static void
+SessionDone(Ns_DbHandle *handle, char *sql)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    char           *name, *value, *p;
+    int             nlen, vlen, kind, i;
+
+    if (ctx == NULL || handle->connection != (void *) ctx->home) {
+        return;
+    }
+    for (p = sql; isspace(UCHAR(*p)); p++)
+        ;
+    if (strncasecmp(p, "create", 6) == 0 && isspace(UCHAR(p[6]))) {
+        for (p += 6; isspace(UCHAR(*p)); p++)
+            ;
+        if (strncasecmp(p, "temporary", 9) == 0 && isspace(UCHAR(p[9]))) {
+            ctx->session_dirty = NS_TRUE;
+            return;
+        }
+    }
+    kind = SessionParse(sql, &name, &nlen, &value, &vlen);
+    if (kind == SESSION_NONE) {
+        return;
+    }
+    ctx->session_dirty = NS_TRUE;
+    if (kind != SESSION_NAMES) {
+        return;
+    }
+    for (i = SESSION_CHARSET; i < SESSION_CHARSET + 4; i++) {
+        if (ctx->session[i] == NULL) {
+            return;
+        }
+    }
+    ns_free(ctx->names);
+    ctx->names = ns_malloc((size_t) vlen + 1);
+    memcpy(ctx->names, value, (size_t) vlen);
+    ctx->names[vlen] = '\0';
+}
+
+/*
+ * SessionReset - Put a handle's home connection back in the state of a
+ * new one with mysql_reset_connection(), if anything was changed: the
+ * session, a transaction left open or autocommit turned off.  That
+ * also drops the connection's prepared statements.  If the reset
+ * fails, the connection is replaced.
+ */
+
+static void
+SessionReset(Ns_DbHandle *handle)
+{
+#ifdef HAVE_SESSION_TRACK
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = ctx->home;
+
+    if (!ctx->session_dirty
+        && !(mysql->server_status & SERVER_STATUS_IN_TRANS)
+        && (mysql->server_status & SERVER_STATUS_AUTOCOMMIT)) {
+        return;
+    }
+
+    FreeResult(handle);
+    CloseStmts(ctx);
+    ATOMIC_ADD(&ctx->pool->stats.resets, 1);
+    if (mysql_reset_connection(mysql) != 0) {
+        Log(handle, mysql);
+        Reconnect(handle);
+        return;
+    }
+    SessionLoad(handle);
+#endif
+}
+
+/*
+ * UsePrimary - Point handle->connection back at the primary after a
+ * read on a replica: always when the result is done with, otherwise as
+ * soon as the result no longer needs the replica's connection.
+ */
+
+static void
+UsePrimary(Ns_DbHandle *handle, int always)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    if (ctx == NULL || ctx->replica < 0) {
+        return;
+    }
+    if (!always && (ctx->unbuffered
+                    || mysql_more_results((MYSQL *) handle->connection))) {
+        return;
+    }
+    ctx->replica = -1;
+    handle->connection = (void *) ctx->primary;
+}
+
+/*
+ * ReadAhead - Copy rows of an unbuffered result into the handle until
+ * either the result ends or max_buffered bytes have been read.  A
+ * result that ends in time is as good as a stored one and frees the
+ * connection; a larger one keeps streaming after the copied rows.
+ */
+
+static void
+ReadAhead(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL_RES      *result = (MYSQL_RES *) handle->statement;
+    MYSQL_ROW       row, copy;
+    unsigned long  *lengths;
+    unsigned int    i;
+    size_t          size;
+    long            bytes = 0;
+    char           *data;
+
+    while (bytes < ctx->max_buffered) {
+        row = mysql_fetch_row(result);
+        if (row == NULL) {
+            if (mysql_errno((MYSQL *) handle->connection)) {
+                Log(handle, (MYSQL *) handle->connection);
+            } else {
+                ctx->unbuffered = NS_FALSE;
+            }
+            break;
+        }
+        lengths = mysql_fetch_lengths(result);
+
+        size = ctx->numcols * (sizeof(char *) + sizeof(unsigned long));
+        for (i = 0; i < ctx->numcols; i++) {
+            if (row[i] != NULL) {
+                size += lengths[i] + 1;
+            }
+        }
+
+        /* The values, their lengths, then the data. */
+        copy = ns_malloc(size);
+        memcpy(copy + ctx->numcols, lengths,
+               ctx->numcols * sizeof(unsigned long));
+        data = (char *) ((unsigned long *) (copy + ctx->numcols)
+                         + ctx->numcols);
+        for (i = 0; i < ctx->numcols; i++) {
+            if (row[i] == NULL) {
+                copy[i] = NULL;
+            } else {
+                memcpy(data, row[i], lengths[i]);
+                data[lengths[i]] = '\0';
+                copy[i] = data;
+                data += lengths[i] + 1;
+            }
+        }
+
+        if (ctx->ahead_count == ctx->ahead_size) {
+            ctx->ahead_size = ctx->ahead_size ? ctx->ahead_size * 2 : 64;
+            ctx->ahead = ns_realloc(ctx->ahead,
+                                    ctx->ahead_size * sizeof(MYSQL_ROW));
+        }
+        ctx->ahead[ctx->ahead_count++] = copy;
+        bytes += size;
+    }
+
+    if (handle->verbose)
+        Ns_Log(Notice, "ReadAhead(%s): %d rows, %ld bytes, %s.",
+            handle->datasource, ctx->ahead_count, bytes,
+            ctx->unbuffered ? "streaming" : "complete");
+}
+
+/*
+ * StoreResult - Pick up the result of the last query, either buffered
+ * in full with mysql_store_result() or streamed with mysql_use_result()
+ * depending on the handle's settings, and make it the handle's current
+ * statement.
+ */
+
+static MYSQL_RES *
+StoreResult(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL_RES      *result;
+    int             unbuffered;
+
+    unbuffered = (ctx != NULL && (ctx->streaming || ctx->max_buffered > 0));
+
+    if (unbuffered) {
+        result = mysql_use_result((MYSQL *) handle->connection);
+    } else {
+        result = mysql_store_result((MYSQL *) handle->connection);
+    }
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (result == NULL) {
+        return NULL;
+    }
+
+    handle->statement = (void *) result;
+    handle->fetchingRows = NS_TRUE;
+
+    if (ctx != NULL) {
+        ctx->unbuffered = unbuffered;
+        ctx->numcols = mysql_num_fields(result);
+        if (unbuffered && !ctx->streaming) {
+            ReadAhead(handle);
+        }
+    }
+
+    return result;
+}
+
+/*
+ * FetchRow - Return the next row of the current statement, serving any
+ * read-ahead rows first, and the lengths of its values in *lengthsPtr.
+ * For a prepared statement, text says whether numeric values are to be
+ * formatted, see StmtFetchRow().
+ */
+
+static MYSQL_ROW
+FetchRow(Ns_DbHandle *handle, unsigned long **lengthsPtr, int text)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL_ROW       row = NULL;
+    unsigned int    i;
+
+    if (ctx == NULL) {
+        row = mysql_fetch_row((MYSQL_RES *) handle->statement);
+        if (row != NULL) {
+            *lengthsPtr = mysql_fetch_lengths((MYSQL_RES *) handle->statement);
+        }
+        return row;
+    }
+
+    if (ctx->stmt != NULL) {
+        row = StmtFetchRow(handle, ctx->stmt, lengthsPtr, text);
+    } else if (ctx->ahead_count > 0) {
+        /* The previous read-ahead row has been copied out by now. */
+        if (ctx->ahead_next > 0) {
+            ns_free(ctx->ahead[ctx->ahead_next - 1]);
+            ctx->ahead[ctx->ahead_next - 1] = NULL;
+        }
+        if (ctx->ahead_next < ctx->ahead_count) {
+            row = ctx->ahead[ctx->ahead_next++];
+            *lengthsPtr = (unsigned long *) (row + ctx->numcols);
+        }
+    }
+
+    if (row == NULL && ctx->stmt == NULL) {
+        row = mysql_fetch_row((MYSQL_RES *) handle->statement);
+        if (row != NULL) {
+            *lengthsPtr = mysql_fetch_lengths((MYSQL_RES *) handle->statement);
+        }
+    }
+
+    if (row != NULL) {
+        for (i = 0; i < ctx->numcols; i++) {
+            ctx->bytes_received += (*lengthsPtr)[i];
+        }
+        ctx->fetched++;
+    }
+
+    return row;
+}
+
+/*
+ * FreeResult - Dispose of the handle's current statement, if any.  For
+ * an unbuffered result mysql_free_result() reads and discards the rows
+ * still on the wire, which leaves the connection ready for reuse.
+ */
+
+static void
+FreeResult(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    int             i;
+
+    /*
+     * A query sent with [ns_mysql send] that nobody waited for is
+     * killed rather than waited out.
+     */
+
+    if (ctx != NULL && ctx->async) {
+        if (ctx->async_state == ASYNC_PENDING
+            && AsyncKill(handle, ConnSource(handle),
+                         (MYSQL *) handle->connection,
+                         mysql_thread_id((MYSQL *) handle->connection),
+                         &ctx->async_wait, &ctx->async_state) != NS_OK) {
+            ctx->async = NS_FALSE;
+            Log(handle, (MYSQL *) handle->connection);
+            Reopen(handle);
+            if (ctx->async_sql != NULL) {
+                CacheInvalidate(handle, ctx->async_sql);
+                ns_free(ctx->async_sql);
+                ctx->async_sql = NULL;
+            }
+        } else {
+            AsyncCollect(handle);
+        }
+    }
+
+    if (ctx != NULL) {
+        if (ctx->fp_pending) {
+            ProfileRows(ctx->fp_hash, ctx->fetched);
+            ctx->fp_pending = NS_FALSE;
+        }
+        for (i = 0; i < ctx->ahead_count; i++) {
+            ns_free(ctx->ahead[i]);
+        }
+        ctx->ahead_count = 0;
+        ctx->ahead_next = 0;
+        ctx->unbuffered = NS_FALSE;
+        ctx->numcols = 0;
+        ctx->nulls_count = 0;
+        ctx->failed = NS_FALSE;
+        if (ctx->stmt != NULL) {
+            mysql_stmt_free_result(ctx->stmt->stmt);
+            ctx->stmt = NULL;
+        }
+    }
+
+    if (handle->statement != NULL) {
+        mysql_free_result((MYSQL_RES *) handle->statement);
+        handle->statement = NULL;
+    }
+    handle->fetchingRows = NS_FALSE;
+
+    DrainResults(handle);
+    UsePrimary(handle, NS_TRUE);
+}
+
+/*
+ * FreePending - Dispose of a result that would leave the connection out
+ * of sync for another command: one being streamed unbuffered, or a
+ * query sent with [ns_mysql send].  A stored result may stay open.
+ */
+
+static void
+FreePending(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    if (ctx != NULL && (ctx->unbuffered || ctx->async)) {
+        FreeResult(handle);
+    }
+}
+
+/*
+ * DrainResults - Read and discard any results still pending after the
+ * current one, as left by CALL or a multi-statement query, so that the
+ * next query is not out of sync.  Returns NS_ERROR if one of the later
+ * statements failed; the server runs none after it.
+ */
+
+static int
+DrainResults(Ns_DbHandle *handle)
+{
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    MYSQL_RES      *result;
+    int             status, rc = NS_OK;
+
+    if (mysql == NULL) {
+        return NS_OK;
+    }
+
+    while (mysql_more_results(mysql)) {
+        status = mysql_next_result(mysql);
+        if (status > 0) {
+            Log(handle, mysql);
+            rc = NS_ERROR;
+            break;
+        }
+        if (status < 0) {
+            break;
+        }
+        result = mysql_use_result(mysql);
+        if (result != NULL) {
+            mysql_free_result(result);
+        }
+    }
+
+    /* What a procedure changed is reported at the end of its results. */
+    SessionTrack(handle);
+
+    return rc;
+}
+
+/*
+ * CloseStmt - Close a cached prepared statement and release its
+ * bindings.
+ */
+
+static void
+CloseStmt(MySQLContext *ctx, MySQLStmt *st)
+{
+    unsigned int    i;
+
+    if (st->prev != NULL) {
+        st->prev->next = st->next;
+    } else {
+        ctx->lru_head = st->next;
+    }
+    if (st->next != NULL) {
+        st->next->prev = st->prev;
+    } else {
+        ctx->lru_tail = st->prev;
+    }
+    Tcl_DeleteHashEntry(st->hPtr);
+    ctx->nstmts--;
+
+    mysql_stmt_close(st->stmt);
+    for (i = 0; i < st->numcols; i++) {
+        ns_free(st->cols[i].buf);
+    }
+    ns_free(st->params);
+    ns_free(st->binds);
+    ns_free(st->cols);
+    ns_free(st->values);
+    ns_free(st->lengths);
+    ns_free(st);
+}
+
+static void
+CloseStmts(MySQLContext *ctx)
+{
+    ctx->stmt = NULL;
+    while (ctx->lru_head != NULL) {
+        CloseStmt(ctx, ctx->lru_head);
+    }
+}
+
+/*
+ * GetStmt - Return the prepared statement for sql, preparing it on the
+ * server on a cache miss and evicting the least recently used one when
+ * the handle already holds its pool's stmtcachesize statements.
+ */
+
+static MySQLStmt *
+GetStmt(Ns_DbHandle *handle, char *sql)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLStmt      *st;
+    MYSQL_STMT     *stmt;
+    Tcl_HashEntry  *hPtr;
+    int             new;
+
+    hPtr = Tcl_FindHashEntry(&ctx->stmts, sql);
+    if (hPtr != NULL) {
+        st = (MySQLStmt *) Tcl_GetHashValue(hPtr);
+        if (st != ctx->lru_head) {
+            st->prev->next = st->next;
+            if (st->next != NULL) {
+                st->next->prev = st->prev;
+            } else {
+                ctx->lru_tail = st->prev;
+            }
+            st->prev = NULL;
+            st->next = ctx->lru_head;
+            ctx->lru_head->prev = st;
+            ctx->lru_head = st;
+        }
+        return st;
+    }
+
+    stmt = mysql_stmt_init((MYSQL *) handle->connection);
+    if (stmt == NULL) {
+        Log(handle, (MYSQL *) handle->connection);
+        return NULL;
+    }
+    if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+        StmtLog(handle, stmt);
+        mysql_stmt_close(stmt);
+        return NULL;
+    }
+
+    while (ctx->nstmts >= ctx->pool->max_stmts) {
+        MySQLStmt      *victim = ctx->lru_tail;
+
+        /* Never the statement rows are still being fetched from. */
+        if (victim != NULL && victim == ctx->stmt) {
+            victim = victim->prev;
+        }
+        if (victim == NULL) {
+            break;
+        }
+        CloseStmt(ctx, victim);
+    }
+
+    st = ns_calloc(1, sizeof(MySQLStmt));
+    st->stmt = stmt;
+    st->nparams = mysql_stmt_param_count(stmt);
+    if (st->nparams > 0) {
+        st->params = ns_calloc(st->nparams, sizeof(MYSQL_BIND));
+    }
+
+    st->hPtr = Tcl_CreateHashEntry(&ctx->stmts, sql, &new);
+    Tcl_SetHashValue(st->hPtr, st);
+    st->next = ctx->lru_head;
+    if (ctx->lru_head != NULL) {
+        ctx->lru_head->prev = st;
+    } else {
+        ctx->lru_tail = st;
+    }
+    ctx->lru_head = st;
+    ctx->nstmts++;
+
+    if (handle->verbose)
+        Ns_Log(Notice, "GetStmt(%s): prepared %lu parameter statement, "
+            "%d cached.", handle->datasource, st->nparams, ctx->nstmts);
+
+    return st;
+}
+
+/*
+ * StmtBindResult - Bind the result columns of a statement.  Integer and
+ * floating point columns are received in binary form, everything else,
+ * ZEROFILL integers included, as text into a buffer that grows when a
+ * value does not fit.
+ */
+
+static int
+StmtBindResult(Ns_DbHandle *handle, MySQLStmt *st, MYSQL_RES *meta)
+{
+    MYSQL_FIELD    *fields;
+    MYSQL_BIND     *bind;
+    StmtColumn     *col;
+    unsigned int    i;
+
+    if (st->binds == NULL) {
+        st->numcols = mysql_num_fields(meta);
+        fields = mysql_fetch_fields(meta);
+        st->binds = ns_calloc(st->numcols, sizeof(MYSQL_BIND));
+        st->cols = ns_calloc(st->numcols, sizeof(StmtColumn));
+        st->values = ns_calloc(st->numcols, sizeof(char *));
+        st->lengths = ns_calloc(st->numcols, sizeof(unsigned long));
+
+        for (i = 0; i < st->numcols; i++) {
+            bind = &st->binds[i];
+            col = &st->cols[i];
+
+            switch (ColumnKind(&fields[i]) == KIND_STRING
+                    ? MYSQL_TYPE_STRING : fields[i].type) {
+            case MYSQL_TYPE_TINY:
+            case MYSQL_TYPE_SHORT:
+            case MYSQL_TYPE_INT24:
+            case MYSQL_TYPE_LONG:
+            case MYSQL_TYPE_LONGLONG:
+            case MYSQL_TYPE_YEAR:
+                col->type = MYSQL_TYPE_LONGLONG;
+                col->is_unsigned = (fields[i].flags & UNSIGNED_FLAG) != 0;
+                bind->buffer = &col->num.i;
+                break;
+            case MYSQL_TYPE_FLOAT:
+                col->type = MYSQL_TYPE_FLOAT;
+                bind->buffer = &col->num.f;
+                break;
+            case MYSQL_TYPE_DOUBLE:
+                col->type = MYSQL_TYPE_DOUBLE;
+                bind->buffer = &col->num.d;
+                break;
+            default:
+                col->type = MYSQL_TYPE_STRING;
+                col->size = fields[i].length + 1;
+                if (col->size > 1024 || fields[i].length == 0) {
+                    col->size = 1024;
+                }
+                col->buf = ns_malloc(col->size);
+                bind->buffer = col->buf;
+                bind->buffer_length = col->size - 1;
+                break;
+            }
+            bind->buffer_type = col->type;
+            bind->is_unsigned = col->is_unsigned;
+            bind->length = &col->length;
+            bind->is_null = &col->is_null;
+            bind->error = &col->error;
+        }
+    }
+
+    if (mysql_stmt_bind_result(st->stmt, st->binds) != 0) {
+        StmtLog(handle, st->stmt);
+        return NS_ERROR;
+    }
+
+    return NS_OK;
+}
+
+/*
+ * StmtFetchRow - Fetch the next row of a prepared statement and return
+ * it in the same form as mysql_fetch_row() and mysql_fetch_lengths().
+ * Unless text is set, numeric values are left in binary form in the
+ * columns for StmtValueObj(), and only their lengths are filled in.
+ */
+
+static MYSQL_ROW
+StmtFetchRow(Ns_DbHandle *handle, MySQLStmt *st, unsigned long **lengthsPtr,
+             int text)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    StmtColumn     *col;
+    unsigned int    i;
+    int             rc;
+
+    rc = mysql_stmt_fetch(st->stmt);
+    if (rc == MYSQL_NO_DATA) {
+        return NULL;
+    }
+    if (rc == 1) {
+        StmtLog(handle, st->stmt);
+        ctx->failed = NS_TRUE;
+        return NULL;
+    }
+
+    if (rc == MYSQL_DATA_TRUNCATED) {
+        for (i = 0; i < st->numcols; i++) {
+            col = &st->cols[i];
+            if (!col->error || col->type != MYSQL_TYPE_STRING) {
+                continue;
+            }
+            col->size = col->length + 1;
+            col->buf = ns_realloc(col->buf, col->size);
+            st->binds[i].buffer = col->buf;
+            st->binds[i].buffer_length = col->size - 1;
+            if (mysql_stmt_fetch_column(st->stmt, &st->binds[i], i, 0) != 0) {
+                StmtLog(handle, st->stmt);
+                ctx->failed = NS_TRUE;
+                return NULL;
+            }
+        }
+        if (mysql_stmt_bind_result(st->stmt, st->binds) != 0) {
+            StmtLog(handle, st->stmt);
+            ctx->failed = NS_TRUE;
+            return NULL;
+        }
+    }
+
+    for (i = 0; i < st->numcols; i++) {
+        col = &st->cols[i];
+        if (col->is_null) {
+            st->values[i] = NULL;
+            st->lengths[i] = 0;
+            continue;
+        }
+        if (col->type == MYSQL_TYPE_STRING) {
+            st->lengths[i] = col->length < col->size
+                ? col->length : col->size - 1;
+            col->buf[st->lengths[i]] = '\0';
+            st->values[i] = col->buf;
+        } else if (text) {
+            st->lengths[i] = StmtText(col);
+            st->values[i] = col->text;
+        } else {
+            st->lengths[i] = col->type == MYSQL_TYPE_FLOAT
+                ? sizeof(float) : sizeof(long long);
+            st->values[i] = col->text;
+        }
+    }
+
+    *lengthsPtr = st->lengths;
+
+    return st->values;
+}
+
+/*
+ * StmtText - Format a numeric column's value into its text buffer and
+ * return the length.  Floating point values get the shortest form that
+ * reads back as the same value.
+ */
+
+static unsigned long
+StmtText(StmtColumn *col)
+{
+    switch (col->type) {
+    case MYSQL_TYPE_LONGLONG:
+        return sprintf(col->text, col->is_unsigned ? "%llu" : "%lld",
+                       col->num.i);
+    case MYSQL_TYPE_FLOAT:
+        sprintf(col->text, "%.6g", col->num.f);
+        if (strtof(col->text, NULL) != col->num.f) {
+            sprintf(col->text, "%.9g", col->num.f);
+        }
+        return strlen(col->text);
+    default:
+        sprintf(col->text, "%.15g", col->num.d);
+        if (strtod(col->text, NULL) != col->num.d) {
+            sprintf(col->text, "%.17g", col->num.d);
+        }
+        return strlen(col->text);
+    }
+}
+
+/*
+ * StmtValueObj - Make the Tcl object for a numeric column of a row
+ * fetched by StmtFetchRow() without text, straight from its binary
+ * value.
+ */
+
+static Tcl_Obj *
+StmtValueObj(StmtColumn *col)
+{
+    unsigned long   len;
+
+    switch (col->type) {
+    case MYSQL_TYPE_LONGLONG:
+        if (!col->is_unsigned || col->num.i >= 0) {
+            return Tcl_NewWideIntObj((Tcl_WideInt) col->num.i);
+        }
+        break;
+    case MYSQL_TYPE_DOUBLE:
+        return Tcl_NewDoubleObj(col->num.d);
+    default:
+        break;
+    }
+
+    /* Unsigned beyond a wide int, and floats, by their text. */
+    len = StmtText(col);
+
+    return NewValueObj(col->type == MYSQL_TYPE_FLOAT ? KIND_DOUBLE
+                       : KIND_STRING, col->text, len);
+}
+
+/*
+ * AsyncStart - Send a query without waiting for its response.  Returns
+ * ASYNC_PENDING with *waitPtr set to what the connection waits for, or
+ * ASYNC_DONE / ASYNC_FAILED if the outcome is already known.
+ */
+
+static int
+AsyncStart(MYSQL *mysql, char *sql, unsigned long len, int *waitPtr)
+{
+#ifdef HAVE_MARIADB_ASYNC
+    int             err;
+
+    *waitPtr = mysql_real_query_start(&err, mysql, sql, len);
+    if (*waitPtr == 0) {
+        return err ? ASYNC_FAILED : ASYNC_DONE;
+    }
+#else
+    if (mysql_send_query(mysql, sql, len) != 0) {
+        return ASYNC_FAILED;
+    }
+    *waitPtr = POLLIN;
+#endif
+
+    return ASYNC_PENDING;
+}
+
+static int
+AsyncSocket(MYSQL *mysql)
+{
+#ifdef HAVE_MARIADB_ASYNC
+    return (int) mysql_get_socket(mysql);
+#else
+    return (int) mysql->net.fd;
+#endif
+}
+
+static short
+AsyncEvents(int wait)
+{
+#ifdef HAVE_MARIADB_ASYNC
+    short           events = 0;
+
+    if (wait & MYSQL_WAIT_READ) {
+        events |= POLLIN;
+    }
+    if (wait & MYSQL_WAIT_WRITE) {
+        events |= POLLOUT;
+    }
+    if (wait & MYSQL_WAIT_EXCEPT) {
+        events |= POLLPRI;
+    }
+    return events;
+#else
+    return (short) wait;
+#endif
+}
+
+/*
+ * AsyncStep - Advance a pending query after poll() reported revents on
+ * its socket, or a zero revents after a timeout.
+ */
+
+static int
+AsyncStep(MYSQL *mysql, int *waitPtr, short revents)
+{
+#ifdef HAVE_MARIADB_ASYNC
+    int             status = 0, err;
+
+    if (revents & POLLIN) {
+        status |= MYSQL_WAIT_READ;
+    }
+    if (revents & POLLOUT) {
+        status |= MYSQL_WAIT_WRITE;
+    }
+    if (revents & POLLPRI) {
+        status |= MYSQL_WAIT_EXCEPT;
+    }
+    if (revents & (POLLERR | POLLHUP)) {
+        status |= *waitPtr & (MYSQL_WAIT_READ | MYSQL_WAIT_WRITE);
+    }
+    if (status == 0) {
+        if (!(*waitPtr & MYSQL_WAIT_TIMEOUT)) {
+            return ASYNC_PENDING;
+        }
+        status = MYSQL_WAIT_TIMEOUT;
+    }
+    *waitPtr = mysql_real_query_cont(&err, mysql, status);
+    if (*waitPtr == 0) {
+        return err ? ASYNC_FAILED : ASYNC_DONE;
+    }
+    return ASYNC_PENDING;
+#else
+    if (!(revents & (POLLIN | POLLERR | POLLHUP))) {
+        return ASYNC_PENDING;
+    }
+    return mysql_read_query_result(mysql) ? ASYNC_FAILED : ASYNC_DONE;
+#endif
+}
+
+/*
+ * AsyncWait - Poll the sockets of the n connections whose states are
+ * ASYNC_PENDING until all of them, or with any set at least one of
+ * them, have a response, or until timeout (NULL waits forever).
+ * Returns the number of connections no longer pending.
+ */
+
+static int
+AsyncWait(MYSQL **conns, int *waits, int *states, int n, Ns_Time *timeout,
+          int any)
+{
+    struct pollfd  *pfds;
+    Ns_Time         now, deadline, diff;
+    int            *idx;
+    int             i, npending, ndone, ms, rc;
+
+    pfds = ns_malloc(n * sizeof(struct pollfd));
+    idx = ns_malloc(n * sizeof(int));
+
+    if (timeout != NULL) {
+        Ns_GetTime(&deadline);
+        Ns_IncrTime(&deadline, timeout->sec, timeout->usec);
+    }
+
+    for (;;) {
+        npending = ndone = 0;
+        for (i = 0; i < n; i++) {
+            if (states[i] != ASYNC_PENDING) {
+                ndone++;
+                continue;
+            }
+            pfds[npending].fd = AsyncSocket(conns[i]);
+            pfds[npending].events = AsyncEvents(waits[i]);
+            pfds[npending].revents = 0;
+            idx[npending++] = i;
+        }
+        if (npending == 0 || (any && ndone > 0)) {
+            break;
+        }
+
+        ms = -1;
+        if (timeout != NULL) {
+            Ns_GetTime(&now);
+            if (Ns_DiffTime(&deadline, &now, &diff) < 0) {
+                break;
+            }
+            ms = diff.sec * 1000 + diff.usec / 1000;
+        }
+#ifdef HAVE_MARIADB_ASYNC
+        for (i = 0; i < npending; i++) {
+            if (waits[idx[i]] & MYSQL_WAIT_TIMEOUT) {
+                int             t;
+
+                t = mysql_get_timeout_value_ms(conns[idx[i]]);
+                if (ms < 0 || t < ms) {
+                    ms = t;
+                }
+            }
+        }
+#endif
+
+        rc = poll(pfds, npending, ms);
+        if (rc < 0 && errno != EINTR) {
+            Ns_Log(Error, "AsyncWait: poll() failed: %s", strerror(errno));
+            break;
+        }
+        for (i = 0; i < npending; i++) {
+            states[idx[i]] = AsyncStep(conns[idx[i]], &waits[idx[i]],
+                                       rc > 0 ? pfds[i].revents : 0);
+        }
+    }
+
+    ns_free(pfds);
+    ns_free(idx);
+
+    return ndone;
+}
+
+/*
+ * AsyncKill - Kill a query sent with AsyncStart() that is still running
+ * on mysql and wait for the error it then ends with.  Should the kill
+ * fail, the connection is shut down instead, and NS_ERROR returned: it
+ * has to be replaced.
+ */
+
+static int
+AsyncKill(Ns_DbHandle *handle, char *source, MYSQL *mysql, unsigned long id,
+          int *waitPtr, int *statePtr)
+{
+    int             status = NS_OK;
+
+    if (KillQuery(handle, source, id) != NS_OK) {
+        shutdown(AsyncSocket(mysql), SHUT_RDWR);
+        status = NS_ERROR;
+    }
+    AsyncWait(&mysql, waitPtr, statePtr, 1, NULL, 0);
+
+    return status;
+}
+
+/*
+ * AsyncCollect - Finish a query started by [ns_mysql send] once its
+ * response has arrived, leaving the handle as Ns_MySQL_Exec would.
+ */
+
+static int
+AsyncCollect(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    ctx->async = NS_FALSE;
+    if (ctx->async_sql != NULL) {
+        CacheInvalidate(handle, ctx->async_sql);
+        ns_free(ctx->async_sql);
+        ctx->async_sql = NULL;
+    }
+    if (ctx->async_state == ASYNC_FAILED) {
+        Log(handle, (MYSQL *) handle->connection);
+        return NS_ERROR;
+    }
+
+    return ExecResult(handle);
+}
+
+/* ************************************************************ */
+
+/*
+ * SchemaKey - Build the schema cache key of a lookup on the handle's
+ * server and current database.  The pool is part of it, as pools on
+ * the same server may log in as users with different privileges.
+ */
+
+static void
+SchemaKey(Ns_DString *dsPtr, Ns_DbHandle *handle, char *lookup,
+          const char *arg)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+
+    Ns_DStringVarAppend(dsPtr, lookup, "\n", ctx->pool->name, "\n",
+        PrimarySource(handle), "\n", mysql->db != NULL ? mysql->db : "",
+        "\n", arg != NULL ? arg : "", NULL);
+}
+
+/*
+ * SchemaLookup - Set the interp's result to the cached value of key and
+ * return 1, or return 0 with *generationPtr set for SchemaStore().
+ */
+
+static int
+SchemaLookup(Tcl_Interp *interp, char *key, unsigned long *generationPtr)
+{
+    Tcl_HashEntry  *hPtr;
+    SchemaEntry    *entry;
+    Tcl_Obj        *valueObj = NULL;
+
+    if (schemaTtl == 0) {
+        return 0;
+    }
+
+    Ns_MutexLock(&schemaLock);
+    *generationPtr = schemaGeneration;
+    hPtr = Tcl_FindHashEntry(&schemaCache, key);
+    if (hPtr != NULL) {
+        entry = (SchemaEntry *) Tcl_GetHashValue(hPtr);
+        if (entry->expires > time(NULL)) {
+            valueObj = Tcl_NewStringObj(entry->value, -1);
+        } else {
+            ns_free(entry->value);
+            ns_free(entry);
+            Tcl_DeleteHashEntry(hPtr);
+        }
+    }
+    Ns_MutexUnlock(&schemaLock);
+
+    if (valueObj == NULL) {
+        return 0;
+    }
+    Tcl_SetObjResult(interp, valueObj);
+
+    return 1;
+}
+
+/*
+ * SchemaStore - Cache a looked up value, unless a DDL was seen since
+ * the lookup started.  When the cache holds "schemasize" entries, the
+ * expired ones are dropped; if none has, the value is not kept.
+ */
+
+static void
+SchemaStore(char *key, Tcl_Obj *valueObj, unsigned long generation)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    SchemaEntry    *entry;
+    time_t          now = time(NULL);
+    int             new;
+
+    if (schemaTtl == 0) {
+        return;
+    }
+
+    Ns_MutexLock(&schemaLock);
+    if (schemaCache.numEntries >= schemaMax) {
+        hPtr = Tcl_FirstHashEntry(&schemaCache, &search);
+        while (hPtr != NULL) {
+            entry = (SchemaEntry *) Tcl_GetHashValue(hPtr);
+            if (entry->expires <= now) {
+                ns_free(entry->value);
+                ns_free(entry);
+                Tcl_DeleteHashEntry(hPtr);
+            }
+            hPtr = Tcl_NextHashEntry(&search);
+        }
+    }
+    if (generation == schemaGeneration
+        && (schemaCache.numEntries < schemaMax
+            || Tcl_FindHashEntry(&schemaCache, key) != NULL)) {
+        hPtr = Tcl_CreateHashEntry(&schemaCache, key, &new);
+        if (new) {
+            entry = ns_malloc(sizeof(SchemaEntry));
+            Tcl_SetHashValue(hPtr, entry);
+        } else {
+            entry = (SchemaEntry *) Tcl_GetHashValue(hPtr);
+            ns_free(entry->value);
+        }
+        entry->expires = now + schemaTtl;
+        entry->value = ns_strdup(Tcl_GetString(valueObj));
+    }
+    Ns_MutexUnlock(&schemaLock);
+}
+
+/*
+ * SchemaFlush - Empty the schema cache after a DDL.
+ */
+
+static void
+SchemaFlush(void)
+{
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    SchemaEntry    *entry;
+
+    Ns_MutexLock(&schemaLock);
+    schemaGeneration++;
+    hPtr = Tcl_FirstHashEntry(&schemaCache, &search);
+    while (hPtr != NULL) {
+        entry = (SchemaEntry *) Tcl_GetHashValue(hPtr);
+        ns_free(entry->value);
+        ns_free(entry);
+        Tcl_DeleteHashEntry(hPtr);
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    Ns_MutexUnlock(&schemaLock);
+}
+
+/*
+ * ListResult - Turn the result of mysql_list_dbs() or
+ * mysql_list_tables() into a list, cache it under key and make it the
+ * interp's result.
+ */
+
+static int
+ListResult(Tcl_Interp *interp, MYSQL_RES *result, char *key,
+           unsigned long generation)
+{
+    MYSQL_ROW       row;
+    Tcl_Obj        *listObj;
+    unsigned int    numcols;
+    unsigned int    i;
+
+    numcols = mysql_num_fields(result);
+
+    listObj = Tcl_NewListObj(0, NULL);
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        for (i = 0; i < numcols; i++) {
+            Tcl_ListObjAppendElement(NULL, listObj,
+                Tcl_NewStringObj(row[i], -1));
+        }
+    }
+
+    mysql_free_result(result);
+    SchemaStore(key, listObj, generation);
+    Tcl_SetObjResult(interp, listObj);
+
+    return TCL_OK;
+}
+
+static int 
+Ns_MySQL_List_Dbs(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+{
+    MYSQL_RES      *result;
+    Ns_DString      key;
+    unsigned long   generation;
+    int             rc;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_List_Dbs(%s) called.", handle->datasource);
+
+    FreePending(handle);
+    Ns_DStringInit(&key);
+    SchemaKey(&key, handle, "dbs", wild);
+    if (SchemaLookup(interp, Ns_DStringValue(&key), &generation)) {
+        Ns_DStringFree(&key);
+        return TCL_OK;
+    }
+
+    result = mysql_list_dbs((MYSQL *) handle->connection, wild);
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (result == NULL) {
+        Ns_DStringFree(&key);
+        Tcl_AppendResult(interp, "mysql_list_dbs failed.", NULL);
+        return TCL_ERROR;
+    }
+
+    rc = ListResult(interp, result, Ns_DStringValue(&key), generation);
+    Ns_DStringFree(&key);
+
+    return rc;
+}
+
+static int 
+Ns_MySQL_List_Tables(Tcl_Interp *interp, const char *wild, Ns_DbHandle *handle)
+{
+    MYSQL_RES      *result;
+    Ns_DString      key;
+    unsigned long   generation;
+    int             rc;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_List_Tables(%s) called.", handle->datasource);
+
+    FreePending(handle);
+    Ns_DStringInit(&key);
+    SchemaKey(&key, handle, "tables", wild);
+    if (SchemaLookup(interp, Ns_DStringValue(&key), &generation)) {
+        Ns_DStringFree(&key);
+        return TCL_OK;
+    }
+
+    result = mysql_list_tables((MYSQL *) handle->connection, wild);
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (result == NULL) {
+        Ns_DStringFree(&key);
+        Tcl_AppendResult(interp, "mysql_list_tables failed.", NULL);
+        return TCL_ERROR;
+    }
+
+    rc = ListResult(interp, result, Ns_DStringValue(&key), generation);
+    Ns_DStringFree(&key);
+
+    return rc;
+}
+
+/*
+ * Ns_MySQL_Columns - Describe the columns of a table, from SHOW FULL
+ * COLUMNS, as a list with one name-value list per column.  NULL
+ * defaults and collations are empty strings.
+ */
+
+static int
+Ns_MySQL_Columns(Tcl_Interp *interp, char *table, Ns_DbHandle *handle)
+{
+    static char    *names[] = {
+        "name", "type", "collation", "null", "key", "default", "extra",
+        "privileges", "comment"
+    };
+    MYSQL          *mysql;
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    Tcl_Obj        *listObj, *colObj;
+    Ns_DString      key, sql;
+    unsigned long   generation;
+    unsigned int    numcols, i;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Columns(%s) called.", handle->datasource);
+
+    Ns_DStringInit(&key);
+    SchemaKey(&key, handle, "columns", table);
+    if (SchemaLookup(interp, Ns_DStringValue(&key), &generation)) {
+        Ns_DStringFree(&key);
+        return TCL_OK;
+    }
+
+    FreePending(handle);
+    mysql = (MYSQL *) handle->connection;
+
+    Ns_DStringInit(&sql);
+    Ns_DStringAppend(&sql, "SHOW FULL COLUMNS FROM ");
+    AppendIdent(&sql, table, NS_TRUE);
+    if (mysql_query(mysql, Ns_DStringValue(&sql)) != 0
+        || (result = mysql_store_result(mysql)) == NULL) {
+        Log(handle, mysql);
+        Ns_DStringFree(&sql);
+        Ns_DStringFree(&key);
+        Tcl_AppendResult(interp, "columns failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    Ns_DStringFree(&sql);
+
+    numcols = mysql_num_fields(result);
+    if (numcols > sizeof(names) / sizeof(names[0])) {
+        numcols = sizeof(names) / sizeof(names[0]);
+    }
+
+    listObj = Tcl_NewListObj(0, NULL);
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        colObj = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < numcols; i++) {
+            Tcl_ListObjAppendElement(NULL, colObj,
+                Tcl_NewStringObj(names[i], -1));
+            Tcl_ListObjAppendElement(NULL, colObj,
+                Tcl_NewStringObj(row[i] != NULL ? row[i] : "", -1));
+        }
+        Tcl_ListObjAppendElement(NULL, listObj, colObj);
+    }
+    mysql_free_result(result);
+
+    SchemaStore(Ns_DStringValue(&key), listObj, generation);
+    Ns_DStringFree(&key);
+    Tcl_SetObjResult(interp, listObj);
+
+    return TCL_OK;
+}
+
+static int 
+Ns_MySQL_Select_Db(Tcl_Interp *interp, const char *db, Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    unsigned int    rc;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Select_Db(%s) called.", db);
+
+    FreePending(handle);
+    if (ctx != NULL && handle->connection == (void *) ctx->home
+        && ctx->schema != NULL && STREQ(ctx->schema, db)) {
+        ATOMIC_ADD(&ctx->pool->stats.skipped, 1);
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(db, -1));
+        return TCL_OK;
+    }
+
+    rc = mysql_select_db((MYSQL *) handle->connection, db);
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (rc) {
+        Tcl_AppendResult(interp, "mysql_select_db failed.", NULL);
+        return TCL_ERROR;
+    }
+    if (ctx != NULL && handle->connection == (void *) ctx->home) {
+        ctx->session_dirty = NS_TRUE;
+    }
+    SessionTrack(handle);
+
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(db, -1));
+
+    return TCL_OK;
+}
+
+static int 
+Ns_MySQL_Resultrows(Tcl_Interp *interp, Ns_DbHandle *handle)
+{
+    INT64            rows;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+    
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Resultrows(%s) called.", handle->datasource);
+
+    FreePending(handle);
+    rows = mysql_affected_rows((MYSQL *) handle->connection);
+    Log(handle, (MYSQL *) handle->connection);
+
+    if (rows < 0) {
+        Tcl_AppendResult(interp, "mysql_affected_rows failed.", NULL);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) rows));
+
+    return TCL_OK;
+}
+
+static int 
+Ns_MySQL_Prepare(Tcl_Interp *interp, char *sql, Ns_DbHandle *handle)
+{
+    MySQLStmt      *st;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Prepare(%s) called.", handle->datasource);
+
+    FreePending(handle);
+    st = GetStmt(handle, sql);
+    if (st == NULL) {
+        Tcl_AppendResult(interp, "mysql_stmt_prepare failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt) st->nparams));
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_Compression - Report whether the handle's connection is
+ * compressed and how many bytes have crossed the wire in each direction,
+ * as counted by the server, next to the row data the driver received.
+ */
+
+static int
+Ns_MySQL_Compression(Tcl_Interp *interp, Ns_DbHandle *handle)
+{
+    static struct {
+        char           *variable;
+        char           *name;
+    } names[] = {
+        { "Compression",           "compression" },
+        { "Compression_algorithm", "algorithm" },
+        { "Compression_level",     "level" },
+        { "Bytes_sent",            "wire_received" },
+        { "Bytes_received",        "wire_sent" },
+        { NULL, NULL }
+    };
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    Tcl_Obj        *resultObj;
+    int             i;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Compression(%s) called.", handle->datasource);
+
+    if (ctx->unbuffered || ctx->async || mysql_more_results(mysql)) {
+        Tcl_AppendResult(interp, "handle is still reading a result", NULL);
+        return TCL_ERROR;
+    }
+
+    if (mysql_query(mysql, "SHOW SESSION STATUS WHERE Variable_name IN "
+            "('Compression', 'Compression_algorithm', 'Compression_level', "
+            "'Bytes_sent', 'Bytes_received')") != 0
+        || (result = mysql_store_result(mysql)) == NULL) {
+        Log(handle, mysql);
+        Tcl_AppendResult(interp, "SHOW SESSION STATUS failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        for (i = 0; names[i].variable != NULL; i++) {
+            if (row[0] != NULL && STRIEQ(row[0], names[i].variable)) {
+                Tcl_ListObjAppendElement(NULL, resultObj,
+                    Tcl_NewStringObj(names[i].name, -1));
+                Tcl_ListObjAppendElement(NULL, resultObj,
+                    Tcl_NewStringObj(row[1] ? row[1] : "", -1));
+                break;
+            }
+        }
+    }
+    mysql_free_result(result);
+    AppendCount(resultObj, "logical_received", ctx->bytes_received);
+
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_Execute - Run a cached prepared statement.  A statement that
+ * returns rows becomes the handle's current statement and, like
+ * [ns_db select], the row set is returned for [ns_db getrow]; otherwise
+ * the number of affected rows is returned.  A prepared statement cannot
+ * be waited for with a timeout, so on a handle that has one the
+ * statement is filled in by BindSql and sent through Query() instead,
+ * with the same results.
+ */
+
+static int 
+Ns_MySQL_Execute(Tcl_Interp *interp, char *sql, int objc,
+                 Tcl_Obj *CONST objv[], Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLStmt      *st;
+    MYSQL_RES      *meta;
+    Ns_Time         start, now, diff;
+    unsigned long   i, id;
+    int             rc;
+    char            buf[TCL_INTEGER_SPACE + 1];
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Execute(%s) called.", handle->datasource);
+
+    if (ctx->timeout > 0) {
+        return Ns_MySQL_ExecBind(interp, sql, NS_TRUE, objc, objv, handle);
+    }
+    if (ctx->lost) {
+        Tcl_AppendResult(interp, "mysql_stmt_execute failed: connection lost"
+            " in a transaction, release the handle", NULL);
+        return TCL_ERROR;
+    }
+
+    FreeResult(handle);
+
+    st = GetStmt(handle, sql);
+    if (st == NULL) {
+        Tcl_AppendResult(interp, "mysql_stmt_prepare failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+
+    if ((unsigned long) objc != st->nparams) {
+        sprintf(buf, "%lu", st->nparams);
+        Tcl_AppendResult(interp, "statement expects ", buf,
+            " parameters", NULL);
+        return TCL_ERROR;
+    }
+
+    for (i = 0; i < st->nparams; i++) {
+        int             len;
+
+        st->params[i].buffer_type = MYSQL_TYPE_STRING;
+        st->params[i].buffer = Tcl_GetStringFromObj(objv[i], &len);
+        st->params[i].buffer_length = len;
+    }
+    if (st->nparams > 0 && mysql_stmt_bind_param(st->stmt, st->params) != 0) {
+        StmtLog(handle, st->stmt);
+        Tcl_AppendResult(interp, "mysql_stmt_bind_param failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+
+    id = mysql_thread_id((MYSQL *) handle->connection);
+    Ns_GetTime(&start);
+    rc = mysql_stmt_execute(st->stmt);
+    CacheInvalidate(handle, sql);
+    if (rc != 0) {
+        StmtLog(handle, st->stmt);
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+
+        /* As in Query(), a read that timed out leaves the statement. */
+        Ns_GetTime(&now);
+        Ns_DiffTime(&now, &start, &diff);
+        if (mysql_stmt_errno(st->stmt) == CR_SERVER_LOST
+            && ctx->pool->read_timeout > 0
+            && diff.sec >= ctx->pool->read_timeout) {
+            Ns_Log(Warning, "Ns_MySQL_Execute(%s): no response in %ld "
+                "seconds, killing query %lu.", handle->datasource,
+                (long) diff.sec, id);
+            ATOMIC_ADD(&ctx->pool->stats.timeouts, 1);
+            KillQuery(handle, ConnSource(handle), id);
+            Reopen(handle);
+        }
+        Tcl_AppendResult(interp, "mysql_stmt_execute failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    SessionTrack(handle);
+
+    meta = mysql_stmt_result_metadata(st->stmt);
+    if (meta == NULL) {
+        QueryDone(handle, &start, sql, NS_FALSE,
+                  (Tcl_WideInt) mysql_stmt_affected_rows(st->stmt));
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj(
+            (Tcl_WideInt) mysql_stmt_affected_rows(st->stmt)));
+        return TCL_OK;
+    }
+
+    if (StmtBindResult(handle, st, meta) != NS_OK
+        || (!ctx->streaming && mysql_stmt_store_result(st->stmt) != 0)) {
+        StmtLog(handle, st->stmt);
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        mysql_free_result(meta);
+        mysql_stmt_free_result(st->stmt);
+        Tcl_AppendResult(interp, "mysql_stmt_fetch failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    QueryDone(handle, &start, sql, NS_FALSE, ctx->streaming ? -1
+              : (Tcl_WideInt) mysql_stmt_num_rows(st->stmt));
+
+    handle->statement = (void *) meta;
+    handle->fetchingRows = NS_TRUE;
+    ctx->stmt = st;
+    ctx->numcols = st->numcols;
+    ctx->unbuffered = ctx->streaming;
+
+    Ns_SetTrunc(handle->row, 0);
+    Ns_MySQL_BindRow(handle);
+
+    return Ns_TclEnterSet(interp, handle->row, NS_TCL_SET_STATIC);
+}
+
+/*
+ * BindSql - Copy sql to dsPtr with each ? placeholder replaced by the
+ * next value.  Placeholders inside quotes, backquotes and comments are
+ * left alone.  Every value is escaped for the connection's character
+ * set and quoted, numbers too, so that 02134 stays a string and a
+ * DOUBLE is compared as the server reads it.  A ?int placeholder, for
+ * LIMIT and OFFSET, takes an integer and puts it in as is.
+ */
+
+static int
+BindSql(Tcl_Interp *interp, MYSQL *mysql, char *sql, int objc,
+        Tcl_Obj *CONST objv[], Ns_DString *dsPtr)
+{
+    char           *p, *run, *value, *v, quote;
+    unsigned long   n;
+    int             len, nbound = 0;
+    Tcl_WideInt     wide;
+    char            buf[TCL_INTEGER_SPACE * 2];
+
+    Ns_DStringSetLength(dsPtr, 0);
+    for (run = p = sql; *p != '\0'; p++) {
+        switch (*p) {
+        case '\'':
+        case '"':
+        case '`':
+            for (quote = *p++; *p != '\0' && *p != quote; p++) {
+                if (*p == '\\' && p[1] != '\0' && quote != '`') {
+                    p++;
+                }
+            }
+            if (*p == '\0') {
+                p--;
+            }
+            continue;
+        case '#':
+            p += strcspn(p, "\n");
+            p--;
+            continue;
+        case '-':
+            if (p[1] == '-' && (isspace(UCHAR(p[2])) || p[2] == '\0')) {
+                p += strcspn(p, "\n");
+                p--;
+            }
+            continue;
+        case '/':
+            if (p[1] == '*') {
+                v = strstr(p + 2, "*/");
+                p = v != NULL ? v + 1 : p + strlen(p) - 1;
+            }
+            continue;
+        case '?':
+            break;
+        default:
+            continue;
+        }
+
+        if (nbound == objc) {
+            nbound++;
+            break;
+        }
+        Ns_DStringNAppend(dsPtr, run, (int) (p - run));
+        run = p + 1;
+
+        if (strncmp(p + 1, "int", 3) == 0 && !isalnum(UCHAR(p[4]))
+            && p[4] != '_') {
+            if (Tcl_GetWideIntFromObj(interp, objv[nbound++], &wide)
+                != TCL_OK) {
+                return TCL_ERROR;
+            }
+            sprintf(buf, "%" TCL_LL_MODIFIER "d", wide);
+            Ns_DStringAppend(dsPtr, buf);
+            p += 3;
+            run = p + 1;
+            continue;
+        }
+
+        value = Tcl_GetStringFromObj(objv[nbound++], &len);
+
+        Ns_DStringNAppend(dsPtr, "'", 1);
+        n = Ns_DStringLength(dsPtr);
+        Ns_DStringSetLength(dsPtr, (int) n + 2 * len + 1);
+#if MYSQL_VERSION_ID >= 50706 && !defined(MARIADB_BASE_VERSION)
+        n += mysql_real_escape_string_quote(mysql, dsPtr->string + n, value,
+                                            (unsigned long) len, '\'');
+#else
+        n += mysql_real_escape_string(mysql, dsPtr->string + n, value,
+                                      (unsigned long) len);
+#endif
+        Ns_DStringSetLength(dsPtr, (int) n);
+        Ns_DStringNAppend(dsPtr, "'", 1);
+    }
+
+    if (nbound != objc) {
+        sprintf(buf, "%d", objc);
+        Tcl_AppendResult(interp, nbound > objc ? "more" : "fewer",
+            " placeholders in statement than the ", buf, " values given",
+            NULL);
+        return TCL_ERROR;
+    }
+    Ns_DStringNAppend(dsPtr, run, (int) strlen(run));
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_ExecBind - Send a statement, with its ? placeholders filled
+ * in by BindSql when values are given, through the same path as
+ * [ns_db exec].  The statement
+ * is built in the handle's own buffer, which keeps its space from one
+ * call to the next.  Rows come back as with [ns_mysql execute]: the
+ * row set if there are rows, otherwise the number of affected rows.
+ */
+
+static int
+Ns_MySQL_ExecBind(Tcl_Interp *interp, char *sql, int bind, int objc,
+                  Tcl_Obj *CONST objv[], Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    int             rc;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_ExecBind(%s) called.", handle->datasource);
+
+    if (bind) {
+        if (BindSql(interp, (MYSQL *) handle->connection, sql, objc, objv,
+                    &ctx->bindsql) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        sql = Ns_DStringValue(&ctx->bindsql);
+    }
+
+    Ns_SetTrunc(handle->row, 0);
+    rc = Ns_MySQL_Exec(handle, sql);
+    if (rc == NS_ERROR) {
+        Tcl_AppendResult(interp, "exec failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    if (rc == NS_DML) {
+        Tcl_SetObjResult(interp, Tcl_NewWideIntObj((Tcl_WideInt)
+            mysql_affected_rows((MYSQL *) handle->connection)));
+        return TCL_OK;
+    }
+
+    Ns_MySQL_BindRow(handle);
+
+    return Ns_TclEnterSet(interp, handle->row, NS_TCL_SET_STATIC);
+}
+
+/*
+ * ColumnKind - Decide from a column's type how its values are returned
+ * to Tcl: integers as wide ints, floating point as doubles, binary
+ * strings as byte arrays and everything else, DECIMAL included, as
+ * strings.
+ */
+
+static int
+ColumnKind(MYSQL_FIELD *field)
+{
+    switch (field->type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_YEAR:
+        /* Zero padding would be lost. */
+        return (field->flags & ZEROFILL_FLAG) ? KIND_STRING : KIND_INT;
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+        return KIND_DOUBLE;
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+    case MYSQL_TYPE_BLOB:
+    case MYSQL_TYPE_VAR_STRING:
+    case MYSQL_TYPE_STRING:
+        /* Character set 63 is "binary". */
+        return field->charsetnr == 63 ? KIND_BINARY : KIND_STRING;
+    default:
+        return KIND_STRING;
+    }
+}
+
+/*
+ * NewValueObj - Make the Tcl object for a column value of the given
+ * kind.  Doubles keep the server's text as their string form; a NULL
+ * becomes an empty string.
+ */
+
+static Tcl_Obj *
+NewValueObj(int kind, char *value, unsigned long length)
+{
+    Tcl_Obj        *obj;
+    Tcl_WideInt     w;
+    double          d;
+    char           *end;
+
+    if (value == NULL) {
+        return Tcl_NewObj();
+    }
+
+    switch (kind) {
+    case KIND_INT:
+        errno = 0;
+        w = strtoll(value, &end, 10);
+        if (errno == 0 && end == value + length && length > 0) {
+            return Tcl_NewWideIntObj(w);
+        }
+        break;
+    case KIND_DOUBLE:
+        obj = Tcl_NewStringObj(value, (int) length);
+        Tcl_GetDoubleFromObj(NULL, obj, &d);
+        return obj;
+    case KIND_BINARY:
+        return Tcl_NewByteArrayObj((unsigned char *) value, (int) length);
+    }
+
+    return Tcl_NewStringObj(value, (int) length);
+}
+
+/*
+ * Ns_MySQL_FetchAll - Read the rest of the handle's current result, or
+ * at most limit rows of it, into the interp result in one pass:
+ *
+ *   lists    {{v1 v2 ...} ...}
+ *   dicts    {{col1 v1 col2 v2 ...} ...}
+ *   columns  {col1 {v1 v1 ...} col2 {v2 v2 ...} ...}
+ *
+ * Rows left over after the limit stay available to [ns_db getrow].
+ */
+
+#define FORMAT_LISTS    0
+#define FORMAT_DICTS    1
+#define FORMAT_COLUMNS  2
+
+static CONST char *formats[] = { "lists", "dicts", "columns", NULL };
+
+static int
+Ns_MySQL_FetchAll(Tcl_Interp *interp, Ns_DbHandle *handle, long limit,
+                  int format)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLStmt      *st = (ctx != NULL) ? ctx->stmt : NULL;
+    MYSQL_ROW       my_row;
+    MYSQL_FIELD    *fields;
+    unsigned long  *lengths;
+    Tcl_Obj        *resultObj, *rowObj, *valueObj;
+    Tcl_Obj       **keyObjs, **colObjs = NULL;
+    unsigned int    numcols, i;
+    long            nrows = 0;
+    int            *kinds;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_FetchAll(%s) called.", handle->datasource);
+
+    if (handle->fetchingRows == NS_FALSE || handle->statement == NULL) {
+        Tcl_AppendResult(interp, "no rows waiting to fetch", NULL);
+        return TCL_ERROR;
+    }
+
+    numcols = mysql_num_fields((MYSQL_RES *) handle->statement);
+    if ((unsigned int) Ns_SetSize(handle->row) != numcols) {
+        Ns_SetTrunc(handle->row, 0);
+        BindColumns(handle, (MYSQL_RES *) handle->statement);
+    }
+
+    fields = mysql_fetch_fields((MYSQL_RES *) handle->statement);
+    keyObjs = ns_malloc(numcols * sizeof(Tcl_Obj *));
+    kinds = ns_malloc(numcols * sizeof(int));
+    for (i = 0; i < numcols; i++) {
+        keyObjs[i] = Tcl_NewStringObj(Ns_SetKey(handle->row, i), -1);
+        Tcl_IncrRefCount(keyObjs[i]);
+        kinds[i] = ColumnKind(&fields[i]);
+    }
+    if (format == FORMAT_COLUMNS) {
+        colObjs = ns_malloc(numcols * sizeof(Tcl_Obj *));
+        for (i = 0; i < numcols; i++) {
+            colObjs[i] = Tcl_NewListObj(0, NULL);
+        }
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+
+    while (limit < 0 || nrows < limit) {
+        my_row = FetchRow(handle, &lengths, st == NULL);
+        if (my_row == NULL) {
+            break;
+        }
+        nrows++;
+
+        rowObj = (format == FORMAT_COLUMNS) ? NULL : Tcl_NewListObj(0, NULL);
+        for (i = 0; i < numcols; i++) {
+            if (st != NULL && my_row[i] != NULL
+                && st->cols[i].type != MYSQL_TYPE_STRING) {
+                valueObj = StmtValueObj(&st->cols[i]);
+            } else {
+                valueObj = NewValueObj(kinds[i], my_row[i], lengths[i]);
+            }
+            switch (format) {
+            case FORMAT_DICTS:
+                Tcl_ListObjAppendElement(NULL, rowObj, keyObjs[i]);
+                /* FALLTHROUGH */
+            case FORMAT_LISTS:
+                Tcl_ListObjAppendElement(NULL, rowObj, valueObj);
+                break;
+            case FORMAT_COLUMNS:
+                Tcl_ListObjAppendElement(NULL, colObjs[i], valueObj);
+                break;
+            }
+        }
+        if (rowObj != NULL) {
+            Tcl_ListObjAppendElement(NULL, resultObj, rowObj);
+        }
+    }
+
+    if (format == FORMAT_COLUMNS) {
+        for (i = 0; i < numcols; i++) {
+            Tcl_ListObjAppendElement(NULL, resultObj, keyObjs[i]);
+            Tcl_ListObjAppendElement(NULL, resultObj, colObjs[i]);
+        }
+        ns_free(colObjs);
+    }
+    for (i = 0; i < numcols; i++) {
+        Tcl_DecrRefCount(keyObjs[i]);
+    }
+    ns_free(keyObjs);
+    ns_free(kinds);
+
+    if (limit < 0 || nrows < limit) {
+        if (ctx != NULL && (ctx->failed || (ctx->unbuffered
+            && mysql_errno((MYSQL *) handle->connection)))) {
+            Log(handle, (MYSQL *) handle->connection);
+            FreeResult(handle);
+            Tcl_DecrRefCount(resultObj);
+            Tcl_AppendResult(interp, "fetch failed: ",
+                Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+            return TCL_ERROR;
+        }
+        FreeResult(handle);
+    }
+
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * IsWrite - Guess from its first keyword whether a statement may change
+ * data.  Anything that is not plainly a read counts as a write.
+ */
+
+static int
+IsWrite(char *sql)
+{
+    static char    *reads[] = {
+        "select", "show", "describe", "desc", "explain", NULL
+    };
+    char          **r;
+    size_t          len;
+
+    while (isspace(UCHAR(*sql)) || *sql == '(') {
+        sql++;
+    }
+    for (len = 0; isalpha(UCHAR(sql[len])); len++)
+        ;
+    for (r = reads; *r != NULL; r++) {
+        if (strlen(*r) == len && strncasecmp(sql, *r, len) == 0) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * IsDDL - Whether a statement may change the schema.
+ */
+
+static int
+IsDDL(char *sql)
+{
+    static char    *ddls[] = {
+        "create", "alter", "drop", "rename", NULL
+    };
+    char          **r;
+    size_t          len;
+
+    while (isspace(UCHAR(*sql))) {
+        sql++;
+    }
+    for (len = 0; isalpha(UCHAR(sql[len])); len++)
+        ;
+    for (r = ddls; *r != NULL; r++) {
+        if (strlen(*r) == len && strncasecmp(sql, *r, len) == 0) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * CacheToken - Read the next token of a statement at *pPtr.  A word,
+ * lower case and without any quotes, is put in word and 'w' returned;
+ * any other character is returned as itself, and 0 at the end.
+ * Comments, string literals and numbers are skipped, but the contents
+ * of executable comments are read as part of the statement.
+ */
+
+static int
+CacheToken(char **pPtr, char *word)
+{
+    char           *p = *pPtr, quote;
+    int             len, digits;
+
+    for (;;) {
+        while (isspace(UCHAR(*p))) {
+            p++;
+        }
+        if (*p == '#' || (p[0] == '-' && p[1] == '-'
+                          && (p[2] == '\0' || isspace(UCHAR(p[2]))))) {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+        } else if (p[0] == '/' && p[1] == '*') {
+            if (p[2] == '!' || (p[2] == 'M' && p[3] == '!')) {
+                for (p += p[2] == '!' ? 3 : 4; isdigit(UCHAR(*p)); p++)
+                    ;
+            } else {
+                p = strstr(p + 2, "*/");
+                p = (p == NULL) ? *pPtr + strlen(*pPtr) : p + 2;
+            }
+        } else if (p[0] == '*' && p[1] == '/') {
+            p += 2;                     /* End of an executable comment. */
+        } else if (*p == '\'') {
+            for (p++; *p != '\0'; p++) {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                } else if (*p == '\'' && *++p != '\'') {
+                    break;
+                }
+            }
+        } else {
+            break;
+        }
+        *pPtr = p;
+    }
+
+    len = 0;
+    if (*p == '`' || *p == '"') {
+        for (quote = *p++; *p != '\0'; p++) {
+            if (*p == quote && *++p != quote) {
+                break;
+            }
+            if (len < MAX_IDENTIFIER) {
+                word[len++] = tolower(UCHAR(*p));
+            }
+        }
+    } else if (isalnum(UCHAR(*p)) || *p == '_' || *p == '$'
+               || UCHAR(*p) >= 0x80) {
+        for (digits = 1; isalnum(UCHAR(*p)) || *p == '_' || *p == '$'
+             || UCHAR(*p) >= 0x80; p++) {
+            digits &= isdigit(UCHAR(*p)) != 0;
+            if (len < MAX_IDENTIFIER) {
+                word[len++] = tolower(UCHAR(*p));
+            }
+        }
+        if (digits) {
+            *pPtr = p;
+            return CacheToken(pPtr, word);
+        }
+    } else {
+        *pPtr = (*p == '\0') ? p : p + 1;
+        return UCHAR(*p);
+    }
+    word[len] = '\0';
+    *pPtr = p;
+
+    return 'w';
+}
+
+/*
+ * CacheBump - Bump the generation of the table named word, if some
+ * cached result depends on it.  Called with cacheLock held.
+ */
+
+static void
+CacheBump(char *word)
+{
+    Tcl_HashEntry  *hPtr;
+
+    hPtr = Tcl_FindHashEntry(&cacheTables, word);
+    if (hPtr != NULL) {
+        ((CacheTable *) Tcl_GetHashValue(hPtr))->generation++;
+    }
+}
+
+/*
+ * CacheInvalidate - Called with every statement a handle sends, once
+ * it has run.  A DDL empties the schema cache.  For a write, each word
+ * of the statement that names a table some cached result depends on
+ * bumps that table's generation, so that the entries built from it are
+ * dropped when next looked up.  Matching every word rather than parsing
+ * the statement errs on the side of invalidating too much.
+ *
+ * Until a transaction commits, other threads still read the rows as
+ * they were and may cache them again, so the words of its writes are
+ * kept with the handle and invalidated once more when it ends.  handle
+ * may be NULL for a statement outside any transaction.
+ */
+
+static void
+CacheInvalidate(Ns_DbHandle *handle, char *sql)
+{
+    MySQLContext   *ctx = NULL;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    char           *p, word[MAX_IDENTIFIER + 1];
+    int             intrans = NS_FALSE, tok, new;
+
+    if (handle != NULL && handle->connection != NULL) {
+        ctx = (MySQLContext *) handle->context;
+        intrans = (((MYSQL *) handle->connection)->server_status
+                   & SERVER_STATUS_IN_TRANS) != 0;
+    }
+
+    if (IsDDL(sql)) {
+        SchemaFlush();
+    }
+    if (IsWrite(sql)) {
+        if (intrans && ctx != NULL) {
+            for (p = sql; (tok = CacheToken(&p, word)) != 0; ) {
+                if (tok == 'w') {
+                    Tcl_CreateHashEntry(&ctx->txn_words, word, &new);
+                }
+            }
+        }
+        if (cacheTables.numEntries > 0) {
+            Ns_MutexLock(&cacheLock);
+            for (p = sql; (tok = CacheToken(&p, word)) != 0; ) {
+                if (tok == 'w') {
+                    CacheBump(word);
+                }
+            }
+            Ns_MutexUnlock(&cacheLock);
+        }
+    }
+
+    /* Committed or rolled back, possibly implicitly. */
+    if (!intrans && ctx != NULL && ctx->txn_words.numEntries > 0) {
+        Ns_MutexLock(&cacheLock);
+        hPtr = Tcl_FirstHashEntry(&ctx->txn_words, &search);
+        while (hPtr != NULL) {
+            CacheBump(Tcl_GetHashKey(&ctx->txn_words, hPtr));
+            hPtr = Tcl_NextHashEntry(&search);
+        }
+        Ns_MutexUnlock(&cacheLock);
+        Tcl_DeleteHashTable(&ctx->txn_words);
+        Tcl_InitHashTable(&ctx->txn_words, TCL_STRING_KEYS);
+    }
+}
+
+/*
+ * CacheDepends - Find the tables a read depends on: every word of its
+ * FROM clauses and joins, subqueries included, other than in join
+ * conditions.  Aliases and the like come along, which only costs an
+ * invalidation now and then.  Each is entered in cacheTables and its
+ * generation taken now, before the read runs, for CacheStore().
+ * Returns how many there are, or -1 if too many to track.
+ */
+
+#define CACHE_DEPS      32
+#define CACHE_DEPTH     32
+
+#define FROM_NONE       0
+#define FROM_TABLES     1
+#define FROM_CONDITION  2
+
+static int
+CacheDepends(char *sql, CacheTable **tables, unsigned long *generations)
+{
+    static char    *ends[] = {
+        "where", "group", "having", "order", "limit", "union", "except",
+        "intersect", "for", "lock", "into", "window", "procedure", NULL
+    };
+    static char    *skip[] = {
+        "as", "join", "inner", "left", "right", "outer", "cross",
+        "natural", "straight_join", "lateral", "use", "ignore", "force",
+        "index", "key", "partition", "dual", "select", "distinct", NULL
+    };
+    Tcl_HashEntry  *hPtr;
+    CacheTable     *table;
+    char            state[CACHE_DEPTH];
+    char          **w, word[MAX_IDENTIFIER + 1];
+    int             tok, depth = 0, n = 0, i, new;
+
+    state[0] = FROM_NONE;
+    while ((tok = CacheToken(&sql, word)) != 0) {
+        if (tok == '(') {
+            if (++depth == CACHE_DEPTH) {
+                return -1;
+            }
+            state[depth] = state[depth - 1] == FROM_TABLES
+                ? FROM_TABLES : FROM_NONE;
+            continue;
+        }
+        if (tok == ')') {
+            if (depth > 0) {
+                depth--;
+            }
+            continue;
+        }
+        if (tok == ',' && state[depth] == FROM_CONDITION) {
+            state[depth] = FROM_TABLES;
+            continue;
+        }
+        if (tok != 'w') {
+            continue;
+        }
+
+        if (STREQ(word, "from") || STREQ(word, "join")
+            || STREQ(word, "straight_join")) {
+            state[depth] = FROM_TABLES;
+            continue;
+        }
+        if (state[depth] == FROM_TABLES
+            && (STREQ(word, "on") || STREQ(word, "using"))) {
+            state[depth] = FROM_CONDITION;
+            continue;
+        }
+        for (w = ends; *w != NULL && !STREQ(word, *w); w++)
+            ;
+        if (*w != NULL) {
+            state[depth] = FROM_NONE;
+            continue;
+        }
+        if (state[depth] != FROM_TABLES) {
+            continue;
+        }
+        for (w = skip; *w != NULL && !STREQ(word, *w); w++)
+            ;
+        if (*w != NULL) {
+            continue;
+        }
+
+        Ns_MutexLock(&cacheLock);
+        hPtr = Tcl_CreateHashEntry(&cacheTables, word, &new);
+        if (new) {
+            Tcl_SetHashValue(hPtr, ns_calloc(1, sizeof(CacheTable)));
+        }
+        table = (CacheTable *) Tcl_GetHashValue(hPtr);
+        for (i = 0; i < n && tables[i] != table; i++)
+            ;
+        if (i == n && n < CACHE_DEPS) {
+            tables[n] = table;
+            generations[n++] = table->generation;
+        } else if (i == n) {
+            n = -1;
+        }
+        Ns_MutexUnlock(&cacheLock);
+        if (n < 0) {
+            return -1;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * AppendCount - Append a name and a counter to a statistics list.
+ */
+
+static void
+AppendCount(Tcl_Obj *listObj, char *name, unsigned long count)
+{
+    Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(name, -1));
+    Tcl_ListObjAppendElement(NULL, listObj,
+        Tcl_NewWideIntObj((Tcl_WideInt) count));
+}
+
+/*
+ * HistAdd - Count the time since start in a histogram.  Returns the
+ * elapsed time in microseconds.
+ */
+
+static unsigned long
+HistAdd(MySQLHist *hist, Ns_Time *start)
+{
+    Ns_Time         now, diff;
+    unsigned long   us, max;
+    int             i, n;
+
+    Ns_GetTime(&now);
+    Ns_DiffTime(&now, start, &diff);
+    us = diff.sec < 0 ? 0 : diff.sec * 1000000UL + diff.usec;
+
+    if (us < 4) {
+        i = (int) us;
+    } else {
+        for (n = 2; (us >> (n + 1)) != 0; n++)
+            ;
+        i = 4 * (n - 1) + (int) ((us >> (n - 2)) & 3);
+        if (i >= HIST_BUCKETS) {
+            i = HIST_BUCKETS - 1;
+        }
+    }
+
+    ATOMIC_ADD(&hist->buckets[i], 1);
+    ATOMIC_ADD(&hist->count, 1);
+
+    /* Racy, but a lost update only loses a maximum that was overtaken. */
+    max = hist->max;
+    if (us > max) {
+        hist->max = us;
+    }
+
+    return us;
+}
+
+/*
+ * HistBound - Upper bound in microseconds of the values in bucket i.
+ */
+
+static unsigned long
+HistBound(int i)
+{
+    i++;
+    if (i < 4) {
+        return (unsigned long) i;
+    }
+    return (unsigned long) (4 + i % 4) << (i / 4 - 1);
+}
+
+static unsigned long
+HistPercentile(MySQLHist *hist, unsigned long count, double p)
+{
+    unsigned long   target, seen = 0;
+    int             i;
+
+    if (count == 0) {
+        return 0;
+    }
+    target = (unsigned long) (count * p);
+    if (target < 1) {
+        target = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->buckets[i];
+        if (seen >= target) {
+            return HistBound(i) < hist->max ? HistBound(i) : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+static void
+HistAppend(Tcl_Obj *listObj, char *name, MySQLHist *hist)
+{
+    MySQLHist       copy;
+    Tcl_Obj        *histObj;
+
+    copy = *hist;
+    histObj = Tcl_NewListObj(0, NULL);
+    AppendCount(histObj, "count", copy.count);
+    AppendCount(histObj, "p50", HistPercentile(&copy, copy.count, 0.50));
+    AppendCount(histObj, "p95", HistPercentile(&copy, copy.count, 0.95));
+    AppendCount(histObj, "p99", HistPercentile(&copy, copy.count, 0.99));
+    AppendCount(histObj, "max", copy.max);
+    Tcl_ListObjAppendElement(NULL, listObj, Tcl_NewStringObj(name, -1));
+    Tcl_ListObjAppendElement(NULL, listObj, histObj);
+}
+
+/*
+ * ExplainLater - Have the plan of a slow query logged by a thread of
+ * its own, so that the request does not wait for a side connection.
+ * At most one runs per pool at a time, and one starts at most every
+ * "explaininterval" seconds; other slow queries go unexplained.
+ */
+
+static void
+ExplainLater(Ns_DbHandle *handle, char *sql)
+{
+    MySQLPool      *pool = ((MySQLContext *) handle->context)->pool;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    ExplainJob     *job;
+    time_t          now = time(NULL);
+    int             start;
+
+    Ns_MutexLock(&poolLock);
+    start = !pool->explaining
+        && pool->explained + pool->explain_interval <= now;
+    if (start) {
+        pool->explaining = NS_TRUE;
+        pool->explained = now;
+        if (pool->explainer.driver == NULL) {
+            PoolHandle(pool, &pool->explainer);
+        }
+    }
+    Ns_MutexUnlock(&poolLock);
+    if (!start) {
+        return;
+    }
+
+    job = ns_malloc(sizeof(ExplainJob) + strlen(sql));
+    job->pool = pool;
+    job->source = ns_strdup(PrimarySource(handle));
+    job->db = mysql->db == NULL ? NULL : ns_strdup(mysql->db);
+    strcpy(job->sql, sql);
+    Ns_ThreadCreate(ExplainThread, job, 0, NULL);
+}
+
+/*
+ * ExplainThread - Log the plan of a slow query, run on a side
+ * connection so the handle's result and session are left alone.
+ */
+
+static void
+ExplainThread(void *arg)
+{
+    ExplainJob     *job = (ExplainJob *) arg;
+    MySQLPool      *pool = job->pool;
+    MYSQL          *side;
+    MYSQL_RES      *result;
+    MYSQL_FIELD    *fields;
+    MYSQL_ROW       row;
+    Ns_DString      ds;
+    unsigned int    numcols, i;
+
+    mysql_thread_init();
+    Ns_DStringInit(&ds);
+
+    side = Connect(&pool->explainer, pool, job->source, 0);
+    if (side == NULL) {
+        goto done;
+    }
+    if (job->db != NULL && mysql_select_db(side, job->db) != 0) {
+        Log(NULL, side);
+        mysql_close(side);
+        goto done;
+    }
+
+    Ns_DStringVarAppend(&ds, "EXPLAIN ", job->sql, NULL);
+    if (mysql_query(side, Ns_DStringValue(&ds)) != 0
+        || (result = mysql_store_result(side)) == NULL) {
+        Log(NULL, side);
+    } else {
+        numcols = mysql_num_fields(result);
+        fields = mysql_fetch_fields(result);
+        while ((row = mysql_fetch_row(result)) != NULL) {
+            Ns_DStringTrunc(&ds, 0);
+            for (i = 0; i < numcols; i++) {
+                Ns_DStringVarAppend(&ds, i ? " " : "", fields[i].name, "=",
+                    row[i] ? row[i] : "NULL", NULL);
+            }
+            Ns_Log(Notice, "explain: %s", Ns_DStringValue(&ds));
+        }
+        mysql_free_result(result);
+    }
+    mysql_close(side);
+
+done:
+    Ns_DStringFree(&ds);
+    ns_free(job->source);
+    ns_free(job->db);
+    ns_free(job);
+    mysql_thread_end();
+
+    Ns_MutexLock(&poolLock);
+    pool->explaining = NS_FALSE;
+    Ns_MutexUnlock(&poolLock);
+}
+
+/*
+ * QueryDone - Account for a query that started at start in its pool's
+ * statistics and in the statement profile, and log it if it was slow.
+ * rows is the number of rows returned or affected, or -1 for a result
+ * whose rows are counted as they are fetched.
+ */
+
+static void
+QueryDone(Ns_DbHandle *handle, Ns_Time *start, char *sql, int failed,
+          Tcl_WideInt rows)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLPool      *pool;
+    unsigned long   us;
+
+    if (ctx == NULL) {
+        return;
+    }
+    pool = ctx->pool;
+
+    us = HistAdd(&pool->stats.query, start);
+    ATOMIC_ADD(&pool->stats.queries, 1);
+    if (failed) {
+        ATOMIC_ADD(&pool->stats.errors, 1);
+    }
+
+    ctx->fp_hash = ProfileAdd(sql, us, failed, rows < 0 ? 0 : rows);
+    ctx->fp_pending = (rows < 0 && ctx->fp_hash != 0);
+    ctx->fetched = 0;
+
+    if (pool->slow_ms > 0 && us >= (unsigned long) pool->slow_ms * 1000) {
+        ATOMIC_ADD(&pool->stats.slow, 1);
+        Ns_Log(Warning, "slow query on pool %s (%lu ms): %s",
+            pool->name, us / 1000, sql);
+        if (pool->explain_slow && !failed && !IsWrite(sql)) {
+            ExplainLater(handle, sql);
+        }
+    }
+}
+
+/*
+ * ResultRows - The rows a successful select or exec returned, -1 if
+ * they are streamed and so not known yet, or the rows it affected.
+ */
+
+static Tcl_WideInt
+ResultRows(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    my_ulonglong    n;
+
+    if (handle->statement != NULL) {
+        if (ctx != NULL && ctx->unbuffered) {
+            return -1;
+        }
+        return (Tcl_WideInt) mysql_num_rows((MYSQL_RES *) handle->statement);
+    }
+    n = mysql_affected_rows((MYSQL *) handle->connection);
+
+    return n == (my_ulonglong) -1 ? 0 : (Tcl_WideInt) n;
+}
+
+/*
+ * FpPlaceholder - Append a ? for a literal to a fingerprint, folding
+ * it into a preceding "?, " so that a list of any length reads "?+".
+ */
+
+static void
+FpPlaceholder(char *buf, int *nPtr)
+{
+    int             m = *nPtr;
+
+    if (m > 0 && buf[m - 1] == ' ') {
+        m--;
+    }
+    if (m > 0 && buf[m - 1] == ',') {
+        m--;
+        if (m > 0 && buf[m - 1] == '+') {
+            m--;
+        }
+        if (m > 0 && buf[m - 1] == '?') {
+            buf[m++] = '+';
+            *nPtr = m;
+            return;
+        }
+    }
+    if (*nPtr < FP_MAX) {
+        buf[(*nPtr)++] = '?';
+    }
+}
+
+/*
+ * FpGroup - After a ")" that closes "(?)" or "(?+)", drop it if it
+ * repeats the group before it, so multi-row VALUES read "(?+)" too.
+ */
+
+static void
+FpGroup(char *buf, int *nPtr)
+{
+    int             n = *nPtr, g, k;
+
+    if (n >= 4 && memcmp(buf + n - 4, "(?+)", 4) == 0) {
+        g = 4;
+    } else if (n >= 3 && memcmp(buf + n - 3, "(?)", 3) == 0) {
+        g = 3;
+    } else {
+        return;
+    }
+    k = n - g;
+    if (k > 0 && buf[k - 1] == ' ') {
+        k--;
+    }
+    if (k > 0 && buf[k - 1] == ',') {
+        k--;
+        if (k >= g && memcmp(buf + k - g, buf + n - g, g) == 0) {
+            *nPtr = k;
+        }
+    }
+}
+
+/*
+ * Fingerprint - Normalize a statement into buf, which holds FP_MAX
+ * characters and a null: comments dropped, white space collapsed to
+ * one space and dropped around FP_TIGHT, before parentheses and inside
+ * them, words lower case, and string and number literals replaced by
+ * ?, with lists of them folded.  Returns a hash of the result, never 0.
+ */
+
+static unsigned int
+Fingerprint(char *sql, char *buf)
+{
+    unsigned char  *p = (unsigned char *) sql;
+    unsigned int    hash = 2166136261U;
+    int             n = 0, space = 0, q, i;
+
+    while (*p != '\0' && n < FP_MAX) {
+        if (isspace(*p)) {
+            p++;
+            space = 1;
+            continue;
+        }
+        if (*p == '#' || (p[0] == '-' && p[1] == '-'
+                          && (p[2] == '\0' || isspace(p[2])))) {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+            space = 1;
+            continue;
+        }
+        if (p[0] == '/' && p[1] == '*') {
+            for (p += 2; *p != '\0' && !(p[0] == '*' && p[1] == '/'); p++)
+                ;
+            if (*p != '\0') {
+                p += 2;
+            }
+            space = 1;
+            continue;
+        }
+        if (space && n > 0 && strchr(FP_TIGHT "(", buf[n - 1]) == NULL
+            && strchr(FP_TIGHT "()", *p) == NULL) {
+            buf[n++] = ' ';
+            if (n == FP_MAX) {
+                break;
+            }
+        }
+        space = 0;
+
+        if (*p == '\'' || *p == '"') {
+            for (q = *p++; *p != '\0'; p++) {
+                if (*p == '\\' && p[1] != '\0') {
+                    p++;
+                } else if (*p == q) {
+                    if (p[1] != q) {
+                        p++;
+                        break;
+                    }
+                    p++;
+                }
+            }
+            FpPlaceholder(buf, &n);
+        } else if (isdigit(*p) || (*p == '.' && isdigit(p[1]))) {
+            for (p++; isalnum(*p) || *p == '.'
+                     || ((*p == '+' || *p == '-')
+                         && (p[-1] == 'e' || p[-1] == 'E')); p++)
+                ;
+            FpPlaceholder(buf, &n);
+        } else if (*p == '?') {
+            p++;
+            FpPlaceholder(buf, &n);
+        } else if (*p == '`') {
+            do {
+                buf[n++] = *p++;
+            } while (*p != '\0' && *p != '`' && n < FP_MAX);
+            if (*p == '`' && n < FP_MAX) {
+                buf[n++] = *p++;
+            }
+        } else if (isalpha(*p) || *p == '_' || *p == '$' || *p >= 0x80) {
+            do {
+                buf[n++] = tolower(*p++);
+            } while ((isalnum(*p) || *p == '_' || *p == '$' || *p >= 0x80)
+                     && n < FP_MAX);
+        } else {
+            buf[n++] = *p++;
+            if (p[-1] == ')') {
+                FpGroup(buf, &n);
+            }
+        }
+    }
+    buf[n] = '\0';
+
+    for (i = 0; i < n; i++) {
+        hash = (hash ^ (unsigned char) buf[i]) * 16777619U;
+    }
+
+    return hash != 0 ? hash : 1;
+}
+
+/*
+ * ProfileFind - Look up a fingerprint in its stripe, whose lock is
+ * held.  Without the text, only the hash is compared.  When create is
+ * set, a missing one is given a slot.
+ */
+
+static ProfileEntry *
+ProfileFind(ProfileStripe *stripe, unsigned int hash, char *fingerprint,
+            int create)
+{
+    ProfileEntry   *e, *victim = NULL;
+    int             i, j;
+
+    if (stripe->slots == NULL) {
+        if (!create) {
+            return NULL;
+        }
+        stripe->size = profileSize / PROFILE_STRIPES;
+        if (stripe->size < PROFILE_PROBES) {
+            stripe->size = PROFILE_PROBES;
+        }
+        stripe->slots = ns_calloc(stripe->size, sizeof(ProfileEntry));
+    }
+
+    j = (int) ((hash / PROFILE_STRIPES) % (unsigned int) stripe->size);
+    for (i = 0; i < PROFILE_PROBES; i++, j = (j + 1) % stripe->size) {
+        e = &stripe->slots[j];
+        if (e->hash == hash && (fingerprint == NULL
+                                || STREQ(e->fingerprint, fingerprint))) {
+            return e;
+        }
+        if (victim == NULL || (victim->hash != 0
+                               && (e->hash == 0 || e->time < victim->time))) {
+            victim = e;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+
+    ns_free(victim->fingerprint);
+    memset(victim, 0, sizeof(ProfileEntry));
+    victim->hash = hash;
+    victim->fingerprint = ns_strdup(fingerprint);
+
+    return victim;
+}
+
+/*
+ * ProfileAdd - Count a statement under its fingerprint.  Returns the
+ * fingerprint's hash for ProfileRows(), or 0 if profiling is off.
+ */
+
+static unsigned int
+ProfileAdd(char *sql, unsigned long us, int failed, Tcl_WideInt rows)
+{
+    ProfileStripe  *stripe;
+    ProfileEntry   *e;
+    char            buf[FP_MAX + 1];
+    unsigned int    hash;
+
+    if (profileSize == 0) {
+        return 0;
+    }
+
+    hash = Fingerprint(sql, buf);
+    stripe = &profile[hash % PROFILE_STRIPES];
+
+    Ns_MutexLock(&stripe->lock);
+    e = ProfileFind(stripe, hash, buf, NS_TRUE);
+    e->calls++;
+    if (failed) {
+        e->errors++;
+    }
+    e->rows += rows;
+    e->time += us;
+    if (us > e->max) {
+        e->max = us;
+    }
+    Ns_MutexUnlock(&stripe->lock);
+
+    return hash;
+}
+
+/*
+ * ProfileRows - Add the rows of a result counted after QueryDone().
+ */
+
+static void
+ProfileRows(unsigned int hash, Tcl_WideInt rows)
+{
+    ProfileStripe  *stripe;
+    ProfileEntry   *e;
+
+    if (hash == 0 || rows == 0) {
+        return;
+    }
+
+    stripe = &profile[hash % PROFILE_STRIPES];
+    Ns_MutexLock(&stripe->lock);
+    e = ProfileFind(stripe, hash, NULL, NS_FALSE);
+    if (e != NULL) {
+        e->rows += rows;
+    }
+    Ns_MutexUnlock(&stripe->lock);
+}
+
+/*
+ * ProfileCompare - qsort() order for [ns_mysql top], largest first by
+ * the key in profileSortBy.
+ */
+
+#define TOP_TIME        0
+#define TOP_CALLS       1
+#define TOP_ROWS        2
+#define TOP_ERRORS      3
+
+static int      profileSortBy;
+
+static int
+ProfileCompare(const void *a, const void *b)
+{
+    const ProfileEntry *x = (const ProfileEntry *) a;
+    const ProfileEntry *y = (const ProfileEntry *) b;
+    Tcl_WideInt     d = 0;
+
+    switch (profileSortBy) {
+    case TOP_TIME:
+        d = y->time - x->time;
+        break;
+    case TOP_CALLS:
+        d = (Tcl_WideInt) y->calls - (Tcl_WideInt) x->calls;
+        break;
+    case TOP_ROWS:
+        d = y->rows - x->rows;
+        break;
+    case TOP_ERRORS:
+        d = (Tcl_WideInt) y->errors - (Tcl_WideInt) x->errors;
+        break;
+    }
+
+    return d > 0 ? 1 : d < 0 ? -1 : 0;
+}
+
+/*
+ * Ns_MySQL_Top - Report the n costliest fingerprints by the given key
+ * and, with reset, start counting afresh.
+ */
+
+static int
+Ns_MySQL_Top(Tcl_Interp *interp, int by, int n, int reset)
+{
+    static Ns_Mutex sortLock;
+    ProfileStripe  *stripe;
+    ProfileEntry   *entries;
+    Tcl_Obj        *resultObj, *entryObj;
+    int             i, j, count = 0, size = 0;
+
+    for (i = 0; i < PROFILE_STRIPES; i++) {
+        size += profile[i].size;
+    }
+    entries = ns_malloc((size + 1) * sizeof(ProfileEntry));
+
+    /*
+     * Copy the counts out, each stripe under its own lock, so that
+     * queries are held up for no longer than the copy takes.
+     */
+
+    for (i = 0; i < PROFILE_STRIPES; i++) {
+        stripe = &profile[i];
+        Ns_MutexLock(&stripe->lock);
+        for (j = 0; j < stripe->size && count < size; j++) {
+            if (stripe->slots[j].hash != 0) {
+                entries[count] = stripe->slots[j];
+                entries[count].fingerprint =
+                    ns_strdup(stripe->slots[j].fingerprint);
+                count++;
+            }
+            if (reset) {
+                ns_free(stripe->slots[j].fingerprint);
+                memset(&stripe->slots[j], 0, sizeof(ProfileEntry));
+            }
+        }
+        Ns_MutexUnlock(&stripe->lock);
+    }
+
+    Ns_MutexLock(&sortLock);
+    profileSortBy = by;
+    qsort(entries, (size_t) count, sizeof(ProfileEntry), ProfileCompare);
+    Ns_MutexUnlock(&sortLock);
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < count; i++) {
+        if (i < n) {
+            entryObj = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewStringObj("fingerprint", -1));
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewStringObj(entries[i].fingerprint, -1));
+            AppendCount(entryObj, "calls", entries[i].calls);
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewStringObj("time", -1));
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewWideIntObj(entries[i].time));
+            AppendCount(entryObj, "avg",
+                (unsigned long) (entries[i].time / entries[i].calls));
+            AppendCount(entryObj, "max", entries[i].max);
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewStringObj("rows", -1));
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewWideIntObj(entries[i].rows));
+            AppendCount(entryObj, "errors", entries[i].errors);
+            Tcl_ListObjAppendElement(NULL, resultObj, entryObj);
+        }
+        ns_free(entries[i].fingerprint);
+    }
+    ns_free(entries);
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * CacheUnlink - Drop an entry from the cache; it is freed now or when
+ * the last thread still reading it lets go.  Called with cacheLock held.
+ */
+
+static void
+CacheUnlink(CacheEntry *entry)
+{
+    if (entry->prev != NULL) {
+        entry->prev->next = entry->next;
+    } else {
+        cacheHead = entry->next;
+    }
+    if (entry->next != NULL) {
+        entry->next->prev = entry->prev;
+    } else {
+        cacheTail = entry->prev;
+    }
+    Tcl_DeleteHashEntry(entry->hPtr);
+    entry->hPtr = NULL;
+    cacheSize -= entry->size;
+
+    if (entry->refs == 0) {
+        ns_free(entry);
+    }
+}
+
+static void
+CacheRelease(CacheEntry *entry)
+{
+    Ns_MutexLock(&cacheLock);
+    if (--entry->refs == 0 && entry->hPtr == NULL) {
+        ns_free(entry);
+    }
+    Ns_MutexUnlock(&cacheLock);
+}
+
+/*
+ * CacheLookup - Return the live entry for key, held for the caller, or
+ * NULL on a miss.  Expired and invalidated entries are dropped here.
+ */
+
+static CacheEntry *
+CacheLookup(char *key)
+{
+    Tcl_HashEntry  *hPtr;
+    CacheEntry     *entry = NULL;
+    int             i;
+
+    Ns_MutexLock(&cacheLock);
+    hPtr = Tcl_FindHashEntry(&cacheEntries, key);
+    if (hPtr != NULL) {
+        entry = (CacheEntry *) Tcl_GetHashValue(hPtr);
+        if (entry->expires <= time(NULL)) {
+            cacheExpirations++;
+            CacheUnlink(entry);
+            entry = NULL;
+        } else {
+            for (i = 0; i < entry->ntables; i++) {
+                if (entry->tables[i]->generation != entry->generations[i]) {
+                    cacheInvalidations++;
+                    CacheUnlink(entry);
+                    entry = NULL;
+                    break;
+                }
+            }
+        }
+    }
+    if (entry != NULL) {
+        if (entry != cacheHead) {
+            entry->prev->next = entry->next;
+            if (entry->next != NULL) {
+                entry->next->prev = entry->prev;
+            } else {
+                cacheTail = entry->prev;
+            }
+            entry->prev = NULL;
+            entry->next = cacheHead;
+            cacheHead->prev = entry;
+            cacheHead = entry;
+        }
+        entry->refs++;
+        cacheHits++;
+    } else {
+        cacheMisses++;
+    }
+    Ns_MutexUnlock(&cacheLock);
+
+    return entry;
+}
+
+/*
+ * CacheStore - Copy a stored result into a single allocation and add it
+ * to the cache under key, evicting least recently used entries to stay
+ * within cachesize.  The entry depends on the ntables tables, with the
+ * generations they had before the query ran.  Returns the entry held
+ * for the caller.  It is returned without being added if key is NULL,
+ * if it is too large to cache, if one of its tables has been written
+ * to since, or if a column comes from a table it does not depend on,
+ * as from a view.
+ */
+
+static CacheEntry *
+CacheStore(char *key, MYSQL_RES *result, int ttl, CacheTable **tables,
+           unsigned long *generations, int ntables)
+{
+    CacheEntry     *entry;
+    MYSQL_FIELD    *fields;
+    MYSQL_ROW       row;
+    Tcl_HashEntry  *hPtr;
+    unsigned long  *lengths;
+    unsigned long   nrows, r;
+    unsigned int    numcols, i, j;
+    size_t          size;
+    char           *p, name[MAX_IDENTIFIER + 1];
+    int             new, t;
+
+    numcols = mysql_num_fields(result);
+    nrows = (unsigned long) mysql_num_rows(result);
+    fields = mysql_fetch_fields(result);
+    if (ntables < 0) {
+        ntables = 0;
+    }
+
+    size = sizeof(CacheEntry) + ntables * (sizeof(CacheTable *)
+        + sizeof(unsigned long)) + numcols * sizeof(char *)
+        + nrows * numcols * (sizeof(char *) + sizeof(unsigned long));
+    for (i = 0; i < numcols; i++) {
+        size += fields[i].name_length + 2;
+    }
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        lengths = mysql_fetch_lengths(result);
+        for (i = 0; i < numcols; i++) {
+            size += row[i] == NULL ? 0 : lengths[i] + 1;
+        }
+    }
+    mysql_data_seek(result, 0);
+
+    entry = ns_malloc(size);
+    memset(entry, 0, sizeof(CacheEntry));
+    entry->refs = 1;
+    entry->size = size;
+    entry->expires = time(NULL) + ttl;
+    entry->numcols = numcols;
+    entry->nrows = nrows;
+    entry->ntables = ntables;
+    entry->tables = (CacheTable **) (entry + 1);
+    entry->generations = (unsigned long *) (entry->tables + ntables);
+    entry->lengths = entry->generations + ntables;
+    entry->names = (char **) (entry->lengths + nrows * numcols);
+    entry->values = entry->names + numcols;
+
+    p = (char *) (entry->values + nrows * numcols);
+    entry->kinds = p;
+    p += numcols;
+    for (i = 0; i < numcols; i++) {
+        entry->kinds[i] = (char) ColumnKind(&fields[i]);
+        entry->names[i] = p;
+        memcpy(p, fields[i].name, fields[i].name_length + 1);
+        p += fields[i].name_length + 1;
+    }
+    for (r = 0; (row = mysql_fetch_row(result)) != NULL; r++) {
+        lengths = mysql_fetch_lengths(result);
+        for (i = 0; i < numcols; i++) {
+            entry->lengths[r * numcols + i] = lengths[i];
+            if (row[i] == NULL) {
+                entry->values[r * numcols + i] = NULL;
+                continue;
+            }
+            entry->values[r * numcols + i] = p;
+            memcpy(p, row[i], lengths[i]);
+            p[lengths[i]] = '\0';
+            p += lengths[i] + 1;
+        }
+    }
+
+    for (t = 0; t < ntables; t++) {
+        entry->tables[t] = tables[t];
+        entry->generations[t] = generations[t];
+    }
+
+    if (key == NULL || size > (size_t) cacheMax) {
+        return entry;
+    }
+
+    Ns_MutexLock(&cacheLock);
+
+    for (t = 0; t < ntables; t++) {
+        if (tables[t]->generation != generations[t]) {
+            cacheInvalidations++;
+            Ns_MutexUnlock(&cacheLock);
+            return entry;
+        }
+    }
+    for (i = 0; i < numcols; i++) {
+        if (fields[i].org_table == NULL || fields[i].org_table[0] == '\0') {
+            continue;
+        }
+        for (j = 0; fields[i].org_table[j] != '\0' && j < MAX_IDENTIFIER;
+             j++) {
+            name[j] = tolower(UCHAR(fields[i].org_table[j]));
+        }
+        name[j] = '\0';
+        hPtr = Tcl_FindHashEntry(&cacheTables, name);
+        for (t = 0; hPtr != NULL && t < ntables; t++) {
+            if (tables[t] == (CacheTable *) Tcl_GetHashValue(hPtr)) {
+                break;
+            }
+        }
+        if (hPtr == NULL || t == ntables) {
+            cacheUncached++;
+            Ns_MutexUnlock(&cacheLock);
+            return entry;
+        }
+    }
+
+    hPtr = Tcl_CreateHashEntry(&cacheEntries, key, &new);
+    if (!new) {
+        CacheUnlink((CacheEntry *) Tcl_GetHashValue(hPtr));
+        hPtr = Tcl_CreateHashEntry(&cacheEntries, key, &new);
+    }
+    entry->hPtr = hPtr;
+    Tcl_SetHashValue(hPtr, entry);
+    entry->next = cacheHead;
+    if (cacheHead != NULL) {
+        cacheHead->prev = entry;
+    } else {
+        cacheTail = entry;
+    }
+    cacheHead = entry;
+    cacheSize += size;
+
+    while (cacheSize > (size_t) cacheMax && cacheTail != entry) {
+        cacheEvictions++;
+        CacheUnlink(cacheTail);
+    }
+    Ns_MutexUnlock(&cacheLock);
+
+    return entry;
+}
+
+/*
+ * Ns_MySQL_CachedSelect - Return the rows of a query, in the formats of
+ * [ns_mysql fetch_all], from the query cache when it holds a live copy
+ * of them for the handle's server and database, and otherwise from the
+ * server, caching them for ttl seconds.  Only a read whose tables are
+ * known, made outside a transaction on a connection whose database the
+ * server reports, is cached; others always go to the server.
+ */
+
+static int
+Ns_MySQL_CachedSelect(Tcl_Interp *interp, char *sql, int ttl, int format,
+                      Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    MYSQL_RES      *result;
+    CacheEntry     *entry = NULL;
+    CacheTable     *tables[CACHE_DEPS];
+    unsigned long   generations[CACHE_DEPS];
+    Ns_DString      key;
+    Tcl_Obj        *resultObj, *rowObj, *valueObj;
+    Tcl_Obj       **keyObjs, **colObjs = NULL;
+    unsigned long   r, k;
+    unsigned int    i;
+    int             rc, ntables = -1;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_CachedSelect(%s) called.",
+            handle->datasource);
+
+    if (ctx != NULL && ctx->primary == ctx->home && ctx->schema != NULL
+        && !(ctx->home->server_status & SERVER_STATUS_IN_TRANS)
+        && !IsWrite(sql)) {
+        ntables = CacheDepends(sql, tables, generations);
+    }
+
+    Ns_DStringInit(&key);
+    if (ntables > 0) {
+        Ns_DStringVarAppend(&key, PrimarySource(handle), "\n",
+            ctx->schema, "\n", sql, NULL);
+        entry = CacheLookup(Ns_DStringValue(&key));
+    } else {
+        Ns_MutexLock(&cacheLock);
+        cacheUncached++;
+        Ns_MutexUnlock(&cacheLock);
+    }
+    if (entry == NULL) {
+        FreeResult(handle);
+        mysql = (MYSQL *) handle->connection;
+
+        rc = Query(handle, sql);
+        mysql = (MYSQL *) handle->connection;
+        result = rc ? NULL : mysql_store_result(mysql);
+        CacheInvalidate(handle, sql);
+        if (result == NULL) {
+            Log(handle, mysql);
+            Ns_DStringFree(&key);
+            if (rc == 0 && mysql_errno(mysql) == 0) {
+                DrainResults(handle);
+                Tcl_AppendResult(interp, "query did not return rows", NULL);
+            } else {
+                Tcl_AppendResult(interp, "query failed: ",
+                    Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+            }
+            return TCL_ERROR;
+        }
+        entry = CacheStore(ntables > 0 ? Ns_DStringValue(&key) : NULL,
+                           result, ttl, tables, generations, ntables);
+        mysql_free_result(result);
+        DrainResults(handle);
+    }
+    Ns_DStringFree(&key);
+
+    keyObjs = ns_malloc(entry->numcols * sizeof(Tcl_Obj *));
+    for (i = 0; i < entry->numcols; i++) {
+        keyObjs[i] = Tcl_NewStringObj(entry->names[i], -1);
+        Tcl_IncrRefCount(keyObjs[i]);
+    }
+    if (format == FORMAT_COLUMNS) {
+        colObjs = ns_malloc(entry->numcols * sizeof(Tcl_Obj *));
+        for (i = 0; i < entry->numcols; i++) {
+            colObjs[i] = Tcl_NewListObj(0, NULL);
+        }
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (r = 0; r < entry->nrows; r++) {
+        rowObj = (format == FORMAT_COLUMNS) ? NULL : Tcl_NewListObj(0, NULL);
+        for (i = 0; i < entry->numcols; i++) {
+            k = r * entry->numcols + i;
+            valueObj = NewValueObj(entry->kinds[i], entry->values[k],
+                                   entry->lengths[k]);
+            switch (format) {
+            case FORMAT_DICTS:
+                Tcl_ListObjAppendElement(NULL, rowObj, keyObjs[i]);
+                /* FALLTHROUGH */
+            case FORMAT_LISTS:
+                Tcl_ListObjAppendElement(NULL, rowObj, valueObj);
+                break;
+            case FORMAT_COLUMNS:
+                Tcl_ListObjAppendElement(NULL, colObjs[i], valueObj);
+                break;
+            }
+        }
+        if (rowObj != NULL) {
+            Tcl_ListObjAppendElement(NULL, resultObj, rowObj);
+        }
+    }
+
+    if (format == FORMAT_COLUMNS) {
+        for (i = 0; i < entry->numcols; i++) {
+            Tcl_ListObjAppendElement(NULL, resultObj, keyObjs[i]);
+            Tcl_ListObjAppendElement(NULL, resultObj, colObjs[i]);
+        }
+        ns_free(colObjs);
+    }
+    for (i = 0; i < entry->numcols; i++) {
+        Tcl_DecrRefCount(keyObjs[i]);
+    }
+    ns_free(keyObjs);
+    CacheRelease(entry);
+
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_Batch - Send a list of statements to the server in one
+ * round trip and return one entry per result, in order:
+ *
+ *   affected n                          for statements without rows
+ *   columns {c1 c2 ...} rows {{...} ...} for statements with rows
+ *
+ * The server stops at the first failing statement; its error is raised
+ * after the remaining results have been read, leaving the handle in
+ * sync.  The statements that ran are noted for the session reset like
+ * any other.  Requires "ns_param multistatements on" for the pool.
+ */
+
+static int
+Ns_MySQL_Batch(Tcl_Interp *interp, Tcl_Obj *stmtsObj, Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    MYSQL_FIELD    *fields;
+    unsigned long  *lengths;
+    Ns_DString      ds;
+    Ns_Time         start;
+    Tcl_Obj        *resultObj, *entryObj, *listObj, *rowObj, **stmtObjs;
+    Tcl_WideInt     rows = 0;
+    unsigned int    numcols, i;
+    int             nstmts, status, len, n, k;
+    char           *stmt;
+    char            buf[TCL_INTEGER_SPACE];
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Batch(%s) called.", handle->datasource);
+
+    if (ctx == NULL || !ctx->pool->multistatements) {
+        Tcl_AppendResult(interp, "multistatements is not enabled for pool \"",
+            handle->poolname, "\"", NULL);
+        return TCL_ERROR;
+    }
+
+    if (Tcl_ListObjGetElements(interp, stmtsObj, &nstmts, &stmtObjs)
+        != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (nstmts == 0) {
+        return TCL_OK;
+    }
+
+    Ns_DStringInit(&ds);
+    for (n = 0; n < nstmts; n++) {
+        stmt = Tcl_GetStringFromObj(stmtObjs[n], &len);
+        while (len > 0 && (isspace(UCHAR(stmt[len - 1]))
+                           || stmt[len - 1] == ';')) {
+            len--;
+        }
+        /* On a line of its own, in case stmt ends in a comment. */
+        if (n > 0) {
+            Ns_DStringNAppend(&ds, "\n;\n", 3);
+        }
+        Ns_DStringNAppend(&ds, stmt, len);
+    }
+
+    /* Back on the primary if a read on a replica was still open. */
+    FreeResult(handle);
+
+    Ns_GetTime(&start);
+    status = Query(handle, Ns_DStringValue(&ds));
+    mysql = (MYSQL *) handle->connection;
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    n = 0;
+
+    while (status == 0) {
+        result = mysql_store_result(mysql);
+        entryObj = Tcl_NewListObj(0, NULL);
+
+        if (result != NULL) {
+            numcols = mysql_num_fields(result);
+            fields = mysql_fetch_fields(result);
+
+            listObj = Tcl_NewListObj(0, NULL);
+            for (i = 0; i < numcols; i++) {
+                Tcl_ListObjAppendElement(NULL, listObj,
+                    Tcl_NewStringObj(fields[i].name, -1));
+            }
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewStringObj("columns", -1));
+            Tcl_ListObjAppendElement(NULL, entryObj, listObj);
+
+            listObj = Tcl_NewListObj(0, NULL);
+            while ((row = mysql_fetch_row(result)) != NULL) {
+                lengths = mysql_fetch_lengths(result);
+                rowObj = Tcl_NewListObj(0, NULL);
+                for (i = 0; i < numcols; i++) {
+                    Tcl_ListObjAppendElement(NULL, rowObj,
+                        NewValueObj(ColumnKind(&fields[i]), row[i],
+                                    lengths[i]));
+                }
+                Tcl_ListObjAppendElement(NULL, listObj, rowObj);
+            }
+            rows += (Tcl_WideInt) mysql_num_rows(result);
+            mysql_free_result(result);
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewStringObj("rows", -1));
+            Tcl_ListObjAppendElement(NULL, entryObj, listObj);
+        } else if (mysql_field_count(mysql) == 0) {
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewStringObj("affected", -1));
+            Tcl_ListObjAppendElement(NULL, entryObj,
+                Tcl_NewWideIntObj((Tcl_WideInt) mysql_affected_rows(mysql)));
+            rows += (Tcl_WideInt) mysql_affected_rows(mysql);
+        } else {
+            /* Reading the result failed; no further results follow. */
+            Tcl_DecrRefCount(entryObj);
+            status = 1;
+            break;
+        }
+
+        Tcl_ListObjAppendElement(NULL, resultObj, entryObj);
+        n++;
+
+        /* Query() took in the first result's session changes. */
+        status = mysql_next_result(mysql);
+        if (status == 0) {
+            SessionTrack(handle);
+        }
+    }
+
+    /* Only now have all the statements run. */
+    if (status > 0) {
+        Log(handle, mysql);
+        DrainResults(handle);
+    }
+    /* A failed batch stopped at the statement of result n. */
+    for (k = 0; k < nstmts && (status <= 0 || k < n); k++) {
+        SessionDone(handle, Tcl_GetString(stmtObjs[k]));
+    }
+    CacheInvalidate(handle, Ns_DStringValue(&ds));
+    QueryDone(handle, &start, Ns_DStringValue(&ds), status > 0, rows);
+    Ns_DStringFree(&ds);
+
+    if (status > 0) {
+        Tcl_DecrRefCount(resultObj);
+        sprintf(buf, "%d", n);
+        Tcl_AppendResult(interp, "batch failed at result ", buf, ": ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * Rows handed to LOAD DATA LOCAL by the infile callbacks below, as
+ * tab separated lines built one row at a time as the client library
+ * asks for more.
+ */
+
+typedef struct Infile {
+    Tcl_Obj       **rows;
+    int             nrows;
+    int             next;               /* Next row to format. */
+    char           *null;               /* Value sent as NULL, or NULL. */
+    Ns_DString      buf;
+    int             offset;             /* Start of unsent data in buf. */
+} Infile;
+
+static int
+InfileInit(void **ptr, const char *filename, void *userdata)
+{
+    *ptr = userdata;
+    return 0;
+}
+
+static int
+InfileRead(void *ptr, char *buf, unsigned int len)
+{
+    Infile         *in = (Infile *) ptr;
+    Tcl_Obj       **valueObjs;
+    char           *value;
+    int             nvalues, vlen, i, n;
+
+    while (Ns_DStringLength(&in->buf) - in->offset < (int) len
+           && in->next < in->nrows) {
+        if (in->offset > 0) {
+            n = Ns_DStringLength(&in->buf) - in->offset;
+            memmove(in->buf.string, in->buf.string + in->offset, n);
+            Ns_DStringSetLength(&in->buf, n);
+            in->offset = 0;
+        }
+        Tcl_ListObjGetElements(NULL, in->rows[in->next++], &nvalues,
+                               &valueObjs);
+        for (i = 0; i < nvalues; i++) {
+            if (i > 0) {
+                Ns_DStringNAppend(&in->buf, "\t", 1);
+            }
+            value = Tcl_GetStringFromObj(valueObjs[i], &vlen);
+            if (in->null != NULL && STREQ(value, in->null)) {
+                Ns_DStringNAppend(&in->buf, "\\N", 2);
+                continue;
+            }
+            for (; vlen > 0; value++, vlen--) {
+                switch (*value) {
+                case '\t': Ns_DStringNAppend(&in->buf, "\\t", 2); break;
+                case '\n': Ns_DStringNAppend(&in->buf, "\\n", 2); break;
+                case '\\': Ns_DStringNAppend(&in->buf, "\\\\", 2); break;
+                case '\0': Ns_DStringNAppend(&in->buf, "\\0", 2); break;
+                default:   Ns_DStringNAppend(&in->buf, value, 1); break;
+                }
+            }
+        }
+        Ns_DStringNAppend(&in->buf, "\n", 1);
+    }
+
+    n = Ns_DStringLength(&in->buf) - in->offset;
+    if (n > (int) len) {
+        n = (int) len;
+    }
+    memcpy(buf, in->buf.string + in->offset, n);
+    in->offset += n;
+
+    return n;
+}
+
+static void
+InfileEnd(void *ptr)
+{
+    /* The rows and buffer belong to Ns_MySQL_BulkInsert(). */
+}
+
+static int
+InfileError(void *ptr, char *msg, unsigned int len)
+{
+    strncpy(msg, "bulk_insert: reading rows failed", len);
+    msg[len - 1] = '\0';
+    return CR_UNKNOWN_ERROR;
+}
+
+/*
+ * AppendIdent - Append an identifier in backquotes; when qualified, a
+ * "db.table" is quoted as two names.
+ */
+
+static void
+AppendIdent(Ns_DString *dsPtr, char *name, int qualified)
+{
+    Ns_DStringNAppend(dsPtr, "`", 1);
+    for (; *name != '\0'; name++) {
+        if (*name == '`') {
+            Ns_DStringNAppend(dsPtr, "``", 2);
+        } else if (*name == '.' && qualified) {
+            Ns_DStringNAppend(dsPtr, "`.`", 3);
+        } else {
+            Ns_DStringNAppend(dsPtr, name, 1);
+        }
+    }
+    Ns_DStringNAppend(dsPtr, "`", 1);
+}
+
+/*
+ * ServerMaxPacket - Ask the server for the limit MaxPacket keeps.
+ */
+
+static unsigned long
+ServerMaxPacket(MYSQL *mysql)
+{
+    MYSQL_RES      *result;
+    MYSQL_ROW       row;
+    unsigned long   max = 1024 * 1024;
+
+    if (mysql_query(mysql, "SELECT @@max_allowed_packet") == 0
+        && (result = mysql_store_result(mysql)) != NULL) {
+        row = mysql_fetch_row(result);
+        if (row != NULL && row[0] != NULL) {
+            max = strtoul(row[0], NULL, 10);
+        }
+        mysql_free_result(result);
+    } else {
+        Log(NULL, mysql);
+    }
+    if (max > 16 * 1024 * 1024) {
+        max = 16 * 1024 * 1024;
+    }
+
+    return max;
+}
+
+/*
+ * MaxPacket - The longest statement the server accepts, asked once per
+ * connection.  Kept under 16MB so a chunk does not hold up the server
+ * for long.
+ */
+
+static unsigned long
+MaxPacket(Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    if (ctx->max_packet == 0) {
+        ctx->max_packet = ServerMaxPacket((MYSQL *) handle->connection);
+    }
+
+    return ctx->max_packet;
+}
+
+
+/*
+ * BulkSend - Send one statement of a bulk insert and add its counts.
+ */
+
+static int
+BulkSend(Ns_DbHandle *handle, Ns_DString *sqlPtr, char *header,
+         Tcl_WideInt *affectedPtr, Tcl_WideInt *warningsPtr)
+{
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    Ns_Time         start;
+    int             rc;
+
+    Ns_GetTime(&start);
+    rc = mysql_real_query(mysql, Ns_DStringValue(sqlPtr),
+                          (unsigned long) Ns_DStringLength(sqlPtr));
+    QueryDone(handle, &start, header, rc != 0,
+              rc != 0 ? 0 : (Tcl_WideInt) mysql_affected_rows(mysql));
+    if (rc != 0) {
+        Log(handle, mysql);
+        return NS_ERROR;
+    }
+    *affectedPtr += (Tcl_WideInt) mysql_affected_rows(mysql);
+    *warningsPtr += mysql_warning_count(mysql);
+
+    return NS_OK;
+}
+
+/*
+ * Ns_MySQL_BulkInsert - Insert a list of rows into a table with as few
+ * round trips as possible: multi-row INSERTs each filling up to
+ * max_allowed_packet, or in infile mode a single LOAD DATA LOCAL fed
+ * from the rows in memory.  Values equal to nullValue, when given, are
+ * inserted as NULL.  Returns rows, affected, statements, warnings,
+ * seconds and rows_per_sec.
+ */
+
+static int
+Ns_MySQL_BulkInsert(Tcl_Interp *interp, char *table, Tcl_Obj *columnsObj,
+                    Tcl_Obj *rowsObj, int infile, char *nullValue,
+                    Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MYSQL          *mysql;
+    Ns_DString      header, sql, row;
+    Ns_Time         start, end, diff;
+    Tcl_Obj       **colObjs, **rowObjs, **valueObjs, *resultObj;
+    Tcl_WideInt     affected = 0, warnings = 0;
+    unsigned long   limit, n, esc;
+    int             ncols, nrows, nvalues, statements = 0, inchunk;
+    int             i, j, len, rc = NS_OK;
+    char           *value;
+    char            buf[TCL_INTEGER_SPACE * 3];
+    double          seconds;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_BulkInsert(%s) called.", handle->datasource);
+
+    if (infile && !ctx->pool->local_infile) {
+        Tcl_AppendResult(interp, "localinfile is not enabled for pool \"",
+            handle->poolname, "\"", NULL);
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, columnsObj, &ncols, &colObjs) != TCL_OK
+        || Tcl_ListObjGetElements(interp, rowsObj, &nrows, &rowObjs)
+        != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (ncols == 0) {
+        Tcl_AppendResult(interp, "no columns given", NULL);
+        return TCL_ERROR;
+    }
+
+    /* Check every row before sending any, so a bad one inserts nothing. */
+    for (i = 0; i < nrows; i++) {
+        if (Tcl_ListObjGetElements(interp, rowObjs[i], &nvalues, &valueObjs)
+            != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (nvalues != ncols) {
+            sprintf(buf, "%d has %d values, expected %d", i, nvalues, ncols);
+            Tcl_AppendResult(interp, "row ", buf, NULL);
+            return TCL_ERROR;
+        }
+    }
+
+    FreeResult(handle);
+    mysql = (MYSQL *) handle->connection;
+
+    Ns_DStringInit(&header);
+    Ns_DStringInit(&sql);
+    Ns_DStringInit(&row);
+    Ns_DStringAppend(&header, infile
+        ? "LOAD DATA LOCAL INFILE 'ns_mysql' INTO TABLE " : "INSERT INTO ");
+    AppendIdent(&header, table, NS_TRUE);
+    if (infile) {
+        Ns_DStringVarAppend(&header, " CHARACTER SET ",
+            mysql_character_set_name(mysql), NULL);
+    }
+    Ns_DStringAppend(&header, " (");
+    for (j = 0; j < ncols; j++) {
+        if (j > 0) {
+            Ns_DStringNAppend(&header, ",", 1);
+        }
+        AppendIdent(&header, Tcl_GetString(colObjs[j]), NS_FALSE);
+    }
+    Ns_DStringAppend(&header, infile ? ")" : ") VALUES ");
+
+    Ns_GetTime(&start);
+
+    if (nrows == 0) {
+        /* Nothing to send. */
+    } else if (infile) {
+        Infile          in;
+
+        in.rows = rowObjs;
+        in.nrows = nrows;
+        in.next = 0;
+        in.null = nullValue;
+        in.offset = 0;
+        Ns_DStringInit(&in.buf);
+        mysql_set_local_infile_handler(mysql, InfileInit, InfileRead,
+                                       InfileEnd, InfileError, &in);
+        rc = BulkSend(handle, &header, Ns_DStringValue(&header),
+                      &affected, &warnings);
+        mysql_set_local_infile_default(mysql);
+        Ns_DStringFree(&in.buf);
+        statements = 1;
+    } else {
+        limit = MaxPacket(handle);
+        Ns_DStringAppend(&sql, Ns_DStringValue(&header));
+        inchunk = 0;
+
+        for (i = 0; i < nrows && rc == NS_OK; i++) {
+            Tcl_ListObjGetElements(NULL, rowObjs[i], &nvalues, &valueObjs);
+            Ns_DStringSetLength(&row, 0);
+            Ns_DStringNAppend(&row, "(", 1);
+            for (j = 0; j < ncols; j++) {
+                if (j > 0) {
+                    Ns_DStringNAppend(&row, ",", 1);
+                }
+                value = Tcl_GetStringFromObj(valueObjs[j], &len);
+                if (nullValue != NULL && STREQ(value, nullValue)) {
+                    Ns_DStringNAppend(&row, "NULL", 4);
+                    continue;
+                }
+                Ns_DStringNAppend(&row, "'", 1);
+                n = Ns_DStringLength(&row);
+                Ns_DStringSetLength(&row, (int) n + 2 * len + 1);
+                esc = mysql_real_escape_string(mysql, row.string + n, value,
+                                               (unsigned long) len);
+                if (esc == (unsigned long) -1) {
+                    /* The server has NO_BACKSLASH_ESCAPES set. */
+                    Ns_DStringFree(&handle->dsExceptionMsg);
+                    Ns_DStringAppend(&handle->dsExceptionMsg,
+                        "mysql_real_escape_string failed");
+                    rc = NS_ERROR;
+                    break;
+                }
+                Ns_DStringSetLength(&row, (int) (n + esc));
+                Ns_DStringNAppend(&row, "'", 1);
+            }
+            Ns_DStringNAppend(&row, ")", 1);
+            if (rc != NS_OK) {
+                break;
+            }
+
+            if (inchunk > 0 && (unsigned long) (Ns_DStringLength(&sql)
+                + 1 + Ns_DStringLength(&row)) > limit) {
+                rc = BulkSend(handle, &sql, Ns_DStringValue(&header),
+                              &affected, &warnings);
+                statements++;
+                Ns_DStringSetLength(&sql, Ns_DStringLength(&header));
+                inchunk = 0;
+            }
+            if (inchunk > 0) {
+                Ns_DStringNAppend(&sql, ",", 1);
+            }
+            Ns_DStringNAppend(&sql, Ns_DStringValue(&row),
+                              Ns_DStringLength(&row));
+            inchunk++;
+        }
+        if (rc == NS_OK && inchunk > 0) {
+            rc = BulkSend(handle, &sql, Ns_DStringValue(&header),
+                          &affected, &warnings);
+            statements++;
+        }
+    }
+
+    Ns_GetTime(&end);
+    Ns_DiffTime(&end, &start, &diff);
+    CacheInvalidate(handle, Ns_DStringValue(&header));
+    Ns_DStringFree(&header);
+    Ns_DStringFree(&sql);
+    Ns_DStringFree(&row);
+
+    if (rc != NS_OK) {
+        sprintf(buf, "%lld", (long long) affected);
+        Tcl_AppendResult(interp, "bulk_insert failed after ", buf,
+            " rows: ", Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+
+    seconds = diff.sec + diff.usec / 1000000.0;
+    resultObj = Tcl_NewListObj(0, NULL);
+    AppendCount(resultObj, "rows", (unsigned long) nrows);
+    Tcl_ListObjAppendElement(NULL, resultObj,
+        Tcl_NewStringObj("affected", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(affected));
+    AppendCount(resultObj, "statements", (unsigned long) statements);
+    Tcl_ListObjAppendElement(NULL, resultObj,
+        Tcl_NewStringObj("warnings", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(warnings));
+    Tcl_ListObjAppendElement(NULL, resultObj,
+        Tcl_NewStringObj("seconds", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewDoubleObj(seconds));
+    Tcl_ListObjAppendElement(NULL, resultObj,
+        Tcl_NewStringObj("rows_per_sec", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj,
+        Tcl_NewDoubleObj(seconds > 0.0 ? nrows / seconds : 0.0));
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * Output formats of [ns_mysql copy_out].
+ */
+
+static CONST char *copyFormats[] = { "csv", "tsv", "json", NULL };
+
+#define COPY_CSV        0
+#define COPY_TSV        1
+#define COPY_JSON       2
+
+#define COPY_CHUNK      65536           /* Bytes buffered between writes. */
+
+static char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+/*
+ * CopyValue - Append one value to buf in the given format.  Bytes that
+ * need no escaping are copied in runs, so plain data costs one scan
+ * and one memcpy.
+ */
+
+static void
+CopyValue(Ns_DString *buf, int format, int kind, char *value,
+          unsigned long len)
+{
+    char           *end = value + len, *run, esc[8];
+    unsigned char   c;
+    unsigned long   i;
+
+    switch (format) {
+    case COPY_CSV:
+        /* NULL is an empty field, an empty string a quoted one. */
+        if (value == NULL) {
+            return;
+        }
+        for (run = value; run < end; run++) {
+            if (*run == '"' || *run == ',' || *run == '\n' || *run == '\r') {
+                break;
+            }
+        }
+        if (run == end && len > 0) {
+            Ns_DStringNAppend(buf, value, (int) len);
+            return;
+        }
+        Ns_DStringNAppend(buf, "\"", 1);
+        for (run = value; value < end; value++) {
+            if (*value == '"') {
+                Ns_DStringNAppend(buf, run, (int) (value - run + 1));
+                run = value;
+            }
+        }
+        Ns_DStringNAppend(buf, run, (int) (end - run));
+        Ns_DStringNAppend(buf, "\"", 1);
+        return;
+
+    case COPY_TSV:
+        /* As LOAD DATA INFILE reads it by default. */
+        if (value == NULL) {
+            Ns_DStringNAppend(buf, "\\N", 2);
+            return;
+        }
+        for (run = value; value < end; value++) {
+            switch (*value) {
+            case '\t': strcpy(esc, "\\t");  break;
+            case '\n': strcpy(esc, "\\n");  break;
+            case '\r': strcpy(esc, "\\r");  break;
+            case '\\': strcpy(esc, "\\\\"); break;
+            case '\0': strcpy(esc, "\\0");  break;
+            default:   continue;
+            }
+            Ns_DStringNAppend(buf, run, (int) (value - run));
+            Ns_DStringNAppend(buf, esc, 2);
+            run = value + 1;
+        }
+        Ns_DStringNAppend(buf, run, (int) (end - run));
+        return;
+
+    case COPY_JSON:
+        if (value == NULL) {
+            Ns_DStringNAppend(buf, "null", 4);
+            return;
+        }
+        if ((kind == KIND_INT || kind == KIND_DOUBLE) && len > 0) {
+            Ns_DStringNAppend(buf, value, (int) len);
+            return;
+        }
+        Ns_DStringNAppend(buf, "\"", 1);
+        if (kind == KIND_BINARY) {
+            /* Binary strings are not valid UTF-8, send them as base64. */
+            for (i = 0; i + 2 < len; i += 3) {
+                esc[0] = base64[UCHAR(value[i]) >> 2];
+                esc[1] = base64[((UCHAR(value[i]) & 3) << 4)
+                                | (UCHAR(value[i + 1]) >> 4)];
+                esc[2] = base64[((UCHAR(value[i + 1]) & 15) << 2)
+                                | (UCHAR(value[i + 2]) >> 6)];
+                esc[3] = base64[UCHAR(value[i + 2]) & 63];
+                Ns_DStringNAppend(buf, esc, 4);
+            }
+            if (i < len) {
+                esc[0] = base64[UCHAR(value[i]) >> 2];
+                if (i + 1 < len) {
+                    esc[1] = base64[((UCHAR(value[i]) & 3) << 4)
+                                    | (UCHAR(value[i + 1]) >> 4)];
+                    esc[2] = base64[(UCHAR(value[i + 1]) & 15) << 2];
+                } else {
+                    esc[1] = base64[(UCHAR(value[i]) & 3) << 4];
+                    esc[2] = '=';
+                }
+                esc[3] = '=';
+                Ns_DStringNAppend(buf, esc, 4);
+            }
+            Ns_DStringNAppend(buf, "\"", 1);
+            return;
+        }
+        for (run = value; value < end; value++) {
+            c = UCHAR(*value);
+            if (c >= 0x20 && c != '"' && c != '\\') {
+                continue;
+            }
+            switch (c) {
+            case '"':  strcpy(esc, "\\\""); break;
+            case '\\': strcpy(esc, "\\\\"); break;
+            case '\n': strcpy(esc, "\\n");  break;
+            case '\r': strcpy(esc, "\\r");  break;
+            case '\t': strcpy(esc, "\\t");  break;
+            default:   sprintf(esc, "\\u%04x", c); break;
+            }
+            Ns_DStringNAppend(buf, run, (int) (value - run));
+            Ns_DStringAppend(buf, esc);
+            run = value + 1;
+        }
+        Ns_DStringNAppend(buf, run, (int) (end - run));
+        Ns_DStringNAppend(buf, "\"", 1);
+        return;
+    }
+}
+
+/*
+ * CopyFlush - Write out and empty the buffer of [ns_mysql copy_out].
+ */
+
+static int
+CopyFlush(Ns_DString *buf, Tcl_Channel chan, Ns_Conn *conn,
+          Tcl_WideInt *bytesPtr)
+{
+    int             len = Ns_DStringLength(buf);
+
+    if (len == 0) {
+        return NS_OK;
+    }
+    if (chan != NULL ? Tcl_Write(chan, Ns_DStringValue(buf), len) != len
+        : Ns_ConnWrite(conn, Ns_DStringValue(buf), len) != len) {
+        return NS_ERROR;
+    }
+    *bytesPtr += len;
+    Ns_DStringSetLength(buf, 0);
+
+    return NS_OK;
+}
+
+/*
+ * Ns_MySQL_CopyOut - Run a query and write its rows as CSV, TSV or a
+ * JSON array of objects to a Tcl channel or, when chan is NULL, the
+ * connection.  The result is read with mysql_use_result() and encoded
+ * straight from the client library's buffers into one buffer that is
+ * written out every COPY_CHUNK bytes, so memory use does not grow with
+ * the result.  CSV and TSV start with a line of column names.
+ */
+
+static int
+Ns_MySQL_CopyOut(Tcl_Interp *interp, char *sql, int format, Tcl_Channel chan,
+                 Ns_Conn *conn, Ns_DbHandle *handle)
+{
+    static char    *types[] = {
+        "text/csv", "text/tab-separated-values", "application/json"
+    };
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLStats     *stats = &ctx->pool->stats;
+    MYSQL          *mysql;
+    MYSQL_RES      *result;
+    MYSQL_FIELD    *fields;
+    MYSQL_ROW       row;
+    Ns_DString      buf, keys;
+    Ns_Time         start;
+    Tcl_Obj        *resultObj;
+    Tcl_WideInt     rows = 0, bytes = 0;
+    unsigned long  *lengths;
+    unsigned long   rowbytes;
+    unsigned int    numcols, i;
+    int            *kinds, *keyoff;
+    int             rc = NS_OK, unwanted = NS_FALSE, lost = NS_FALSE;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_CopyOut(%s) called.", handle->datasource);
+
+    FreeResult(handle);
+    Route(handle, sql);
+
+    Ns_GetTime(&start);
+    if (Query(handle, sql) != 0) {
+        Log(handle, (MYSQL *) handle->connection);
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        UsePrimary(handle, NS_TRUE);
+        Tcl_AppendResult(interp, "copy_out failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    mysql = (MYSQL *) handle->connection;
+    CacheInvalidate(handle, sql);
+    result = mysql_use_result(mysql);
+    QueryDone(handle, &start, sql, result == NULL, 0);
+    if (result == NULL) {
+        Log(handle, mysql);
+        DrainResults(handle);
+        UsePrimary(handle, NS_TRUE);
+        Tcl_AppendResult(interp, "copy_out: query did not return rows", NULL);
+        return TCL_ERROR;
+    }
+
+    numcols = mysql_num_fields(result);
+    fields = mysql_fetch_fields(result);
+    kinds = ns_malloc(numcols * sizeof(int));
+    keyoff = ns_malloc((numcols + 1) * sizeof(int));
+    Ns_DStringInit(&buf);
+    Ns_DStringInit(&keys);
+
+    /*
+     * The header line, or for JSON each column's "name": prefix, is
+     * encoded once.
+     */
+
+    for (i = 0; i < numcols; i++) {
+        kinds[i] = ColumnKind(&fields[i]);
+        keyoff[i] = Ns_DStringLength(&keys);
+        if (format == COPY_JSON) {
+            Ns_DStringNAppend(&keys, i == 0 ? "{" : ",", 1);
+            CopyValue(&keys, COPY_JSON, KIND_STRING, fields[i].name,
+                      strlen(fields[i].name));
+            Ns_DStringNAppend(&keys, ":", 1);
+        } else {
+            if (i > 0) {
+                Ns_DStringNAppend(&buf, format == COPY_CSV ? "," : "\t", 1);
+            }
+            CopyValue(&buf, format, KIND_STRING, fields[i].name,
+                      strlen(fields[i].name));
+        }
+    }
+    keyoff[numcols] = Ns_DStringLength(&keys);
+    Ns_DStringNAppend(&buf, format == COPY_JSON ? "[" : "\n", 1);
+
+    if (chan == NULL && !(conn->flags & NS_CONN_SENTHDRS)) {
+        Ns_ConnSetRequiredHeaders(conn, types[format], -1);
+        Ns_ConnFlushHeaders(conn, 200);
+    }
+
+    while ((row = mysql_fetch_row(result)) != NULL) {
+        lengths = mysql_fetch_lengths(result);
+        rowbytes = 0;
+        if (format == COPY_JSON && rows > 0) {
+            Ns_DStringNAppend(&buf, ",\n", 2);
+        } else if (format == COPY_JSON) {
+            Ns_DStringNAppend(&buf, "\n", 1);
+        }
+        for (i = 0; i < numcols; i++) {
+            if (format == COPY_JSON) {
+                Ns_DStringNAppend(&buf, keys.string + keyoff[i],
+                                  keyoff[i + 1] - keyoff[i]);
+            } else if (i > 0) {
+                Ns_DStringNAppend(&buf, format == COPY_CSV ? "," : "\t", 1);
+            }
+            CopyValue(&buf, format, kinds[i], row[i], lengths[i]);
+            rowbytes += lengths[i];
+        }
+        Ns_DStringNAppend(&buf, format == COPY_JSON ? "}" : "\n", 1);
+        rows++;
+        ctx->bytes_received += rowbytes;
+        ATOMIC_ADD(&stats->rows, 1);
+        ATOMIC_ADD(&stats->bytes, rowbytes);
+
+        if (Ns_DStringLength(&buf) >= COPY_CHUNK
+            && CopyFlush(&buf, chan, conn, &bytes) != NS_OK) {
+            rc = NS_ERROR;
+            break;
+        }
+    }
+
+    if (rc == NS_OK && mysql_errno(mysql)) {
+        Log(handle, mysql);
+        rc = NS_ERROR;
+        Tcl_AppendResult(interp, "copy_out failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+    } else if (rc != NS_OK) {
+        unwanted = NS_TRUE;
+        Tcl_AppendResult(interp, "copy_out: write failed", NULL);
+    } else {
+        if (format == COPY_JSON) {
+            Ns_DStringNAppend(&buf, "\n]\n", 3);
+        }
+        if (CopyFlush(&buf, chan, conn, &bytes) != NS_OK) {
+            rc = NS_ERROR;
+            Tcl_AppendResult(interp, "copy_out: write failed", NULL);
+        }
+    }
+
+    /*
+     * After a failed write the rest of the result is killed first, as
+     * Ns_MySQL_Cancel does, so that freeing it does not read it all.
+     * Should the kill fail, the connection is shut down and replaced.
+     */
+
+    if (unwanted && KillQuery(handle, ConnSource(handle),
+                              mysql_thread_id(mysql)) != NS_OK) {
+        shutdown(AsyncSocket(mysql), SHUT_RDWR);
+        lost = NS_TRUE;
+    }
+    mysql_free_result(result);
+    DrainResults(handle);
+    if (lost) {
+        Reopen(handle);
+    }
+    UsePrimary(handle, NS_TRUE);
+    ProfileRows(((MySQLContext *) handle->context)->fp_hash, rows);
+    Ns_DStringFree(&buf);
+    Ns_DStringFree(&keys);
+    ns_free(kinds);
+    ns_free(keyoff);
+
+    if (rc != NS_OK) {
+        return TCL_ERROR;
+    }
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("rows", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(rows));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(bytes));
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * The chunk [ns_mysql blob_get] and [ns_mysql blob_put] move at a time.
+ */
+
+#define BLOB_CHUNK      65536
+
+/*
+ * BlobStmt - Prepare sql as a one-off statement and bind objv to its
+ * placeholders in order, skipping the one at blob (or none if blob is
+ * -1), which is bound for data sent with mysql_stmt_send_long_data().
+ * The statement is not cached: its result binding is its own.
+ */
+
+static MYSQL_STMT *
+BlobStmt(Tcl_Interp *interp, Ns_DbHandle *handle, char *sql, int objc,
+         Tcl_Obj *CONST objv[], int blob)
+{
+    MYSQL_STMT     *stmt;
+    MYSQL_BIND     *params;
+    unsigned long   nparams, i;
+    int             j, len, rc;
+    char            buf[TCL_INTEGER_SPACE + 1];
+
+    stmt = mysql_stmt_init((MYSQL *) handle->connection);
+    if (stmt == NULL) {
+        Log(handle, (MYSQL *) handle->connection);
+        Tcl_AppendResult(interp, "mysql_stmt_init failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return NULL;
+    }
+    if (mysql_stmt_prepare(stmt, sql, strlen(sql)) != 0) {
+        StmtLog(handle, stmt);
+        mysql_stmt_close(stmt);
+        Tcl_AppendResult(interp, "mysql_stmt_prepare failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return NULL;
+    }
+
+    nparams = mysql_stmt_param_count(stmt);
+    if (blob >= 0 && (unsigned long) blob >= nparams) {
+        mysql_stmt_close(stmt);
+        sprintf(buf, "%d", blob);
+        Tcl_AppendResult(interp, "statement has no parameter ", buf, NULL);
+        return NULL;
+    }
+    if ((unsigned long) objc + (blob >= 0) != nparams) {
+        mysql_stmt_close(stmt);
+        sprintf(buf, "%lu", nparams - (blob >= 0));
+        Tcl_AppendResult(interp, "statement expects ", buf,
+            " bind values", NULL);
+        return NULL;
+    }
+    if (nparams == 0) {
+        return stmt;
+    }
+
+    /* mysql_stmt_bind_param() copies the bindings, not the values. */
+    params = ns_calloc(nparams, sizeof(MYSQL_BIND));
+    for (i = 0, j = 0; i < nparams; i++) {
+        if ((int) i == blob) {
+            params[i].buffer_type = MYSQL_TYPE_LONG_BLOB;
+            params[i].buffer = "";
+            continue;
+        }
+        params[i].buffer_type = MYSQL_TYPE_STRING;
+        params[i].buffer = Tcl_GetStringFromObj(objv[j++], &len);
+        params[i].buffer_length = len;
+    }
+    rc = mysql_stmt_bind_param(stmt, params);
+    ns_free(params);
+    if (rc != 0) {
+        StmtLog(handle, stmt);
+        mysql_stmt_close(stmt);
+        Tcl_AppendResult(interp, "mysql_stmt_bind_param failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return NULL;
+    }
+
+    return stmt;
+}
+
+/*
+ * Ns_MySQL_BlobGet - Run a query and write one column of its first row
+ * to a Tcl channel or, when chan is NULL, the connection, with type
+ * and the value's length as its headers.  The value is bound with no
+ * buffer and read with mysql_stmt_fetch_column() BLOB_CHUNK bytes at a
+ * time, so it is neither copied whole nor cut at a NUL.  Returns the
+ * number of bytes written, or -1 if there was no row or the value was
+ * NULL, in which case nothing is written.
+ */
+
+static int
+Ns_MySQL_BlobGet(Tcl_Interp *interp, char *sql, Tcl_Obj *columnObj,
+                 int objc, Tcl_Obj *CONST objv[], Tcl_Channel chan,
+                 Ns_Conn *conn, char *type, Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLStats     *stats = &ctx->pool->stats;
+    MYSQL_STMT     *stmt;
+    MYSQL_RES      *meta;
+    MYSQL_FIELD    *fields;
+    MYSQL_BIND     *binds, bind;
+    Ns_Time         start;
+    unsigned long  *lengths, total, off, len;
+    my_bool        *nulls;
+    unsigned int    numcols, i;
+    char           *name, *buf = NULL;
+    int             rc, col = -1, n;
+    Tcl_WideInt     bytes = -1;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_BlobGet(%s) called.", handle->datasource);
+
+    FreeResult(handle);
+    Route(handle, sql);
+
+    Ns_GetTime(&start);
+    stmt = BlobStmt(interp, handle, sql, objc, objv, -1);
+    if (stmt == NULL) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        UsePrimary(handle, NS_TRUE);
+        return TCL_ERROR;
+    }
+    if (mysql_stmt_execute(stmt) != 0) {
+        StmtLog(handle, stmt);
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        mysql_stmt_close(stmt);
+        UsePrimary(handle, NS_TRUE);
+        Tcl_AppendResult(interp, "mysql_stmt_execute failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    meta = mysql_stmt_result_metadata(stmt);
+    if (meta == NULL) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        mysql_stmt_close(stmt);
+        UsePrimary(handle, NS_TRUE);
+        Tcl_AppendResult(interp, "blob_get: query did not return rows", NULL);
+        return TCL_ERROR;
+    }
+
+    numcols = mysql_num_fields(meta);
+    fields = mysql_fetch_fields(meta);
+    name = Tcl_GetString(columnObj);
+    for (i = 0; i < numcols; i++) {
+        if (STREQ(fields[i].name, name)) {
+            col = (int) i;
+            break;
+        }
+    }
+    if (col < 0 && Tcl_GetIntFromObj(NULL, columnObj, &n) == TCL_OK
+        && n >= 0 && (unsigned int) n < numcols) {
+        col = n;
+    }
+    mysql_free_result(meta);
+    if (col < 0) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        mysql_stmt_close(stmt);
+        UsePrimary(handle, NS_TRUE);
+        Tcl_AppendResult(interp, "blob_get: no column \"", name,
+            "\" in result", NULL);
+        return TCL_ERROR;
+    }
+
+    /*
+     * Every column is bound with no buffer: the fetch only reports
+     * lengths and NULLs, and says the row was truncated.
+     */
+
+    binds = ns_calloc(numcols, sizeof(MYSQL_BIND));
+    lengths = ns_calloc(numcols, sizeof(unsigned long));
+    nulls = ns_calloc(numcols, sizeof(my_bool));
+    for (i = 0; i < numcols; i++) {
+        binds[i].buffer_type = MYSQL_TYPE_LONG_BLOB;
+        binds[i].length = &lengths[i];
+        binds[i].is_null = &nulls[i];
+    }
+    rc = mysql_stmt_bind_result(stmt, binds) != 0 ? 1 : mysql_stmt_fetch(stmt);
+    QueryDone(handle, &start, sql, rc == 1, rc == MYSQL_NO_DATA ? 0 : 1);
+    if (rc == 1) {
+        StmtLog(handle, stmt);
+        Tcl_AppendResult(interp, "mysql_stmt_fetch failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+    } else if (rc != MYSQL_NO_DATA && !nulls[col]) {
+        total = lengths[col];
+        ATOMIC_ADD(&stats->rows, 1);
+        ATOMIC_ADD(&stats->bytes, total);
+        ctx->bytes_received += total;
+
+        if (chan == NULL && !(conn->flags & NS_CONN_SENTHDRS)) {
+            Ns_ConnSetRequiredHeaders(conn, type, (int) total);
+            Ns_ConnFlushHeaders(conn, 200);
+        }
+
+        buf = ns_malloc(BLOB_CHUNK);
+        memset(&bind, 0, sizeof(bind));
+        bind.buffer_type = MYSQL_TYPE_LONG_BLOB;
+        bind.buffer = buf;
+        bind.buffer_length = BLOB_CHUNK;
+        bind.length = &len;
+        for (bytes = 0, off = 0; off < total; off += len) {
+            if (mysql_stmt_fetch_column(stmt, &bind, (unsigned int) col,
+                                        off) != 0) {
+                StmtLog(handle, stmt);
+                Tcl_AppendResult(interp, "mysql_stmt_fetch_column failed: ",
+                    Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+                rc = 1;
+                break;
+            }
+            len = total - off < BLOB_CHUNK ? total - off : BLOB_CHUNK;
+            if (chan != NULL ? Tcl_Write(chan, buf, (int) len) != (int) len
+                : Ns_ConnWrite(conn, buf, (int) len) != (int) len) {
+                Tcl_AppendResult(interp, "blob_get: write failed", NULL);
+                rc = 1;
+                break;
+            }
+            bytes += len;
+        }
+    }
+
+    /* Reads and discards any further rows. */
+    mysql_stmt_free_result(stmt);
+    mysql_stmt_close(stmt);
+    UsePrimary(handle, NS_TRUE);
+    ns_free(buf);
+    ns_free(binds);
+    ns_free(lengths);
+    ns_free(nulls);
+
+    if (rc == 1) {
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewWideIntObj(bytes));
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_BlobPut - Run a statement with the contents of a Tcl channel
+ * as the value of its placeholder param, and objv as the values of the
+ * others.  The channel is read and sent with mysql_stmt_send_long_data()
+ * BLOB_CHUNK bytes at a time, so the value is never held whole on this
+ * side; the server still limits it to its max_allowed_packet.
+ */
+
+static int
+Ns_MySQL_BlobPut(Tcl_Interp *interp, char *sql, Tcl_Channel chan, int param,
+                 int objc, Tcl_Obj *CONST objv[], Ns_DbHandle *handle)
+{
+    MYSQL_STMT     *stmt;
+    Ns_Time         start;
+    Tcl_Obj        *resultObj;
+    Tcl_WideInt     rows, bytes = 0;
+    char           *buf;
+    int             n, rc;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_BlobPut(%s) called.", handle->datasource);
+
+    FreeResult(handle);
+
+    Ns_GetTime(&start);
+    stmt = BlobStmt(interp, handle, sql, objc, objv, param);
+    if (stmt == NULL) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        return TCL_ERROR;
+    }
+
+    buf = ns_malloc(BLOB_CHUNK);
+    while ((n = Tcl_Read(chan, buf, BLOB_CHUNK)) > 0) {
+        if (mysql_stmt_send_long_data(stmt, (unsigned int) param, buf,
+                                      (unsigned long) n) != 0) {
+            break;
+        }
+        bytes += n;
+    }
+    ns_free(buf);
+    if (n < 0) {
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        mysql_stmt_close(stmt);
+        Tcl_AppendResult(interp, "blob_put: error reading \"",
+            Tcl_GetChannelName(chan), "\": ", Tcl_PosixError(interp), NULL);
+        return TCL_ERROR;
+    }
+
+    rc = n > 0 ? 1 : mysql_stmt_execute(stmt);
+    CacheInvalidate(handle, sql);
+    if (rc != 0) {
+        StmtLog(handle, stmt);
+        QueryDone(handle, &start, sql, NS_TRUE, 0);
+        mysql_stmt_close(stmt);
+        Tcl_AppendResult(interp, n > 0 ? "mysql_stmt_send_long_data failed: "
+            : "mysql_stmt_execute failed: ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    rows = (Tcl_WideInt) mysql_stmt_affected_rows(stmt);
+    QueryDone(handle, &start, sql, NS_FALSE, rows);
+    mysql_stmt_close(stmt);
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("rows", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(rows));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj("bytes", -1));
+    Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewWideIntObj(bytes));
+    Tcl_SetObjResult(interp, resultObj);
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_Enqueue - Hand a statement to the pool's writer thread, which
+ * is started by the first one, and return at once.  A full queue is
+ * dealt with as "writeoverflow" says: the new statement is dropped, or
+ * the oldest one is, or the caller waits for room.  Returns whether the
+ * statement was queued.
+ */
+
+static int
+Ns_MySQL_Enqueue(Tcl_Interp *interp, MySQLPool *pool, char *sql)
+{
+    WriteQueue     *q = &pool->queue;
+    WriteItem      *item, *old;
+    size_t          len = strlen(sql);
+    int             queued = NS_TRUE;
+
+    item = ns_malloc(sizeof(WriteItem) + len);
+    item->next = NULL;
+    memcpy(item->sql, sql, len + 1);
+
+    Ns_MutexLock(&q->lock);
+    if (!q->running && !q->stopping) {
+        q->running = NS_TRUE;
+        Ns_ThreadCreate(WriterThread, pool, 0, &q->thread);
+        Ns_RegisterAtShutdown(WriterStop, pool);
+    }
+    while (q->overflow == OVERFLOW_BLOCK && q->depth >= q->max_depth
+           && !q->stopping) {
+        Ns_CondWait(&q->cond, &q->lock);
+    }
+    if (q->stopping
+        || (q->overflow == OVERFLOW_DROP && q->depth >= q->max_depth)) {
+        queued = NS_FALSE;
+        q->dropped++;
+    } else {
+        if (q->depth >= q->max_depth) {
+            old = q->head;
+            q->head = old->next;
+            q->depth--;
+            q->dropped++;
+            ns_free(old);
+        }
+        if (q->head == NULL) {
+            q->head = item;
+        } else {
+            q->tail->next = item;
+        }
+        q->tail = item;
+        q->enqueued++;
+        if (++q->depth > q->peak) {
+            q->peak = q->depth;
+        }
+
+        /* Wake the writer when there is work, and early for a full batch. */
+        if (q->depth == 1 || q->depth == q->max_batch) {
+            Ns_CondBroadcast(&q->cond);
+        }
+    }
+    Ns_MutexUnlock(&q->lock);
+
+    if (!queued) {
+        ns_free(item);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(queued));
+
+    return TCL_OK;
+}
+
+/*
+ * WriterThread - Run a pool's queued statements.  Once there is work,
+ * the statements of one "writeinterval" (or "writebatch" of them, if
+ * that comes first) are gathered and run in one transaction.  At
+ * shutdown, whatever is still queued is run before the thread exits,
+ * unless that takes longer than "writestoptimeout".
+ */
+
+static void
+WriterThread(void *arg)
+{
+    MySQLPool      *pool = (MySQLPool *) arg;
+    WriteQueue     *q = &pool->queue;
+    Ns_DbHandle    *handle = &q->handle;
+    WriteItem      *items, *item;
+    Ns_Time         deadline;
+    int             n;
+
+    mysql_thread_init();
+    PoolHandle(pool, handle);
+
+    Ns_MutexLock(&q->lock);
+    for (;;) {
+        while (q->head == NULL && !q->stopping) {
+            Ns_CondWait(&q->cond, &q->lock);
+        }
+        if (q->head == NULL) {
+            break;
+        }
+        if (WriterLate(q)) {
+            Ns_Log(Warning, "WriterStop(%s): out of time, dropping %d "
+                "queued statements.", pool->name, q->depth);
+            while ((item = q->head) != NULL) {
+                q->head = item->next;
+                ns_free(item);
+            }
+            q->tail = NULL;
+            q->dropped += q->depth;
+            q->depth = 0;
+            break;
+        }
+
+        Ns_GetTime(&deadline);
+        Ns_IncrTime(&deadline, q->interval / 1000,
+                    (q->interval % 1000) * 1000);
+        while (!q->stopping && q->depth < q->max_batch
+               && Ns_CondTimedWait(&q->cond, &q->lock, &deadline)
+                  != NS_TIMEOUT) {
+            ;
+        }
+
+        items = q->head;
+        for (n = 1, item = items; n < q->max_batch && item->next != NULL;
+             n++) {
+            item = item->next;
+        }
+        q->head = item->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        item->next = NULL;
+        q->depth -= n;
+
+        /* Room for callers waiting to enqueue. */
+        Ns_CondBroadcast(&q->cond);
+        Ns_MutexUnlock(&q->lock);
+
+        WriterFlush(pool, items, n);
+
+        Ns_MutexLock(&q->lock);
+    }
+    Ns_MutexUnlock(&q->lock);
+
+    if (handle->connection != NULL) {
+        mysql_close((MYSQL *) handle->connection);
+        handle->connection = NULL;
+    }
+    Ns_DStringFree(&handle->dsExceptionMsg);
+    mysql_thread_end();
+
+    Ns_MutexLock(&q->lock);
+    q->exited = NS_TRUE;
+    Ns_CondBroadcast(&q->cond);
+    Ns_MutexUnlock(&q->lock);
+}
+
+/*
+ * WriterStop - Shutdown callback that lets a pool's writer thread run
+ * what is left in the queue and waits for it to exit, for at most
+ * "writestoptimeout" seconds and one more for a statement still
+ * running then.  A writer that is stuck even so is left behind.
+ */
+
+static void
+WriterStop(void *arg)
+{
+    MySQLPool      *pool = (MySQLPool *) arg;
+    WriteQueue     *q = &pool->queue;
+    Ns_Time         deadline;
+    int             depth, exited;
+
+    Ns_MutexLock(&q->lock);
+    Ns_GetTime(&q->deadline);
+    Ns_IncrTime(&q->deadline, q->stop_timeout, 0);
+    q->stopping = NS_TRUE;
+    depth = q->depth;
+    Ns_CondBroadcast(&q->cond);
+    Ns_MutexUnlock(&q->lock);
+
+    Ns_Log(Notice, "WriterStop(%s): writing %d queued statements.",
+        pool->name, depth);
+
+    Ns_MutexLock(&q->lock);
+    deadline = q->deadline;
+    Ns_IncrTime(&deadline, 1, 0);
+    while (!q->exited
+           && Ns_CondTimedWait(&q->cond, &q->lock, &deadline)
+              != NS_TIMEOUT) {
+        ;
+    }
+    exited = q->exited;
+    Ns_MutexUnlock(&q->lock);
+
+    if (exited) {
+        Ns_ThreadJoin(&q->thread, NULL);
+    } else {
+        Ns_Log(Warning, "WriterStop(%s): writer still busy after %d "
+            "seconds, not waiting for it.", pool->name, q->stop_timeout);
+    }
+}
+
+/*
+ * WriterLate - Whether the server is stopping and the time to write
+ * what is queued has run out.  Called with the queue's lock held.
+ */
+
+static int
+WriterLate(WriteQueue *q)
+{
+    Ns_Time         now, diff;
+
+    if (!q->stopping) {
+        return NS_FALSE;
+    }
+    Ns_GetTime(&now);
+
+    return Ns_DiffTime(&now, &q->deadline, &diff) >= 0;
+}
+
+/*
+ * InsertSplit - If sql is an INSERT whose VALUES are nothing but rows,
+ * as in "INSERT INTO t (a, b) VALUES (1, 2), (3, 4)", return the length
+ * of its head, up to the first row, and set *rowsPtr and *lenPtr to
+ * the rows without any trailing semicolon.  Otherwise return 0.
+ */
+
+static int
+InsertSplit(char *sql, char **rowsPtr, int *lenPtr)
+{
+    char           *p, *rows, *end;
+    char            quote;
+    int             depth;
+
+    if (strncasecmp(sql, "insert", 6) != 0 || !isspace(UCHAR(sql[6]))) {
+        return 0;
+    }
+
+    /* Table and columns, with no literals or comments, then VALUES. */
+    for (p = sql + 6; *p != '\0'; p++) {
+        if (*p == '`') {
+            p = strchr(p + 1, '`');
+            if (p == NULL) {
+                return 0;
+            }
+        } else if (*p == '\'' || *p == '"' || *p == '#'
+                   || (*p == '-' && p[1] == '-')
+                   || (*p == '/' && p[1] == '*')) {
+            return 0;
+        } else if (strncasecmp(p, "values", 6) == 0
+                   && !isalnum(UCHAR(p[-1])) && p[-1] != '_'
+                   && !isalnum(UCHAR(p[6])) && p[6] != '_') {
+            break;
+        }
+    }
+    if (*p == '\0') {
+        return 0;
+    }
+    for (p += 6; isspace(UCHAR(*p)); p++)
+        ;
+    rows = p;
+
+    for (;;) {
+        if (*p != '(') {
+            return 0;
+        }
+        for (depth = 0; *p != '\0'; p++) {
+            if (*p == '\'' || *p == '"' || *p == '`') {
+                quote = *p;
+                for (p++; *p != '\0' && *p != quote; p++) {
+                    if (*p == '\\' && p[1] != '\0') {
+                        p++;
+                    }
+                }
+                if (*p == '\0') {
+                    return 0;
+                }
+            } else if (*p == '#' || (*p == '-' && p[1] == '-')
+                       || (*p == '/' && p[1] == '*')) {
+                return 0;
+            } else if (*p == '(') {
+                depth++;
+            } else if (*p == ')' && --depth == 0) {
+                break;
+            }
+        }
+        if (*p == '\0') {
+            return 0;
+        }
+        end = ++p;
+        while (isspace(UCHAR(*p))) {
+            p++;
+        }
+        if (*p != ',') {
+            break;
+        }
+        for (p++; isspace(UCHAR(*p)); p++)
+            ;
+    }
+    while (*p == ';' || isspace(UCHAR(*p))) {
+        p++;
+    }
+    if (*p != '\0') {
+        return 0;
+    }
+
+    *rowsPtr = rows;
+    *lenPtr = (int) (end - rows);
+
+    return (int) (rows - sql);
+}
+
+/*
+ * WriterConnect - Make sure the writer's connection is up, opening a
+ * new one if it is not.
+ */
+
+static int
+WriterConnect(MySQLPool *pool)
+{
+    WriteQueue     *q = &pool->queue;
+    Ns_DbHandle    *handle = &q->handle;
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+
+    if (mysql != NULL) {
+        if (mysql_ping(mysql) == 0) {
+            return NS_OK;
+        }
+        Log(handle, mysql);
+        mysql_close(mysql);
+        handle->connection = NULL;
+    }
+    if (pool->primary == NULL) {
+        return NS_ERROR;
+    }
+
+    mysql = Connect(handle, pool, pool->primary, ClientFlags(pool));
+    if (mysql == NULL) {
+        return NS_ERROR;
+    }
+    handle->connection = (void *) mysql;
+    q->max_packet = ServerMaxPacket(mysql);
+
+    return NS_OK;
+}
+
+/*
+ * WriterRun - Run one statement of a flush.  Returns 1 if it ran, 0 if
+ * it failed, or -1 if the transaction went with it: a deadlock rolls
+ * it back, and so does a lost connection.
+ */
+
+static int
+WriterRun(Ns_DbHandle *handle, char *sql)
+{
+    MYSQL          *mysql = (MYSQL *) handle->connection;
+    MYSQL_RES      *result;
+    unsigned int    nErr;
+    int             status;
+
+    if (mysql_query(mysql, sql) == 0) {
+        do {
+            result = mysql_use_result(mysql);
+            if (result != NULL) {
+                mysql_free_result(result);
+            }
+        } while ((status = mysql_next_result(mysql)) == 0);
+        if (status < 0) {
+            return 1;
+        }
+    }
+    Log(handle, mysql);
+    nErr = mysql_errno(mysql);
+
+    /* 1213 is ER_LOCK_DEADLOCK, the client library's errors are 2000 up. */
+    return (nErr == 1213 || nErr >= 2000) ? -1 : 0;
+}
+
+/*
+ * WriterBatch - Run a batch of queued statements on the writer's
+ * connection, in one transaction when there are several.  Consecutive
+ * INSERTs that differ only in their rows are sent as one multi-row
+ * INSERT of up to max_allowed_packet bytes; if that fails, its
+ * statements are run one by one so that a bad row costs only itself.
+ * A failed statement is logged and skipped.  Returns 1 once the batch
+ * is committed, -1 if a deadlock rolled it back and it can be run
+ * again, or 0 if it is lost.
+ */
+
+static int
+WriterBatch(MySQLPool *pool, WriteItem *items, int n, int *writtenPtr,
+            int *failedPtr, int *sentPtr)
+{
+    WriteQueue     *q = &pool->queue;
+    Ns_DbHandle    *handle = &q->handle;
+    Ns_DString      ds;
+    WriteItem      *item, *next, *g;
+    char           *rows, *r;
+    unsigned int    nErr;
+    int             head, len, h, l, rc, ngroup;
+    int             written = 0, failed = 0, lost = 0;
+
+    if (WriterConnect(pool) != NS_OK) {
+        return 0;
+    }
+    Ns_DStringInit(&ds);
+
+    if (n > 1) {
+        lost = WriterRun(handle, "START TRANSACTION") != 1;
+    }
+
+    for (item = items; item != NULL && !lost; item = next) {
+        next = item->next;
+        ngroup = 1;
+        head = InsertSplit(item->sql, &rows, &len);
+        if (head > 0) {
+            Ns_DStringSetLength(&ds, 0);
+            Ns_DStringNAppend(&ds, item->sql, head + len);
+            while (next != NULL
+                   && (h = InsertSplit(next->sql, &r, &l)) == head
+                   && strncmp(next->sql, item->sql, (size_t) head) == 0
+                   && (unsigned long) (Ns_DStringLength(&ds) + l + 1)
+                      < q->max_packet) {
+                Ns_DStringNAppend(&ds, ",", 1);
+                Ns_DStringNAppend(&ds, r, l);
+                next = next->next;
+                ngroup++;
+            }
+        }
+
+        (*sentPtr)++;
+        rc = WriterRun(handle, ngroup > 1 ? Ns_DStringValue(&ds) : item->sql);
+        if (rc == 1) {
+            written += ngroup;
+        } else if (rc == 0 && ngroup > 1) {
+            for (g = item; g != next && rc >= 0; g = g->next) {
+                (*sentPtr)++;
+                rc = WriterRun(handle, g->sql);
+                if (rc == 1) {
+                    written++;
+                } else if (rc == 0) {
+                    failed++;
+                    Ns_Log(Warning, "write-behind on pool %s dropped: %s",
+                        pool->name, g->sql);
+                }
+            }
+        } else if (rc == 0) {
+            failed++;
+            Ns_Log(Warning, "write-behind on pool %s dropped: %s",
+                pool->name, item->sql);
+        }
+        lost = rc < 0;
+    }
+
+    if (!lost && n > 1) {
+        lost = WriterRun(handle, "COMMIT") != 1;
+    }
+    Ns_DStringFree(&ds);
+    if (!lost) {
+        *writtenPtr = written;
+        *failedPtr = failed;
+        return 1;
+    }
+
+    nErr = mysql_errno((MYSQL *) handle->connection);
+    if (n > 1 && nErr < 2000) {
+        mysql_query((MYSQL *) handle->connection, "ROLLBACK");
+    }
+
+    return nErr == 1213 ? -1 : 0;
+}
+
+/*
+ * WriterFlush - Run a batch of queued statements and account for it.
+ * A batch a deadlock rolled back is run again, up to three times; one
+ * whose transaction is lost otherwise fails as a whole.  Every table
+ * the batch names is invalidated in the query cache, since a lost
+ * COMMIT may have gone through.
+ */
+
+static void
+WriterFlush(MySQLPool *pool, WriteItem *items, int n)
+{
+    WriteQueue     *q = &pool->queue;
+    Ns_DbHandle    *handle = &q->handle;
+    Ns_Time         start;
+    WriteItem      *item;
+    int             rc, tries, late;
+    int             written = 0, failed = 0, sent = 0;
+
+    Ns_GetTime(&start);
+
+    for (tries = 1; ; tries++) {
+        rc = WriterBatch(pool, items, n, &written, &failed, &sent);
+        Ns_MutexLock(&q->lock);
+        late = WriterLate(q);
+        if (rc < 0 && tries < 3 && !late) {
+            q->retried++;
+        }
+        Ns_MutexUnlock(&q->lock);
+        if (rc >= 0 || tries == 3 || late) {
+            break;
+        }
+        Ns_Log(Notice, "write-behind on pool %s: deadlock, running %d "
+            "statements again.", pool->name, n);
+    }
+
+    if (rc != 1) {
+        Ns_Log(Error, "write-behind on pool %s: %d statements lost%s%s.",
+            pool->name, n, handle->connection == NULL ? ", no connection"
+            : ": ", handle->connection == NULL ? ""
+            : Ns_DStringValue(&handle->dsExceptionMsg));
+        written = 0;
+        failed = n;
+    }
+
+    while ((item = items) != NULL) {
+        items = item->next;
+        CacheInvalidate(NULL, item->sql);
+        ns_free(item);
+    }
+
+    Ns_MutexLock(&q->lock);
+    q->written += written;
+    q->failed += failed;
+    q->sent += sent;
+    q->flushes++;
+    HistAdd(&q->flush, &start);
+    Ns_MutexUnlock(&q->lock);
+}
+
+static int
+Ns_MySQL_Send(Tcl_Interp *interp, char *sql, Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+
+    assert(handle != NULL);
+    assert(handle->connection != NULL);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Send(%s) called.", handle->datasource);
+
+    FreeResult(handle);
+    if (IsWrite(sql) || IsDDL(sql)) {
+        ctx->async_sql = ns_strdup(sql);
+    }
+
+    ctx->async_state = AsyncStart((MYSQL *) handle->connection, sql,
+                                  strlen(sql), &ctx->async_wait);
+    ctx->async = NS_TRUE;
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_Wait - Wait for queries started with [ns_mysql send] on one
+ * or more handles.  Returns a list of handle/status pairs, status being
+ * what [ns_db exec] would have returned, for each handle whose query
+ * has completed; handles still running when the timeout expires are
+ * left out and can be waited for again.
+ */
+
+static int
+Ns_MySQL_Wait(Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    static CONST char *opts[] = { "-any", "-timeout", NULL };
+    Ns_DbHandle   **handles;
+    MySQLContext   *ctx;
+    MYSQL         **conns;
+    Ns_Time         timeout, *timeoutPtr = NULL;
+    Tcl_Obj        *resultObj;
+    char           *id;
+    int            *waits, *states;
+    int             i, n, ms, opt, any = 0, status, rc = TCL_ERROR;
+
+    for (i = 2; i < objc && Tcl_GetString(objv[i])[0] == '-'; i++) {
+        if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0, &opt)
+            != TCL_OK) {
+            return TCL_ERROR;
+        }
+        if (opt == 0) {
+            any = 1;
+            continue;
+        }
+        if (++i == objc) {
+            Tcl_AppendResult(interp, "missing value for ",
+                Tcl_GetString(objv[i - 1]), NULL);
+            return TCL_ERROR;
+        }
+        if (Tcl_GetIntFromObj(interp, objv[i], &ms) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        timeout.sec = ms / 1000;
+        timeout.usec = (ms % 1000) * 1000;
+        timeoutPtr = &timeout;
+    }
+    if (i == objc) {
+        Tcl_WrongNumArgs(interp, 2, objv,
+            "?-timeout ms? ?-any? handle ?handle ...?");
+        return TCL_ERROR;
+    }
+
+    n = objc - i;
+    objv += i;
+    handles = ns_malloc(n * sizeof(Ns_DbHandle *));
+    conns = ns_malloc(n * sizeof(MYSQL *));
+    waits = ns_malloc(n * sizeof(int));
+    states = ns_malloc(n * sizeof(int));
+
+    for (i = 0; i < n; i++) {
+        id = Tcl_GetString(objv[i]);
+        if (Ns_TclDbGetHandle(interp, id, &handles[i]) != TCL_OK) {
+            goto done;
+        }
+        if (Ns_DbDriverName(handles[i]) != mysql_driver_name) {
+            Tcl_AppendResult(interp, "handle \"", id,
+                "\" is not of type \"", mysql_driver_name, "\"", NULL);
+            goto done;
+        }
+        ctx = (MySQLContext *) handles[i]->context;
+        if (ctx == NULL || !ctx->async) {
+            Tcl_AppendResult(interp, "no query sent on handle \"", id,
+                "\"", NULL);
+            goto done;
+        }
+        conns[i] = (MYSQL *) handles[i]->connection;
+        waits[i] = ctx->async_wait;
+        states[i] = ctx->async_state;
+    }
+
+    AsyncWait(conns, waits, states, n, timeoutPtr, any);
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (i = 0; i < n; i++) {
+        ctx = (MySQLContext *) handles[i]->context;
+        ctx->async_wait = waits[i];
+        ctx->async_state = states[i];
+        if (states[i] == ASYNC_PENDING) {
+            continue;
+        }
+        status = AsyncCollect(handles[i]);
+        Tcl_ListObjAppendElement(NULL, resultObj, objv[i]);
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewStringObj(
+            status == NS_ROWS ? "NS_ROWS" :
+            status == NS_DML ? "NS_DML" : "NS_ERROR", -1));
+    }
+    Tcl_SetObjResult(interp, resultObj);
+    rc = TCL_OK;
+
+done:
+    ns_free(handles);
+    ns_free(conns);
+    ns_free(waits);
+    ns_free(states);
+
+    return rc;
+}
+
+/*
+ * Ns_MySQL_Scatter - Run a statement on every shard of the handle's
+ * pool at once and merge the rows, in shard order, into one list as
+ * [ns_mysql fetch_all] would return it.  A statement that returns no
+ * rows anywhere yields the total of affected rows.  The handle's
+ * timeout applies to the slowest shard; statements still running then
+ * are killed.
+ */
+
+static int
+Ns_MySQL_Scatter(Tcl_Interp *interp, char *sql, int format,
+                 Ns_DbHandle *handle)
+{
+    MySQLContext   *ctx = (MySQLContext *) handle->context;
+    MySQLPool      *pool = ctx->pool;
+    MYSQL         **conns;
+    MYSQL_RES      *result;
+    MYSQL_FIELD    *fields;
+    MYSQL_ROW       row;
+    unsigned long  *lengths;
+    Tcl_Obj        *resultObj, *rowObj, *valueObj;
+    Tcl_Obj       **keyObjs = NULL, **colObjs = NULL;
+    Ns_Time         start, timeout, *timeoutPtr = NULL;
+    Tcl_WideInt     affected = 0;
+    unsigned int    numcols = 0, i;
+    int            *waits, *states, *lost, *kinds = NULL;
+    int             n, failed = -1, late = -1, rows = 0, results = 0;
+    char            buf[TCL_INTEGER_SPACE];
+
+    if (pool->nshards == 0) {
+        Tcl_AppendResult(interp, "pool \"", pool->name,
+            "\" has no shards", NULL);
+        return TCL_ERROR;
+    }
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Scatter(%s) called.", handle->datasource);
+
+    FreeResult(handle);
+    for (n = 0; n < pool->nshards; n++) {
+        if (ctx->shards[n] == NULL) {
+            ctx->shards[n] = Connect(handle, pool, pool->shards[n],
+                                     ClientFlags(pool));
+            if (ctx->shards[n] == NULL) {
+                Tcl_AppendResult(interp, "scatter: cannot connect to shard ",
+                    pool->shards[n], ": ",
+                    Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+                return TCL_ERROR;
+            }
+        }
+    }
+
+    n = pool->nshards;
+    conns = ns_malloc(n * sizeof(MYSQL *));
+    waits = ns_malloc(n * sizeof(int));
+    states = ns_malloc(n * sizeof(int));
+    lost = ns_calloc(n, sizeof(int));
+    memcpy(conns, ctx->shards, n * sizeof(MYSQL *));
+
+    Ns_GetTime(&start);
+    for (i = 0; i < (unsigned int) n; i++) {
+        states[i] = AsyncStart(conns[i], sql, (unsigned long) strlen(sql),
+                               &waits[i]);
+    }
+    if (ctx->timeout > 0) {
+        timeout.sec = ctx->timeout / 1000;
+        timeout.usec = (ctx->timeout % 1000) * 1000;
+        timeoutPtr = &timeout;
+    }
+    if (AsyncWait(conns, waits, states, n, timeoutPtr, 0) < n) {
+        for (i = 0; i < (unsigned int) n; i++) {
+            if (states[i] == ASYNC_PENDING) {
+                Ns_Log(Warning, "Ns_MySQL_Scatter(%s): no response from %s "
+                    "in %d ms, killing query.", handle->datasource,
+                    pool->shards[i], ctx->timeout);
+                ATOMIC_ADD(&pool->stats.timeouts, 1);
+                if (late < 0) {
+                    late = (int) i;
+                }
+                lost[i] = AsyncKill(handle, pool->shards[i], conns[i],
+                                    mysql_thread_id(conns[i]), &waits[i],
+                                    &states[i]) != NS_OK;
+            }
+        }
+    }
+    CacheInvalidate(NULL, sql);
+
+    /*
+     * Every shard's response is read, even after one has failed, so
+     * that all connections are left in sync.
+     */
+
+    resultObj = Tcl_NewListObj(0, NULL);
+    for (n = 0; n < pool->nshards; n++) {
+        if (states[n] == ASYNC_FAILED) {
+            if (failed < 0) {
+                Log(handle, conns[n]);
+                failed = n;
+            }
+            continue;
+        }
+        result = mysql_store_result(conns[n]);
+        if (result == NULL) {
+            if (mysql_field_count(conns[n]) > 0 && failed < 0) {
+                Log(handle, conns[n]);
+                failed = n;
+            } else {
+                affected += (Tcl_WideInt) mysql_affected_rows(conns[n]);
+            }
+        } else {
+            if (results++ == 0) {
+                numcols = mysql_num_fields(result);
+                fields = mysql_fetch_fields(result);
+                keyObjs = ns_malloc(numcols * sizeof(Tcl_Obj *));
+                kinds = ns_malloc(numcols * sizeof(int));
+                for (i = 0; i < numcols; i++) {
+                    keyObjs[i] = Tcl_NewStringObj(fields[i].name, -1);
+                    Tcl_IncrRefCount(keyObjs[i]);
+                    kinds[i] = ColumnKind(&fields[i]);
+                }
+                if (format == FORMAT_COLUMNS) {
+                    colObjs = ns_malloc(numcols * sizeof(Tcl_Obj *));
+                    for (i = 0; i < numcols; i++) {
+                        colObjs[i] = Tcl_NewListObj(0, NULL);
+                    }
+                }
+            }
+            if (mysql_num_fields(result) != numcols && failed < 0) {
+                Ns_DStringFree(&handle->dsExceptionMsg);
+                Ns_DStringAppend(&handle->dsExceptionMsg,
+                    "shards returned different columns");
+                failed = n;
+            }
+            while (failed < 0 && (row = mysql_fetch_row(result)) != NULL) {
+                lengths = mysql_fetch_lengths(result);
+                rows++;
+                rowObj = (format == FORMAT_COLUMNS) ? NULL
+                    : Tcl_NewListObj(0, NULL);
+                for (i = 0; i < numcols; i++) {
+                    valueObj = NewValueObj(kinds[i], row[i], lengths[i]);
+                    switch (format) {
+                    case FORMAT_DICTS:
+                        Tcl_ListObjAppendElement(NULL, rowObj, keyObjs[i]);
+                        /* FALLTHROUGH */
+                    case FORMAT_LISTS:
+                        Tcl_ListObjAppendElement(NULL, rowObj, valueObj);
+                        break;
+                    case FORMAT_COLUMNS:
+                        Tcl_ListObjAppendElement(NULL, colObjs[i], valueObj);
+                        break;
+                    }
+                }
+                if (rowObj != NULL) {
+                    Tcl_ListObjAppendElement(NULL, resultObj, rowObj);
+                }
+            }
+            mysql_free_result(result);
+        }
+        while (mysql_more_results(conns[n])
+               && mysql_next_result(conns[n]) == 0) {
+            result = mysql_use_result(conns[n]);
+            if (result != NULL) {
+                mysql_free_result(result);
+            }
+        }
+    }
+    if (late >= 0) {
+        sprintf(buf, "%d", ctx->timeout);
+        Ns_DStringFree(&handle->dsExceptionMsg);
+        Ns_DStringVarAppend(&handle->dsExceptionMsg, "no response in ",
+            buf, " ms", NULL);
+        failed = late;
+    }
+    QueryDone(handle, &start, sql, failed >= 0,
+              results > 0 ? (Tcl_WideInt) rows : affected);
+
+    /*
+     * A shard whose query could not be killed had its connection shut
+     * down.  It is replaced now if the handle is pinned to it, else
+     * when it is next used.
+     */
+
+    for (n = 0; n < pool->nshards; n++) {
+        if (!lost[n]) {
+            continue;
+        }
+        Log(NULL, ctx->shards[n]);
+        if (n == ctx->shard) {
+            Reopen(handle);
+        } else {
+            mysql_close(ctx->shards[n]);
+            ctx->shards[n] = NULL;
+        }
+    }
+
+    if (results > 0) {
+        if (format == FORMAT_COLUMNS) {
+            for (i = 0; i < numcols; i++) {
+                Tcl_ListObjAppendElement(NULL, resultObj, keyObjs[i]);
+                Tcl_ListObjAppendElement(NULL, resultObj, colObjs[i]);
+            }
+            ns_free(colObjs);
+        }
+        for (i = 0; i < numcols; i++) {
+            Tcl_DecrRefCount(keyObjs[i]);
+        }
+        ns_free(keyObjs);
+        ns_free(kinds);
+    }
+    ns_free(conns);
+    ns_free(waits);
+    ns_free(states);
+    ns_free(lost);
+
+    if (failed >= 0) {
+        Tcl_DecrRefCount(resultObj);
+        Tcl_AppendResult(interp, "scatter failed on shard ",
+            pool->shards[failed], ": ",
+            Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+        return TCL_ERROR;
+    }
+    if (results == 0) {
+        Tcl_DecrRefCount(resultObj);
+        resultObj = Tcl_NewWideIntObj(affected);
+    }
+    Tcl_SetObjResult(interp, resultObj);
+
+    if (handle->verbose)
+        Ns_Log(Notice, "Ns_MySQL_Scatter(%s): %d rows from %d shards.",
+            handle->datasource, rows, pool->nshards);
+
+    return TCL_OK;
+}
+
+/*
+ * Ns_MySQL_Cmd - This function implements the "ns_mysql" Tcl command
+ * installed into each interpreter of each virtual server.  It provides
+ * access to features specific to the MySQL driver.
+ */
+
+static int
+Ns_MySQL_Cmd(ClientData dummy, Tcl_Interp *interp, int objc,
+             Tcl_Obj *CONST objv[])
+{
+    static CONST char *subcmds[] = {
+        "batch", "blob_get", "blob_put", "bulk_insert", "cache_stats",
+        "cached_select", "colcache",
+        "columns", "compression", "copy_out", "enqueue", "exec", "execute",
+        "fetch_all", "include_tablenames", "list_dbs", "list_tables",
+        "maxbufferedbytes", "nulls", "prepare", "primary", "queue_stats",
+        "replicas",
+        "resultrows", "scatter", "select_db", "send", "shard", "stats",
+        "streaming", "timeout", "top", "version", "wait", NULL
+    };
+    enum {
+        CBatchIdx, CBlobGetIdx, CBlobPutIdx, CBulkInsertIdx, CCacheStatsIdx,
+        CCachedSelectIdx, CColcacheIdx,
+        CColumnsIdx, CCompressionIdx, CCopyOutIdx, CEnqueueIdx, CExecIdx,
+        CExecuteIdx, CFetchAllIdx, CIncludeTablenamesIdx, CListDbsIdx,
+        CListTablesIdx, CMaxBufferedBytesIdx, CNullsIdx, CPrepareIdx,
+        CPrimaryIdx, CQueueStatsIdx, CReplicasIdx,
+        CResultrowsIdx, CScatterIdx, CSelectDbIdx, CSendIdx, CShardIdx,
+        CStatsIdx, CStreamingIdx, CTimeoutIdx, CTopIdx, CVersionIdx, CWaitIdx
+    };
+    Ns_DbHandle    *handle;
+    MySQLContext   *ctx;
+    Tcl_Obj        *resultObj;
+    int             subcmd;
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "cmd handle ?args?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], subcmds, "command", 0, &subcmd)
+        != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    /* Subcommands that do not take a single handle. */
+    if (subcmd == CTopIdx) {
+        /* == [ns_mysql top ?-by time|calls|rows|errors? ?-n N? ?-reset?] == */
+        static CONST char *opts[] = { "-by", "-n", "-reset", NULL };
+        static CONST char *keys[] = {
+            "time", "calls", "rows", "errors", NULL
+        };
+        int             i, opt, by = TOP_TIME, n = 10, reset = 0;
+
+        for (i = 2; i < objc; i++) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                    &opt) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (opt == 2) {
+                reset = 1;
+            } else if (i + 1 == objc) {
+                Tcl_WrongNumArgs(interp, 2, objv,
+                    "?-by time|calls|rows|errors? ?-n N? ?-reset?");
+                return TCL_ERROR;
+            } else if (opt == 0) {
+                if (Tcl_GetIndexFromObj(interp, objv[++i], keys, "key", 0,
+                                        &by) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else if (Tcl_GetIntFromObj(interp, objv[++i], &n) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        }
+        return Ns_MySQL_Top(interp, by, n, reset);
+    }
+    if (objc < 3) {
+        Tcl_WrongNumArgs(interp, 1, objv, "cmd handle ?args?");
+        return TCL_ERROR;
+    }
+    if (subcmd == CWaitIdx) {
+        return Ns_MySQL_Wait(interp, objc, objv);
+    }
+    if (subcmd == CEnqueueIdx || subcmd == CQueueStatsIdx) {
+        MySQLPool      *pool;
+        WriteQueue     *q;
+
+        pool = FindPool(Tcl_GetString(objv[2]));
+        if (pool == NULL) {
+            Tcl_AppendResult(interp, "no ", mysql_driver_name,
+                " pool \"", Tcl_GetString(objv[2]), "\"", NULL);
+            return TCL_ERROR;
+        }
+        if (subcmd == CEnqueueIdx) {
+            /* == [ns_mysql enqueue $pool sql] == */
+            if (objc != 4) {
+                Tcl_WrongNumArgs(interp, 2, objv, "pool sql");
+                return TCL_ERROR;
+            }
+            return Ns_MySQL_Enqueue(interp, pool, Tcl_GetString(objv[3]));
+        }
+
+        /* == [ns_mysql queue_stats $pool ?-reset?] == */
+        if (objc > 4
+            || (objc == 4 && !STREQ(Tcl_GetString(objv[3]), "-reset"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "pool ?-reset?");
+            return TCL_ERROR;
+        }
+        q = &pool->queue;
+        resultObj = Tcl_NewListObj(0, NULL);
+        Ns_MutexLock(&q->lock);
+        AppendCount(resultObj, "depth", (unsigned long) q->depth);
+        AppendCount(resultObj, "peak", (unsigned long) q->peak);
+        AppendCount(resultObj, "enqueued", q->enqueued);
+        AppendCount(resultObj, "dropped", q->dropped);
+        AppendCount(resultObj, "written", q->written);
+        AppendCount(resultObj, "failed", q->failed);
+        AppendCount(resultObj, "statements", q->sent);
+        AppendCount(resultObj, "flushes", q->flushes);
+        AppendCount(resultObj, "retried", q->retried);
+        HistAppend(resultObj, "flush", &q->flush);
+        if (objc == 4) {
+            q->peak = q->depth;
+            q->enqueued = q->dropped = q->written = q->failed = 0;
+            q->sent = q->flushes = q->retried = 0;
+            memset(&q->flush, 0, sizeof(MySQLHist));
+        }
+        Ns_MutexUnlock(&q->lock);
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
+    }
+
+    if (Ns_TclDbGetHandle(interp, Tcl_GetString(objv[2]), &handle)
+        != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    /*
+     * Make sure this is a MySQL handle before accessing
+     * handle->connection.
+     */
+
+    if (Ns_DbDriverName(handle) != mysql_driver_name) {
+        Tcl_AppendResult(interp, "handle \"", Tcl_GetString(objv[2]),
+            "\" is not of type \"", mysql_driver_name, "\"", NULL);
+        return TCL_ERROR;
+    }
+
+    ctx = (MySQLContext *) handle->context;
+    switch (subcmd) {
+    case CBlobGetIdx:
+    case CBlobPutIdx:
+    case CBulkInsertIdx:
+    case CColcacheIdx:
+    case CCopyOutIdx:
+    case CCompressionIdx:
+    case CExecIdx:
+    case CMaxBufferedBytesIdx:
+    case CNullsIdx:
+    case CPrimaryIdx:
+    case CReplicasIdx:
+    case CScatterIdx:
+    case CShardIdx:
+    case CStatsIdx:
+    case CStreamingIdx:
+    case CTimeoutIdx:
+        if (ctx == NULL) {
+            Tcl_AppendResult(interp, "handle \"", Tcl_GetString(objv[2]),
+                "\" is not connected", NULL);
+            return TCL_ERROR;
+        }
+        break;
+    }
+
+    switch (subcmd) {
+    case CIncludeTablenamesIdx:
+        /* == [ns_mysql include_tablenames $db (on|off)] == */
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle boolean");
+            return TCL_ERROR;
+        }
+        return Tcl_GetBooleanFromObj(interp, objv[3], &include_tablenames);
+
+    case CBatchIdx:
+        /* == [ns_mysql batch $db {sql ...}] == */
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sqlList");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Batch(interp, objv[3], handle);
+
+    case CBlobGetIdx: {
+        /*
+         * == [ns_mysql blob_get $db sql column ?-bind values?
+         *        ?-type mime? ?-channel ch | -conn?] ==
+         */
+        static CONST char *opts[] = {
+            "-bind", "-type", "-channel", "-conn", NULL
+        };
+        Tcl_Obj       **valueObjs = NULL;
+        Tcl_Channel     chan = NULL;
+        Ns_Conn        *conn = NULL;
+        char           *type = "application/octet-stream";
+        int             nvalues = 0;
+        int             i, opt, mode;
+
+        if (objc < 5) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql column"
+                " ?-bind values? ?-type mime? ?-channel ch | -conn?");
+            return TCL_ERROR;
+        }
+        for (i = 5; i < objc; i++) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                    &opt) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (opt == 3) {
+                chan = NULL;
+                continue;
+            }
+            if (++i == objc) {
+                Tcl_AppendResult(interp, "missing value for ",
+                    Tcl_GetString(objv[i - 1]), NULL);
+                return TCL_ERROR;
+            }
+            if (opt == 0) {
+                if (Tcl_ListObjGetElements(interp, objv[i], &nvalues,
+                                           &valueObjs) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else if (opt == 1) {
+                type = Tcl_GetString(objv[i]);
+            } else {
+                chan = Tcl_GetChannel(interp, Tcl_GetString(objv[i]), &mode);
+                if (chan == NULL) {
+                    return TCL_ERROR;
+                }
+                if (!(mode & TCL_WRITABLE)) {
+                    Tcl_AppendResult(interp, "channel \"",
+                        Tcl_GetString(objv[i]), "\" wasn't opened for writing",
+                        NULL);
+                    return TCL_ERROR;
+                }
+            }
+        }
+        if (chan == NULL) {
+            conn = Ns_TclGetConn(interp);
+            if (conn == NULL) {
+                Tcl_AppendResult(interp, "no connection", NULL);
+                return TCL_ERROR;
+            }
+        }
+        return Ns_MySQL_BlobGet(interp, Tcl_GetString(objv[3]), objv[4],
+                                nvalues, valueObjs, chan, conn, type, handle);
+    }
+
+    case CBlobPutIdx: {
+        /*
+         * == [ns_mysql blob_put $db sql channel ?-bind values?
+         *        ?-param n?] ==
+         */
+        static CONST char *opts[] = { "-bind", "-param", NULL };
+        Tcl_Obj       **valueObjs = NULL;
+        Tcl_Channel     chan;
+        int             nvalues = 0, param = 0;
+        int             i, opt, mode;
+
+        if (objc < 5 || (objc - 5) % 2 != 0) {
+            Tcl_WrongNumArgs(interp, 2, objv,
+                "handle sql channel ?-bind values? ?-param n?");
+            return TCL_ERROR;
+        }
+        chan = Tcl_GetChannel(interp, Tcl_GetString(objv[4]), &mode);
+        if (chan == NULL) {
+            return TCL_ERROR;
+        }
+        if (!(mode & TCL_READABLE)) {
+            Tcl_AppendResult(interp, "channel \"", Tcl_GetString(objv[4]),
+                "\" wasn't opened for reading", NULL);
+            return TCL_ERROR;
+        }
+        for (i = 5; i < objc; i += 2) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                    &opt) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (opt == 0) {
+                if (Tcl_ListObjGetElements(interp, objv[i + 1], &nvalues,
+                                           &valueObjs) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else if (Tcl_GetIntFromObj(interp, objv[i + 1], &param)
+                       != TCL_OK) {
+                return TCL_ERROR;
+            } else if (param < 0) {
+                Tcl_AppendResult(interp, "-param must not be negative", NULL);
+                return TCL_ERROR;
+            }
+        }
+        return Ns_MySQL_BlobPut(interp, Tcl_GetString(objv[3]), chan, param,
+                                nvalues, valueObjs, handle);
+    }
+
+    case CBulkInsertIdx: {
+        /*
+         * == [ns_mysql bulk_insert $db table columns rows
+         *        ?-mode values|infile? ?-null string?] ==
+         */
+        static CONST char *opts[] = { "-mode", "-null", NULL };
+        static CONST char *modes[] = { "values", "infile", NULL };
+        char           *nullValue = NULL;
+        int             mode = 0;
+        int             i, opt;
+
+        if (objc < 6 || (objc - 6) % 2 != 0) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle table columns rows"
+                " ?-mode values|infile? ?-null string?");
+            return TCL_ERROR;
+        }
+        for (i = 6; i < objc; i += 2) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                    &opt) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (opt == 1) {
+                nullValue = Tcl_GetString(objv[i + 1]);
+            } else if (Tcl_GetIndexFromObj(interp, objv[i + 1], modes,
+                                           "mode", 0, &mode) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        }
+        return Ns_MySQL_BulkInsert(interp, Tcl_GetString(objv[3]), objv[4],
+                                   objv[5], mode == 1, nullValue, handle);
+    }
+
+    case CCachedSelectIdx: {
+        /*
+         * == [ns_mysql cached_select $db sql ?-ttl s?
+         *        ?-format lists|dicts|columns?] ==
+         */
+        static CONST char *opts[] = { "-ttl", "-format", NULL };
+        int             ttl = cacheTtl;
+        int             format = FORMAT_LISTS;
+        int             i, opt;
+
+        if (objc < 4 || (objc - 4) % 2 != 0) {
+            Tcl_WrongNumArgs(interp, 2, objv,
+                "handle sql ?-ttl s? ?-format lists|dicts|columns?");
+            return TCL_ERROR;
+        }
+        for (i = 4; i < objc; i += 2) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                    &opt) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (opt == 0) {
+                if (Tcl_GetIntFromObj(interp, objv[i + 1], &ttl) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else if (Tcl_GetIndexFromObj(interp, objv[i + 1], formats,
+                                           "format", 0, &format) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        }
+        return Ns_MySQL_CachedSelect(interp, Tcl_GetString(objv[3]), ttl,
+                                     format, handle);
+    }
+
+    case CCacheStatsIdx:
+        /* == [ns_mysql cache_stats $db ?-reset?] == */
+        if (objc > 4 || (objc == 4 && !STREQ(Tcl_GetString(objv[3]), "-reset"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?-reset?");
+            return TCL_ERROR;
+        }
+        resultObj = Tcl_NewListObj(0, NULL);
+        Ns_MutexLock(&cacheLock);
+        AppendCount(resultObj, "hits", cacheHits);
+        AppendCount(resultObj, "misses", cacheMisses);
+        AppendCount(resultObj, "evictions", cacheEvictions);
+        AppendCount(resultObj, "expirations", cacheExpirations);
+        AppendCount(resultObj, "invalidations", cacheInvalidations);
+        AppendCount(resultObj, "uncached", cacheUncached);
+        AppendCount(resultObj, "entries",
+                    (unsigned long) cacheEntries.numEntries);
+        AppendCount(resultObj, "bytes", (unsigned long) cacheSize);
+        if (objc == 4) {
+            cacheHits = cacheMisses = cacheEvictions = 0;
+            cacheExpirations = cacheInvalidations = cacheUncached = 0;
+        }
+        Ns_MutexUnlock(&cacheLock);
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
+
+    case CColcacheIdx:
+        /* == [ns_mysql colcache $db ?-reset?] == */
+        if (objc > 4 || (objc == 4 && !STREQ(Tcl_GetString(objv[3]), "-reset"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?-reset?");
+            return TCL_ERROR;
+        }
+        resultObj = Tcl_NewListObj(0, NULL);
+        AppendCount(resultObj, "hits", ctx->colcache_hits);
+        AppendCount(resultObj, "misses", ctx->colcache_misses);
+        AppendCount(resultObj, "templates", (unsigned long) ctx->ntemplates);
+        Tcl_ListObjAppendElement(NULL, resultObj,
+            Tcl_NewStringObj("hitrate", -1));
+        Tcl_ListObjAppendElement(NULL, resultObj, Tcl_NewDoubleObj(
+            ctx->colcache_hits + ctx->colcache_misses == 0
+            ? 0.0 : (double) ctx->colcache_hits
+                / (ctx->colcache_hits + ctx->colcache_misses)));
+        if (objc == 4) {
+            ctx->colcache_hits = ctx->colcache_misses = 0;
+        }
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
+
+    case CCompressionIdx:
+        /* == [ns_mysql compression $db] == */
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Compression(interp, handle);
+
+    case CCopyOutIdx: {
+        /*
+         * == [ns_mysql copy_out $db sql ?-format csv|tsv|json?
+         *        ?-channel ch | -conn?] ==
+         */
+        static CONST char *opts[] = { "-format", "-channel", "-conn", NULL };
+        Tcl_Channel     chan = NULL;
+        Ns_Conn        *conn = NULL;
+        int             format = COPY_CSV;
+        int             i, opt, mode;
+
+        if (objc < 4) {
+            Tcl_WrongNumArgs(interp, 2, objv,
+                "handle sql ?-format csv|tsv|json? ?-channel ch | -conn?");
+            return TCL_ERROR;
+        }
+        for (i = 4; i < objc; i++) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                    &opt) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (opt == 2) {
+                chan = NULL;
+                continue;
+            }
+            if (++i == objc) {
+                Tcl_AppendResult(interp, "missing value for ",
+                    Tcl_GetString(objv[i - 1]), NULL);
+                return TCL_ERROR;
+            }
+            if (opt == 0) {
+                if (Tcl_GetIndexFromObj(interp, objv[i], copyFormats,
+                                        "format", 0, &format) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+            } else {
+                chan = Tcl_GetChannel(interp, Tcl_GetString(objv[i]), &mode);
+                if (chan == NULL) {
+                    return TCL_ERROR;
+                }
+                if (!(mode & TCL_WRITABLE)) {
+                    Tcl_AppendResult(interp, "channel \"",
+                        Tcl_GetString(objv[i]), "\" wasn't opened for writing",
+                        NULL);
+                    return TCL_ERROR;
+                }
+            }
+        }
+        if (chan == NULL) {
+            conn = Ns_TclGetConn(interp);
+            if (conn == NULL) {
+                Tcl_AppendResult(interp, "no connection", NULL);
+                return TCL_ERROR;
+            }
+        }
+        return Ns_MySQL_CopyOut(interp, Tcl_GetString(objv[3]), format, chan,
+                                conn, handle);
+    }
+
+    case CFetchAllIdx: {
+        /*
+         * == [ns_mysql fetch_all $db ?-limit n?
+         *        ?-format lists|dicts|columns?] ==
+         */
+        static CONST char *opts[] = { "-limit", "-format", NULL };
+        long            limit = -1;
+        int             format = FORMAT_LISTS;
+        int             i, n, opt;
+
+        if ((objc - 3) % 2 != 0) {
+            Tcl_WrongNumArgs(interp, 2, objv,
+                "handle ?-limit n? ?-format lists|dicts|columns?");
+            return TCL_ERROR;
+        }
+        for (i = 3; i < objc; i += 2) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], opts, "option", 0,
+                                    &opt) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            if (opt == 0) {
+                if (Tcl_GetIntFromObj(interp, objv[i + 1], &n) != TCL_OK) {
+                    return TCL_ERROR;
+                }
+                limit = n < 0 ? -1 : n;
+            } else if (Tcl_GetIndexFromObj(interp, objv[i + 1], formats,
+                                           "format", 0, &format) != TCL_OK) {
+                return TCL_ERROR;
+            }
+        }
+        return Ns_MySQL_FetchAll(interp, handle, limit, format);
+    }
+
+    case CListDbsIdx:
+        /* == [ns_mysql list_dbs $db ?wild?] == */
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?wild?");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_List_Dbs(interp,
+            objc == 4 ? Tcl_GetString(objv[3]) : NULL, handle);
+
+    case CListTablesIdx:
+        /* == [ns_mysql list_tables $db ?wild?] == */
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?wild?");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_List_Tables(interp,
+            objc == 4 ? Tcl_GetString(objv[3]) : NULL, handle);
+
+    case CColumnsIdx:
+        /* == [ns_mysql columns $db table] == */
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle table");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Columns(interp, Tcl_GetString(objv[3]), handle);
+
+    case CResultrowsIdx:
+        /* == [ns_mysql resultrows $db] == */
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Resultrows(interp, handle);
+
+    case CSelectDbIdx:
+        /* == [ns_mysql select_db $db database] == */
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle database");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Select_Db(interp, Tcl_GetString(objv[3]), handle);
+
+    case CNullsIdx: {
+        /* == [ns_mysql nulls $db] == */
+        unsigned int    i;
+
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+        resultObj = Tcl_NewListObj(0, NULL);
+        for (i = 0; i < ctx->nulls_count
+                 && i < (unsigned int) Ns_SetSize(handle->row); i++) {
+            if (ctx->nulls[i]) {
+                Tcl_ListObjAppendElement(NULL, resultObj,
+                    Tcl_NewStringObj(Ns_SetKey(handle->row, i), -1));
+            }
+        }
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
+    }
+
+    case CPrepareIdx:
+        /* == [ns_mysql prepare $db sql] == */
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Prepare(interp, Tcl_GetString(objv[3]), handle);
+
+    case CExecIdx: {
+        /* == [ns_mysql exec $db sql ?-bind values?] == */
+        Tcl_Obj       **valueObjs = NULL;
+        int             nvalues = 0;
+
+        if (objc != 4 && (objc != 6
+                          || !STREQ(Tcl_GetString(objv[4]), "-bind"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql ?-bind values?");
+            return TCL_ERROR;
+        }
+        if (objc == 6 && Tcl_ListObjGetElements(interp, objv[5], &nvalues,
+                                                &valueObjs) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_ExecBind(interp, Tcl_GetString(objv[3]), objc == 6,
+                                 nvalues, valueObjs, handle);
+    }
+
+    case CExecuteIdx:
+        /* == [ns_mysql execute $db sql ?value ...?] == */
+        if (objc < 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql ?value ...?");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Execute(interp, Tcl_GetString(objv[3]), objc - 4,
+                                objv + 4, handle);
+
+    case CPrimaryIdx:
+        /* == [ns_mysql primary $db ?boolean?] == */
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?boolean?");
+            return TCL_ERROR;
+        }
+        if (objc == 4 && Tcl_GetBooleanFromObj(interp, objv[3],
+                                               &ctx->force_primary) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(ctx->force_primary));
+        return TCL_OK;
+
+    case CReplicasIdx: {
+        /* == [ns_mysql replicas $db] == */
+        MySQLPool      *pool = ctx->pool;
+        Tcl_Obj        *replicaObj;
+        int             i;
+
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+        resultObj = Tcl_NewListObj(0, NULL);
+        Ns_MutexLock(&poolLock);
+        for (i = 0; i < pool->nreplicas; i++) {
+            replicaObj = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewStringObj("datasource", -1));
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewStringObj(pool->replicas[i].datasource, -1));
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewStringObj("up", -1));
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewBooleanObj(pool->replicas[i].up));
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewStringObj("lag", -1));
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewLongObj(pool->replicas[i].lag));
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewStringObj("checked", -1));
+            Tcl_ListObjAppendElement(NULL, replicaObj,
+                Tcl_NewLongObj((long) pool->replicas[i].checked));
+            AppendCount(replicaObj, "queries", pool->replicas[i].queries);
+            Tcl_ListObjAppendElement(NULL, resultObj, replicaObj);
+        }
+        Ns_MutexUnlock(&poolLock);
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
+    }
+
+    case CSendIdx:
+        /* == [ns_mysql send $db sql] == */
+        if (objc != 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle sql");
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Send(interp, Tcl_GetString(objv[3]), handle);
+
+    case CShardIdx: {
+        /* == [ns_mysql shard $db ?key|-none?] == */
+        int             shard;
+
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?key|-none?");
+            return TCL_ERROR;
+        }
+        if (objc == 4) {
+            if (ctx->pool->nshards == 0) {
+                Tcl_AppendResult(interp, "pool \"", ctx->pool->name,
+                    "\" has no shards", NULL);
+                return TCL_ERROR;
+            }
+            if (STREQ(Tcl_GetString(objv[3]), "-none")) {
+                shard = -1;
+            } else if ((shard = ShardOf(ctx->pool, objv[3])) < 0) {
+                Tcl_AppendResult(interp, "expected integer shard key but got \"",
+                    Tcl_GetString(objv[3]), "\"", NULL);
+                return TCL_ERROR;
+            }
+            if (UseShard(handle, shard) != NS_OK) {
+                Tcl_AppendResult(interp, "cannot connect to shard ",
+                    ctx->pool->shards[shard], ": ",
+                    Ns_DStringValue(&handle->dsExceptionMsg), NULL);
+                return TCL_ERROR;
+            }
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(ctx->shard));
+        return TCL_OK;
+    }
+
+    case CScatterIdx: {
+        /* == [ns_mysql scatter $db sql ?-format lists|dicts|columns?] == */
+        int             format = FORMAT_LISTS;
+
+        if (objc != 4 && (objc != 6
+                          || !STREQ(Tcl_GetString(objv[4]), "-format"))) {
+            Tcl_WrongNumArgs(interp, 2, objv,
+                "handle sql ?-format lists|dicts|columns?");
+            return TCL_ERROR;
+        }
+        if (objc == 6 && Tcl_GetIndexFromObj(interp, objv[5], formats,
+                                             "format", 0, &format) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        return Ns_MySQL_Scatter(interp, Tcl_GetString(objv[3]), format,
+                                handle);
+    }
+
+    case CStatsIdx: {
+        /* == [ns_mysql stats $db ?-reset?] == */
+        MySQLStats     *stats = &ctx->pool->stats;
+
+        if (objc > 4 || (objc == 4 && !STREQ(Tcl_GetString(objv[3]), "-reset"))) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?-reset?");
+            return TCL_ERROR;
+        }
+        resultObj = Tcl_NewListObj(0, NULL);
+        AppendCount(resultObj, "queries", stats->queries);
+        AppendCount(resultObj, "errors", stats->errors);
+        AppendCount(resultObj, "slow", stats->slow);
+        AppendCount(resultObj, "timeouts", stats->timeouts);
+        AppendCount(resultObj, "skipped", stats->skipped);
+        AppendCount(resultObj, "resets", stats->resets);
+        AppendCount(resultObj, "rows", stats->rows);
+        AppendCount(resultObj, "bytes", stats->bytes);
+        HistAppend(resultObj, "query", &stats->query);
+        HistAppend(resultObj, "fetch", &stats->fetch);
+        if (objc == 4) {
+            memset(stats, 0, sizeof(MySQLStats));
+        }
+        Tcl_SetObjResult(interp, resultObj);
+        return TCL_OK;
+    }
+
+    case CTimeoutIdx:
+        /* == [ns_mysql timeout $db ?ms?] == */
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?ms?");
+            return TCL_ERROR;
+        }
+        if (objc == 4) {
+            int             ms;
+
+            if (Tcl_GetIntFromObj(interp, objv[3], &ms) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            ctx->timeout = ms < 0 ? 0 : ms;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(ctx->timeout));
+        return TCL_OK;
+
+    case CStreamingIdx:
+        /* == [ns_mysql streaming $db ?boolean?] == */
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?boolean?");
+            return TCL_ERROR;
+        }
+        if (objc == 4 && Tcl_GetBooleanFromObj(interp, objv[3],
+                                               &ctx->streaming) != TCL_OK) {
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewBooleanObj(ctx->streaming));
+        return TCL_OK;
+
+    case CMaxBufferedBytesIdx:
+        /* == [ns_mysql maxbufferedbytes $db ?bytes?] == */
+        if (objc > 4) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle ?bytes?");
+            return TCL_ERROR;
+        }
+        if (objc == 4) {
+            int             bytes;
+
+            if (Tcl_GetIntFromObj(interp, objv[3], &bytes) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            ctx->max_buffered = bytes < 0 ? 0 : bytes;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewIntObj(ctx->max_buffered));
+        return TCL_OK;
+
+    case CVersionIdx:
+        /* == [ns_mysql version $db] == */
+        if (objc != 3) {
+            Tcl_WrongNumArgs(interp, 2, objv, "handle");
+            return TCL_ERROR;
+        }
+        Tcl_SetObjResult(interp, Tcl_NewStringObj(mysql_driver_version, -1));
+        return TCL_OK;
+    }
+    
+    return TCL_OK;
+}
+
+
+static int
+Ns_MySQLInterpInit(Tcl_Interp *interp, void *ignored)
+{
+    Tcl_CreateObjCommand(interp, "ns_mysql", Ns_MySQL_Cmd, NULL, NULL);
+
+    return NS_OK;
+}
+
+
+/*
+ * Ns_MySQL_ServerInit - Install the ns_mysql command and register the
+ * prewarm, keepalive and replica check tasks of this server's pools
+ * that use the driver.
+ */
+
+static int
+Ns_MySQL_ServerInit(char *hServer, char *hModule, char *hDriver)
+{
+    MySQLPool      *pool;
+    char           *pools, *path, *driver;
+
+    pools = Ns_DbPoolList(hServer);
+    for (; pools != NULL && *pools != '\0'; pools += strlen(pools) + 1) {
+        path = Ns_ConfigGetPath(NULL, NULL, "db", "pool", pools, NULL);
+        driver = path == NULL ? NULL : Ns_ConfigGetValue(path, "driver");
+        if (driver == NULL || !STREQ(driver, hDriver)) {
+            continue;
+        }
+
+        pool = GetPool(pools);
+
+        /* Pools can be shared by several servers. */
+        Ns_MutexLock(&poolLock);
+        if (pool->scheduled) {
+            Ns_MutexUnlock(&poolLock);
+            continue;
+        }
+        pool->scheduled = NS_TRUE;
+        Ns_MutexUnlock(&poolLock);
+
+        if (pool->prewarm) {
+            Ns_RegisterAtStartup(PrewarmPool, pool);
+        }
+        if (pool->keepalive > 0) {
+            Ns_ScheduleProc(KeepalivePool, pool, 1, pool->keepalive);
+        }
+        if (pool->nreplicas > 0) {
+            PoolHandle(pool, &pool->checker);
+            Ns_ScheduleProc(CheckPool, pool, 1, pool->replica_check);
+        }
+    }
+
+    return Ns_TclInitInterps(hServer, Ns_MySQLInterpInit, NULL);
+}
+
+
+static void
+Log(Ns_DbHandle *handle, MYSQL *mysql)
+{
+    Ns_LogSeverity  severity = Error;
+    unsigned int    nErr;
+    char            msg[MAX_ERROR_MSG + 1];
+
+    nErr = mysql_errno(mysql);
+    if (nErr) {
+        strncpy(msg, mysql_error(mysql), MAX_ERROR_MSG);
+        Ns_Log(severity, "MySQL log message: (%u) '%s'", nErr, msg);
+
+        if (handle != NULL) {
+            sprintf(handle->cExceptionCode, "%u", nErr);
+            Ns_DStringFree(&(handle->dsExceptionMsg));
+            Ns_DStringAppend(&(handle->dsExceptionMsg), msg);
+        }
+    }
+}
+
+static void
+StmtLog(Ns_DbHandle *handle, MYSQL_STMT *stmt)
+{
+    unsigned int    nErr;
+    char            msg[MAX_ERROR_MSG + 1];
+
+    nErr = mysql_stmt_errno(stmt);
+    if (nErr) {
+        strncpy(msg, mysql_stmt_error(stmt), MAX_ERROR_MSG);
+        msg[MAX_ERROR_MSG] = '\0';
+        Ns_Log(Error, "MySQL log message: (%u) '%s'", nErr, msg);
+
+        if (handle != NULL) {
+            snprintf(handle->cExceptionCode, sizeof(handle->cExceptionCode),
+                "%u", nErr);
             Ns_DStringFree(&(handle->dsExceptionMsg));
             Ns_DStringAppend(&(handle->dsExceptionMsg), msg);
         }